@@ -0,0 +1,1027 @@
+#include "definitions.hpp"
+#include "denoise.hpp"
+#include "kernels.hpp"
+#include "memory.hpp"
+#include "random.hpp"
+#include "ray_sort.hpp"
+#include "render.hpp"
+#include "scene_cache.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+struct Options
+{
+    std::vector<std::string_view> scenes;
+    int image_width {256};
+    int image_height {256};
+    int frames {4};
+    int bounces {4};
+    Vertex_format vertex_format {Vertex_format::full};
+    u32 thread_count {0};
+    std::optional<Isa> isa;
+};
+
+// One line of JSON per measurement, so that the output can be diffed and
+// parsed by scripts
+struct Measurement
+{
+    std::string_view scene;
+    std::size_t triangle_count;
+    std::string_view benchmark;
+    std::string_view variant;
+    std::string_view unit;
+    f64 count;
+    f64 seconds;
+    // Only measured for some single-threaded kernels, when available
+    std::optional<f64> cache_misses {};
+};
+
+void print(const Measurement &measurement)
+{
+    std::cout << "{\"scene\":\"" << measurement.scene << "\",\"triangles\":"
+              << measurement.triangle_count << ",\"benchmark\":\""
+              << measurement.benchmark << "\",\"variant\":\""
+              << measurement.variant << "\",\"unit\":\"" << measurement.unit
+              << "\",\"count\":" << measurement.count
+              << ",\"seconds\":" << measurement.seconds
+              << ",\"millions_per_second\":"
+              << measurement.count / measurement.seconds * 1e-6;
+    if (measurement.cache_misses.has_value())
+    {
+        std::cout << ",\"cache_misses\":" << *measurement.cache_misses;
+    }
+    std::cout << "}\n";
+}
+
+// Counts the cache misses (of the last level cache on most CPUs) of the calling
+// thread with the Linux performance counters, when the kernel and the hardware
+// expose them
+class Cache_miss_counter
+{
+public:
+    Cache_miss_counter()
+    {
+#if defined(__linux__)
+        perf_event_attr attributes {};
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        m_fd = static_cast<int>(
+            syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#endif
+    }
+
+    ~Cache_miss_counter()
+    {
+#if defined(__linux__)
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+#endif
+    }
+
+    Cache_miss_counter(const Cache_miss_counter &) = delete;
+    Cache_miss_counter(Cache_miss_counter &&) = delete;
+    Cache_miss_counter &operator=(const Cache_miss_counter &) = delete;
+    Cache_miss_counter &operator=(Cache_miss_counter &&) = delete;
+
+    void start()
+    {
+#if defined(__linux__)
+        if (m_fd >= 0)
+        {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Returns the misses since start(), or nothing without a counter
+    [[nodiscard]] std::optional<f64> stop()
+    {
+#if defined(__linux__)
+        if (m_fd >= 0)
+        {
+            ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+            u64 count {};
+            if (read(m_fd, &count, sizeof(count)) ==
+                static_cast<ssize_t>(sizeof(count)))
+            {
+                return static_cast<f64>(count);
+            }
+        }
+#endif
+        return std::nullopt;
+    }
+
+private:
+    int m_fd {-1};
+};
+
+template <typename F>
+[[nodiscard]] f64 time_seconds(F &&f)
+{
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<f64>(std::chrono::steady_clock::now() -
+                                      start)
+        .count();
+}
+
+void print_usage(const char *program)
+{
+    std::cerr
+        << "Usage: " << program << " [options]\n"
+        << "\n"
+        << "Measures the tracing and rendering kernels, printing one JSON\n"
+        << "object per line\n"
+        << "\n"
+        << "Options:\n"
+        << "  --scene <name>      scene to measure, can be repeated (default\n"
+        << "                      cornell_box, sphere_16, sphere_128,\n"
+        << "                      sphere_512, sphere_1024 and\n"
+        << "                      instances_16), or a .obj or binary .ply\n"
+        << "                      file\n"
+        << "  --width <pixels>    image width (default 256)\n"
+        << "  --height <pixels>   image height (default 256)\n"
+        << "  --frames <count>    frames rendered per sample type (default 4)\n"
+        << "  --bounces <count>   measured diffuse bounces (default 4)\n"
+        << "  --vertices <format> full (default) or quantized\n"
+        << "  --threads <count>   render threads, 0 for all (default 0)\n"
+        << "  --isa <name>        kernels to use: sse4_2, avx2 or avx512\n"
+        << "                      (default the newest that the CPU\n"
+        << "                      supports)\n";
+}
+
+template <typename T>
+[[nodiscard]] bool parse_integer(std::string_view text, T &value)
+{
+    const auto *const last = text.data() + text.size();
+    const auto [ptr, ec] = std::from_chars(text.data(), last, value);
+    return ec == std::errc {} && ptr == last;
+}
+
+[[nodiscard]] std::optional<Options> parse_arguments(int argc, char *argv[])
+{
+    Options options {};
+    for (int i {1}; i < argc; ++i)
+    {
+        const std::string_view argument {argv[i]};
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for \"" << argument << "\"\n";
+            return std::nullopt;
+        }
+        const std::string_view value {argv[++i]};
+        bool valid {true};
+        if (argument == "--scene")
+        {
+            options.scenes.push_back(value);
+        }
+        else if (argument == "--width")
+        {
+            valid = parse_integer(value, options.image_width) &&
+                    options.image_width > 0;
+        }
+        else if (argument == "--height")
+        {
+            valid = parse_integer(value, options.image_height) &&
+                    options.image_height > 0;
+        }
+        else if (argument == "--frames")
+        {
+            valid = parse_integer(value, options.frames) && options.frames > 0;
+        }
+        else if (argument == "--bounces")
+        {
+            valid = parse_integer(value, options.bounces) && options.bounces >= 0;
+        }
+        else if (argument == "--vertices")
+        {
+            valid = false;
+            for (std::size_t f {}; f < std::size(vertex_format_names); ++f)
+            {
+                if (value == vertex_format_names[f])
+                {
+                    options.vertex_format = static_cast<Vertex_format>(f);
+                    valid = true;
+                }
+            }
+        }
+        else if (argument == "--threads")
+        {
+            valid = parse_integer(value, options.thread_count);
+        }
+        else if (argument == "--isa")
+        {
+            valid = false;
+            for (std::size_t t {}; t < std::size(isa_names); ++t)
+            {
+                if (value == isa_names[t])
+                {
+                    options.isa = static_cast<Isa>(t);
+                    valid = true;
+                }
+            }
+        }
+        else
+        {
+            std::cerr << "Unknown option \"" << argument << "\"\n";
+            return std::nullopt;
+        }
+        if (!valid)
+        {
+            std::cerr << "Invalid value \"" << value << "\" for \"" << argument
+                      << "\"\n";
+            return std::nullopt;
+        }
+    }
+    if (options.scenes.empty())
+    {
+        options.scenes = {"cornell_box",
+                          "sphere_16",
+                          "sphere_128",
+                          "sphere_512",
+                          "sphere_1024",
+                          "instances_16"};
+    }
+    return options;
+}
+
+[[nodiscard]] std::vector<Ray>
+generate_primary_rays(const Scene &scene, int image_width, int image_height)
+{
+    std::vector<Ray> rays;
+    rays.reserve(static_cast<std::size_t>(image_width) *
+                 static_cast<std::size_t>(image_height));
+    for (int i {}; i < image_height; ++i)
+    {
+        for (int j {}; j < image_width; ++j)
+        {
+            auto sampler =
+                make_sampler(Sampler_type::sobol,
+                             123456789,
+                             static_cast<u32>(i * image_width + j),
+                             0);
+            rays.push_back(generate_ray(
+                scene.camera, i, j, image_width, image_height, sampler));
+        }
+    }
+    return rays;
+}
+
+// Continues every ray that hit a surface with a diffuse bounce, as in the color
+// integrator, which gives increasingly incoherent rays
+[[nodiscard]] std::vector<Ray>
+generate_bounce_rays(const Scene &scene,
+                     const std::vector<Ray> &rays,
+                     const std::vector<Ray_payload> &payloads,
+                     u32 &rng_state)
+{
+    std::vector<Ray> bounce_rays;
+    bounce_rays.reserve(rays.size());
+    for (std::size_t i {}; i < rays.size(); ++i)
+    {
+        if (payloads[i].primitive_id == 0xffffffffu)
+        {
+            continue;
+        }
+        const auto triangle_normal = surface_normal(scene.geometry,
+                                                    payloads[i].instance_id,
+                                                    payloads[i].primitive_id);
+        const auto normal = vec::dot(triangle_normal, rays[i].direction) < 0.0f
+                                ? triangle_normal
+                                : -triangle_normal;
+        bounce_rays.push_back(
+            {.origin = offset_ray_origin(payloads[i].position, normal),
+             .direction = random_cosine_direction(normal, rng_state)});
+    }
+    return bounce_rays;
+}
+
+struct Shadow_ray
+{
+    Ray ray;
+    f32 t_max;
+};
+
+// Connects every hit to a random point on the lights, as in next event
+// estimation
+[[nodiscard]] std::vector<Shadow_ray>
+generate_shadow_rays(const Scene &scene,
+                     const std::vector<Ray> &rays,
+                     const std::vector<Ray_payload> &payloads,
+                     u32 &rng_state)
+{
+    std::vector<Shadow_ray> shadow_rays;
+    const auto &lights = scene.lights;
+    if (lights.triangle_ids.empty())
+    {
+        return shadow_rays;
+    }
+    shadow_rays.reserve(rays.size());
+    for (std::size_t i {}; i < rays.size(); ++i)
+    {
+        if (payloads[i].primitive_id == 0xffffffffu)
+        {
+            continue;
+        }
+        const auto it = std::lower_bound(
+            lights.cdf.begin(), lights.cdf.end(), random(rng_state));
+        const auto light_index =
+            std::min(static_cast<std::size_t>(it - lights.cdf.begin()),
+                     lights.cdf.size() - 1);
+        const auto sqrt_u = math::sqrt(random(rng_state));
+        const auto v = random(rng_state);
+        const auto point = surface_point(scene.geometry,
+                                         lights.instance_ids[light_index],
+                                         lights.triangle_ids[light_index],
+                                         sqrt_u * (1.0f - v),
+                                         sqrt_u * v);
+        const auto triangle_normal = surface_normal(scene.geometry,
+                                                    payloads[i].instance_id,
+                                                    payloads[i].primitive_id);
+        const auto normal = vec::dot(triangle_normal, rays[i].direction) < 0.0f
+                                ? triangle_normal
+                                : -triangle_normal;
+        const auto origin = offset_ray_origin(payloads[i].position, normal);
+        const auto distance = vec::length(point - origin);
+        if (distance < 1e-6f)
+        {
+            continue;
+        }
+        shadow_rays.push_back(
+            {.ray = {.origin = origin,
+                     .direction = (point - origin) * (1.0f / distance)},
+             .t_max = distance * (1.0f - 1e-4f)});
+    }
+    return shadow_rays;
+}
+
+// Times the BVH builds alone, serially and with the thread pool, and prints the
+// quality of the BVHs of the scene, which determines the cost of the other
+// measurements, and the memory used for tracing. The BVHs are rebuilt from the
+// triangles of the objects, since prepare_scene() releases its input
+void benchmark_build(std::string_view scene_name,
+                     const Scene &scene,
+                     Thread_pool &thread_pool)
+{
+    const auto &objects = scene.geometry.objects;
+    std::vector<std::vector<Triangle>> object_triangles(objects.size());
+    for (std::size_t i {}; i < objects.size(); ++i)
+    {
+        const auto &soa = objects[i].triangles;
+        auto &triangles = object_triangles[i];
+        triangles.reserve(soa.indices.size());
+        for (u32 j {}; j < soa.indices.size(); ++j)
+        {
+            const auto indices = soa.indices[j];
+            triangles.push_back(
+                {.vertex0 = vertex_position(soa, indices.x),
+                 .vertex1 = vertex_position(soa, indices.y),
+                 .vertex2 = vertex_position(soa, indices.z),
+                 .material_id = soa.material_id[j]});
+        }
+    }
+
+    Thread_pool serial_thread_pool {1};
+    const std::pair<std::string_view, Thread_pool *> variants[] {
+        {"serial", &serial_thread_pool}, {"parallel", &thread_pool}};
+    for (const auto &[variant, pool] : variants)
+    {
+        // Building reorders the triangles
+        auto triangles = object_triangles;
+        std::vector<Bvh> bvhs;
+        bvhs.reserve(triangles.size());
+        const auto seconds = time_seconds(
+            [&]
+            {
+                for (auto &object : triangles)
+                {
+                    bvhs.push_back(build_bvh(object, *pool));
+                }
+            });
+        print({.scene = scene_name,
+               .triangle_count = triangle_count(scene),
+               .benchmark = "build",
+               .variant = variant,
+               .unit = "triangles",
+               .count = static_cast<f64>(triangle_count(scene)),
+               .seconds = seconds});
+    }
+
+    const auto &geometry = scene.geometry;
+    const auto print_bvh_stats = [&](const Bvh &bvh, const std::string &level)
+    {
+        const auto stats = compute_bvh_stats(bvh);
+        std::cout << "{\"scene\":\"" << scene_name
+                  << "\",\"triangles\":" << triangle_count(scene)
+                  << ",\"benchmark\":\"bvh\",\"level\":\"" << level
+                  << "\",\"nodes\":" << stats.node_count
+                  << ",\"leaves\":" << stats.leaf_count
+                  << ",\"wide_nodes\":" << stats.wide_node_count
+                  << ",\"max_depth\":" << stats.max_depth
+                  << ",\"max_leaf_size\":" << stats.max_leaf_size
+                  << ",\"average_leaf_size\":" << stats.average_leaf_size
+                  << ",\"sah_cost\":" << stats.sah_cost << "}\n";
+    };
+    for (std::size_t i {}; i < geometry.objects.size(); ++i)
+    {
+        if (!geometry.objects[i].bvh.nodes.empty())
+        {
+            print_bvh_stats(geometry.objects[i].bvh,
+                            "object_" + std::to_string(i));
+        }
+    }
+    // Leaves of the instance BVH reference instances rather than triangles
+    print_bvh_stats(geometry.bvh, "instances");
+
+    const auto bytes = [](const auto &buffer)
+    { return buffer.size() * sizeof(*buffer.data()); };
+    std::size_t instanced_triangle_count {};
+    for (const auto &instance : geometry.instances)
+    {
+        instanced_triangle_count +=
+            geometry.objects[instance.object_id].triangles.indices.size();
+    }
+    std::size_t vertex_count {};
+    std::size_t vertex_bytes {};
+    std::size_t triangle_bytes {};
+    std::size_t bvh_bytes {};
+    for (const auto &object : geometry.objects)
+    {
+        const auto &soa = object.triangles;
+        vertex_count += soa.vertices.size() + soa.quantized_vertices.size();
+        vertex_bytes += bytes(soa.vertices) + bytes(soa.quantized_vertices);
+        triangle_bytes +=
+            bytes(soa.indices) + bytes(soa.normal) + bytes(soa.material_id);
+        bvh_bytes += bytes(object.bvh.nodes) + bytes(object.bvh.wide_nodes);
+    }
+    std::cout << "{\"scene\":\"" << scene_name
+              << "\",\"triangles\":" << triangle_count(scene)
+              << ",\"benchmark\":\"memory\",\"vertices\":" << vertex_count
+              << ",\"vertex_bytes\":" << vertex_bytes
+              << ",\"triangle_bytes\":" << triangle_bytes
+              << ",\"bvh_bytes\":" << bvh_bytes
+              << ",\"instances\":" << geometry.instances.size()
+              << ",\"instanced_triangles\":" << instanced_triangle_count
+              << ",\"instance_bytes\":"
+              << bytes(geometry.instances) + bytes(geometry.bvh.nodes) +
+                     bytes(geometry.bvh.wide_nodes)
+              << "}\n";
+}
+
+// Times writing the scene to a cache file and loading it back, which only
+// maps the file
+void benchmark_cache(std::string_view scene_name, const Scene &scene)
+{
+    const auto path = std::filesystem::temp_directory_path() /
+                      "path_tracer_benchmark.scene";
+    bool saved {};
+    const auto save_seconds =
+        time_seconds([&] { saved = save_scene_cache(scene, path); });
+    if (!saved)
+    {
+        std::cerr << "Failed to write scene cache " << path << '\n';
+        return;
+    }
+    const auto load_start = std::chrono::steady_clock::now();
+    auto cached_scene = load_scene_cache(path);
+    const auto load_seconds =
+        std::chrono::duration<f64>(std::chrono::steady_clock::now() -
+                                   load_start)
+            .count();
+    std::error_code error {};
+    if (!cached_scene.has_value())
+    {
+        std::cerr << "Failed to load scene cache " << path << '\n';
+        std::filesystem::remove(path, error);
+        return;
+    }
+    const std::pair<std::string_view, f64> variants[] {
+        {"cache_save", save_seconds}, {"cache", load_seconds}};
+    for (const auto &[variant, seconds] : variants)
+    {
+        print({.scene = scene_name,
+               .triangle_count = triangle_count(scene),
+               .benchmark = "load",
+               .variant = variant,
+               .unit = "triangles",
+               .count = static_cast<f64>(triangle_count(scene)),
+               .seconds = seconds});
+    }
+    cached_scene.reset();
+    std::filesystem::remove(path, error);
+}
+
+// Returns false if occluded() disagrees with intersect() on a shadow ray
+[[nodiscard]] bool benchmark_intersect(std::string_view scene_name,
+                                       const Scene &scene,
+                                       const Options &options,
+                                       Thread_pool &thread_pool)
+{
+    auto rays = generate_primary_rays(
+        scene, options.image_width, options.image_height);
+    std::vector<Ray_payload> payloads(rays.size());
+
+    const auto seconds = time_seconds(
+        [&]
+        {
+            for (std::size_t i {}; i < rays.size(); ++i)
+            {
+                payloads[i] = intersect(rays[i], scene.geometry);
+            }
+        });
+    print({.scene = scene_name,
+           .triangle_count = triangle_count(scene),
+           .benchmark = "intersect",
+           .variant = "primary_scalar",
+           .unit = "rays",
+           .count = static_cast<f64>(rays.size()),
+           .seconds = seconds});
+
+    const auto packet_count = rays.size() / 8;
+    std::vector<Ray_payload> packet_payloads(packet_count * 8);
+    const auto packet_seconds = time_seconds(
+        [&]
+        {
+            for (std::size_t p {}; p < packet_count; ++p)
+            {
+                std::array<Ray, 8> packet_rays {};
+                std::copy_n(rays.begin() + static_cast<std::ptrdiff_t>(p * 8),
+                            8,
+                            packet_rays.begin());
+                const auto packet = make_packet(packet_rays);
+                const auto result = intersect8(packet, scene.geometry);
+                std::copy(result.begin(),
+                          result.end(),
+                          packet_payloads.begin() +
+                              static_cast<std::ptrdiff_t>(p * 8));
+            }
+        });
+    print({.scene = scene_name,
+           .triangle_count = triangle_count(scene),
+           .benchmark = "intersect",
+           .variant = "primary_packet8",
+           .unit = "rays",
+           .count = static_cast<f64>(packet_count * 8),
+           .seconds = packet_seconds});
+
+    u32 rng_state {987654321};
+
+    // Shadow rays towards the lights, traced as closest-hit and any-hit queries
+    const auto shadow_rays =
+        generate_shadow_rays(scene, rays, payloads, rng_state);
+    if (!shadow_rays.empty())
+    {
+        // Both queries must agree on every ray
+        std::vector<u8> closest_hit_occluded(shadow_rays.size());
+        std::vector<u8> any_hit_occluded(shadow_rays.size());
+        const auto closest_seconds = time_seconds(
+            [&]
+            {
+                for (std::size_t i {}; i < shadow_rays.size(); ++i)
+                {
+                    const auto &shadow_ray = shadow_rays[i];
+                    const auto payload =
+                        intersect(shadow_ray.ray, scene.geometry);
+                    closest_hit_occluded[i] =
+                        payload.primitive_id != 0xffffffffu &&
+                        vec::length(payload.position - shadow_ray.ray.origin) <
+                            shadow_ray.t_max;
+                }
+            });
+        const auto any_seconds = time_seconds(
+            [&]
+            {
+                for (std::size_t i {}; i < shadow_rays.size(); ++i)
+                {
+                    const auto &shadow_ray = shadow_rays[i];
+                    any_hit_occluded[i] = occluded(
+                        shadow_ray.ray, shadow_ray.t_max, scene.geometry);
+                }
+            });
+        std::size_t mismatch_count {};
+        for (std::size_t i {}; i < shadow_rays.size(); ++i)
+        {
+            mismatch_count += closest_hit_occluded[i] != any_hit_occluded[i];
+        }
+        if (mismatch_count != 0)
+        {
+            std::cerr << "occluded() disagrees with intersect() on "
+                      << mismatch_count << " of " << shadow_rays.size()
+                      << " shadow rays\n";
+            return false;
+        }
+        for (const auto &[variant, shadow_seconds] :
+             {std::pair {"shadow_closest_hit", closest_seconds},
+              std::pair {"shadow_any_hit", any_seconds}})
+        {
+            print({.scene = scene_name,
+                   .triangle_count = triangle_count(scene),
+                   .benchmark = "intersect",
+                   .variant = variant,
+                   .unit = "rays",
+                   .count = static_cast<f64>(shadow_rays.size()),
+                   .seconds = shadow_seconds});
+        }
+    }
+
+    Cache_miss_counter cache_miss_counter;
+    const auto trace_bounce =
+        [&](const std::vector<Ray> &bounce_rays, std::string_view variant)
+    {
+        cache_miss_counter.start();
+        const auto bounce_seconds = time_seconds(
+            [&]
+            {
+                for (std::size_t i {}; i < bounce_rays.size(); ++i)
+                {
+                    payloads[i] = intersect(bounce_rays[i], scene.geometry);
+                }
+            });
+        const auto cache_misses = cache_miss_counter.stop();
+        print({.scene = scene_name,
+               .triangle_count = triangle_count(scene),
+               .benchmark = "intersect",
+               .variant = variant,
+               .unit = "rays",
+               .count = static_cast<f64>(bounce_rays.size()),
+               .seconds = bounce_seconds,
+               .cache_misses = cache_misses});
+    };
+
+    const auto &root = scene.geometry.bvh.nodes.front();
+    for (int bounce {1}; bounce <= options.bounces; ++bounce)
+    {
+        rays = generate_bounce_rays(scene, rays, payloads, rng_state);
+        if (rays.empty())
+        {
+            break;
+        }
+        payloads.resize(rays.size());
+        const auto variant = "bounce_" + std::to_string(bounce);
+
+        // The same rays ordered by ray_sort_key(), as in the wavefront
+        // integrator, with the cost of sorting measured separately
+        std::vector<Ray> sorted_rays(rays.size());
+        const auto sort_seconds = time_seconds(
+            [&]
+            {
+                std::vector<u32> keys(rays.size());
+                for (std::size_t i {}; i < rays.size(); ++i)
+                {
+                    keys[i] =
+                        ray_sort_key(rays[i], root.aabb_min, root.aabb_max);
+                }
+                const auto order = sort_keys(keys, thread_pool);
+                for (std::size_t i {}; i < rays.size(); ++i)
+                {
+                    sorted_rays[i] = rays[order[i]];
+                }
+            });
+        print({.scene = scene_name,
+               .triangle_count = triangle_count(scene),
+               .benchmark = "intersect",
+               .variant = variant + "_sort",
+               .unit = "rays",
+               .count = static_cast<f64>(rays.size()),
+               .seconds = sort_seconds});
+
+        // Sorted first, so that the payloads of the next bounce are those of
+        // rays in their original order
+        trace_bounce(sorted_rays, variant + "_sorted");
+        trace_bounce(rays, variant);
+    }
+    return true;
+}
+
+// Cosine-weighted hemisphere sampling around random normals, from precomputed
+// uniform numbers so that only the sampler is measured
+void benchmark_sampling(const Options &options)
+{
+    constexpr std::size_t sample_count {1 << 12};
+    Aligned_vector<f32> normals[3];
+    Aligned_vector<f32> uniforms[2];
+    u32 rng_state {123456789};
+    for (std::size_t i {}; i < sample_count; ++i)
+    {
+        const auto normal = vec::normalize(f32v3 {random(rng_state) - 0.5f,
+                                                  random(rng_state) - 0.5f,
+                                                  random(rng_state) - 0.5f});
+        normals[0].push_back(normal.x);
+        normals[1].push_back(normal.y);
+        normals[2].push_back(normal.z);
+        uniforms[0].push_back(random(rng_state));
+        uniforms[1].push_back(random(rng_state));
+    }
+    const auto repetitions = std::max(options.frames, 1) * 64;
+
+    f32v3 scalar_sum {};
+    const auto scalar_seconds = time_seconds(
+        [&]
+        {
+            for (int r {}; r < repetitions; ++r)
+            {
+                for (std::size_t i {}; i < sample_count; ++i)
+                {
+                    scalar_sum += sample_cosine_hemisphere(
+                        f32v3 {normals[0][i], normals[1][i], normals[2][i]},
+                        uniforms[0][i],
+                        uniforms[1][i]);
+                }
+            }
+        });
+
+    vf32v3 packet_sum {};
+    const auto packet_seconds = time_seconds(
+        [&]
+        {
+            for (int r {}; r < repetitions; ++r)
+            {
+                for (std::size_t i {}; i < sample_count; i += 8)
+                {
+                    packet_sum += sample_cosine_hemisphere(
+                        vf32v3 {simd::load_aligned(&normals[0][i]),
+                                simd::load_aligned(&normals[1][i]),
+                                simd::load_aligned(&normals[2][i])},
+                        simd::load_aligned(&uniforms[0][i]),
+                        simd::load_aligned(&uniforms[1][i]));
+                }
+            }
+        });
+
+    // Keeps the directions from being optimized away
+    if (scalar_sum.x + simd::reduce_max(packet_sum.x) > 1e30f)
+    {
+        std::cerr << "Unexpected direction sum\n";
+    }
+
+    // Numbers of the first bounces of every pixel sample
+    constexpr u32 dimension_count {20};
+    const auto pixel_count = static_cast<u32>(options.image_width) *
+                             static_cast<u32>(options.image_height);
+    for (std::size_t t {}; t < std::size(sampler_type_names); ++t)
+    {
+        f32 sum {};
+        const auto seconds = time_seconds(
+            [&]
+            {
+                for (u32 pixel {}; pixel < pixel_count; ++pixel)
+                {
+                    auto sampler = make_sampler(
+                        static_cast<Sampler_type>(t), 1, pixel, 0);
+                    for (u32 d {}; d < dimension_count; ++d)
+                    {
+                        sum += next_1d(sampler);
+                    }
+                }
+            });
+        if (sum < 0.0f)
+        {
+            std::cerr << "Unexpected negative sample\n";
+        }
+        print({.scene = "none",
+               .triangle_count = 0,
+               .benchmark = "sampling",
+               .variant = sampler_type_names[t],
+               .unit = "numbers",
+               .count = static_cast<f64>(pixel_count) *
+                        static_cast<f64>(dimension_count),
+               .seconds = seconds});
+    }
+    for (const auto &[variant, seconds] :
+         {std::pair {"cosine_hemisphere_scalar", scalar_seconds},
+          std::pair {"cosine_hemisphere_packet8", packet_seconds}})
+    {
+        print({.scene = "none",
+               .triangle_count = 0,
+               .benchmark = "sampling",
+               .variant = variant,
+               .unit = "directions",
+               .count = static_cast<f64>(sample_count) *
+                        static_cast<f64>(repetitions),
+               .seconds = seconds});
+    }
+}
+
+void benchmark_sample_pixel(std::string_view scene_name,
+                            const Scene &scene,
+                            const Options &options)
+{
+    for (std::size_t t {}; t < std::size(sample_type_names); ++t)
+    {
+        f32v3 sum {};
+        const auto sample_image = [&]<Sample_type type>()
+        {
+            for (int i {}; i < options.image_height; ++i)
+            {
+                for (int j {}; j < options.image_width; ++j)
+                {
+                    auto sampler = make_sampler(
+                        Sampler_type::sobol,
+                        1,
+                        static_cast<u32>(i * options.image_width + j),
+                        0);
+                    sum += sample_pixel<type>(scene,
+                                              i,
+                                              j,
+                                              options.image_width,
+                                              options.image_height,
+                                              sampler,
+                                              1);
+                }
+            }
+        };
+        const auto seconds = time_seconds(
+            [&]
+            {
+                dispatch_sample_type(static_cast<Sample_type>(t),
+                                     sample_image);
+            });
+        // Keeps the samples from being optimized away
+        if (sum.x < 0.0f)
+        {
+            std::cerr << "Unexpected negative sample\n";
+        }
+        print({.scene = scene_name,
+               .triangle_count = triangle_count(scene),
+               .benchmark = "sample_pixel",
+               .variant = sample_type_names[t],
+               .unit = "samples",
+               .count = static_cast<f64>(options.image_width) *
+                        static_cast<f64>(options.image_height),
+               .seconds = seconds});
+    }
+}
+
+void benchmark_frame(std::string_view scene_name,
+                     const Scene &scene,
+                     const Options &options,
+                     Thread_pool &thread_pool)
+{
+    const auto image_size = static_cast<std::size_t>(options.image_width) *
+                            static_cast<std::size_t>(options.image_height);
+    auto film = make_film(options.image_width, options.image_height);
+    // Without a sample type, all of them are rendered at once
+    const auto run = [&](std::optional<Sample_type> sample_type,
+                         Integrator_type integrator_type,
+                         std::string_view variant)
+    {
+        clear_film(film);
+        const auto seconds = time_seconds(
+            [&]
+            {
+                for (int s {}; s < options.frames; ++s)
+                {
+                    if (sample_type.has_value())
+                    {
+                        accumulate_sample(scene,
+                                          *sample_type,
+                                          Sampler_type::sobol,
+                                          integrator_type,
+                                          1,
+                                          1,
+                                          film,
+                                          thread_pool);
+                    }
+                    else
+                    {
+                        accumulate_sample(scene,
+                                          Sampler_type::sobol,
+                                          integrator_type,
+                                          1,
+                                          1,
+                                          film,
+                                          thread_pool);
+                    }
+                }
+            });
+        print({.scene = scene_name,
+               .triangle_count = triangle_count(scene),
+               .benchmark = "frame",
+               .variant = variant,
+               .unit = "samples",
+               .count = static_cast<f64>(image_size) *
+                        static_cast<f64>(options.frames),
+               .seconds = seconds});
+    };
+    for (std::size_t t {}; t < std::size(sample_type_names); ++t)
+    {
+        run(static_cast<Sample_type>(t),
+            Integrator_type::depth_first,
+            sample_type_names[t]);
+    }
+    // The other sample types are the same with every integrator
+    run(Sample_type::color, Integrator_type::wavefront, "color_wavefront");
+    run(Sample_type::color,
+        Integrator_type::wavefront_sorted,
+        "color_wavefront_sorted");
+    run(std::nullopt, Integrator_type::depth_first, "all");
+    run(std::nullopt, Integrator_type::wavefront, "all_wavefront");
+
+    // The film now has the albedo and normals that guide the denoiser
+    std::vector<f32v3> image(image_size);
+    const std::pair<int, std::string_view> pass_counts[] {
+        {1, "1_pass"}, {3, "3_passes"}, {5, "5_passes"}};
+    for (const auto &[pass_count, variant] : pass_counts)
+    {
+        bool denoised {};
+        const auto seconds = time_seconds(
+            [&] { denoised = denoise(film, pass_count, image, thread_pool); });
+        if (denoised)
+        {
+            print({.scene = scene_name,
+                   .triangle_count = triangle_count(scene),
+                   .benchmark = "denoise",
+                   .variant = variant,
+                   .unit = "pixels",
+                   .count = static_cast<f64>(image_size),
+                   .seconds = seconds});
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    const auto options = parse_arguments(argc, argv);
+    if (!options.has_value())
+    {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (options->isa.has_value() && !select_kernels(*options->isa))
+    {
+        std::cerr << "The CPU does not support "
+                  << isa_names[static_cast<int>(*options->isa)] << '\n';
+        return EXIT_FAILURE;
+    }
+
+    Thread_pool thread_pool {options->thread_count};
+
+    benchmark_sampling(*options);
+
+    for (const auto scene_name : options->scenes)
+    {
+        std::optional<Scene> scene {};
+        const auto load_seconds =
+            time_seconds(
+                [&]
+                {
+                    scene = load_scene(
+                        scene_name, options->vertex_format, thread_pool);
+                });
+        if (!scene.has_value())
+        {
+            std::cerr << "Failed to load scene \"" << scene_name << "\"\n";
+            return EXIT_FAILURE;
+        }
+        print({.scene = scene_name,
+               .triangle_count = triangle_count(*scene),
+               .benchmark = "load",
+               .variant = "total",
+               .unit = "triangles",
+               .count = static_cast<f64>(triangle_count(*scene)),
+               .seconds = load_seconds});
+
+        benchmark_cache(scene_name, *scene);
+        benchmark_build(scene_name, *scene, thread_pool);
+        if (!benchmark_intersect(scene_name, *scene, *options, thread_pool))
+        {
+            return EXIT_FAILURE;
+        }
+        benchmark_sample_pixel(scene_name, *scene, *options);
+        benchmark_frame(scene_name, *scene, *options, thread_pool);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,523 @@
+#include "definitions.hpp"
+#include "denoise.hpp"
+#include "image.hpp"
+#include "kernels.hpp"
+#include "render.hpp"
+#include "scene_cache.hpp"
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wconversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+#pragma GCC diagnostic ignored "-Wnull-dereference"
+#endif
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+
+struct Options
+{
+    std::string_view scene {"cornell_box"};
+    int image_width {256};
+    int image_height {256};
+    int samples {64};
+    f32 error_threshold {0.0f};
+    Sample_type sample_type {Sample_type::color};
+    Sampler_type sampler_type {Sampler_type::sobol};
+    Integrator_type integrator_type {Integrator_type::depth_first};
+    Vertex_format vertex_format {Vertex_format::full};
+    u32 thread_count {0};
+    u32 seed {1};
+    // The newest instruction set of the CPU if not given
+    std::optional<Isa> isa;
+    std::string_view save_scene;
+    // With a prefix, every sample type is rendered
+    std::string_view aov_prefix;
+    // Passes of the denoiser applied to the color, 0 to disable it
+    int denoise_passes {0};
+    std::string_view output;
+};
+
+void print_usage(const char *program)
+{
+    std::cerr
+        << "Usage: " << program << " [options] <output>\n"
+        << "\n"
+        << "Renders a scene without a window and writes it to <output>, as\n"
+        << "8-bit sRGB for .png, or as linear floats for .hdr and .pfm.\n"
+        << "<output> can be omitted with --save-scene\n"
+        << "\n"
+        << "Options:\n"
+        << "  --scene <name>      cornell_box (default), sphere_<n> for a\n"
+        << "                      sphere of about 4n^2 triangles,\n"
+        << "                      instances_<n> for n^2 instanced spheres,\n"
+        << "                      or a .obj, binary .ply or .scene file\n"
+        << "  --save-scene <file> write the loaded scene, with its BVHs, to a\n"
+        << "                      .scene file, which loads without parsing\n"
+        << "                      or building\n"
+        << "  --width <pixels>    image width (default 256)\n"
+        << "  --height <pixels>   image height (default 256)\n"
+        << "  --samples <count>   samples per pixel (default 64), the\n"
+        << "                      maximum with --error\n"
+        << "  --error <value>     stop sampling the tiles whose relative\n"
+        << "                      error is below value, and stop once all\n"
+        << "                      tiles are (default 0, disabled)\n"
+        << "  --type <type>       color (default), albedo, normal,\n"
+        << "                      barycentric, primitive_id, material_id\n"
+        << "  --sampler <type>    sobol (default), independent\n"
+        << "  --integrator <type> depth_first (default), wavefront,\n"
+        << "                      wavefront_sorted\n"
+        << "  --vertices <format> full (default) for float positions, or\n"
+        << "                      quantized for 16-bit positions on a grid\n"
+        << "                      over every object\n"
+        << "  --threads <count>   render threads, 0 for all (default 0)\n"
+        << "  --seed <value>      random seed (default 1)\n"
+        << "  --isa <name>        kernels to use: sse4_2, avx2 or avx512\n"
+        << "                      (default the newest that the CPU\n"
+        << "                      supports)\n"
+        << "  --aov-prefix <path> render every sample type from the same\n"
+        << "                      camera rays, and also write each one to\n"
+        << "                      <path><type> with the extension of\n"
+        << "                      <output>\n"
+        << "  --denoise <passes>  filter the noise out of the color, guided\n"
+        << "                      by the albedo and normals, with 1 to 5\n"
+        << "                      passes of increasing radius (default 0,\n"
+        << "                      disabled)\n";
+}
+
+template <typename T>
+[[nodiscard]] bool parse_number(std::string_view text, T &value)
+{
+    const auto *const last = text.data() + text.size();
+    const auto [ptr, ec] = std::from_chars(text.data(), last, value);
+    return ec == std::errc {} && ptr == last;
+}
+
+[[nodiscard]] std::optional<Options> parse_arguments(int argc, char *argv[])
+{
+    Options options {};
+    for (int i {1}; i < argc; ++i)
+    {
+        const std::string_view argument {argv[i]};
+        if (!argument.starts_with("--"))
+        {
+            if (!options.output.empty())
+            {
+                std::cerr << "Unexpected argument \"" << argument << "\"\n";
+                return std::nullopt;
+            }
+            options.output = argument;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for \"" << argument << "\"\n";
+            return std::nullopt;
+        }
+        const std::string_view value {argv[++i]};
+        bool valid {true};
+        if (argument == "--scene")
+        {
+            options.scene = value;
+        }
+        else if (argument == "--width")
+        {
+            valid = parse_number(value, options.image_width) &&
+                    options.image_width > 0;
+        }
+        else if (argument == "--height")
+        {
+            valid = parse_number(value, options.image_height) &&
+                    options.image_height > 0;
+        }
+        else if (argument == "--samples")
+        {
+            valid =
+                parse_number(value, options.samples) && options.samples > 0;
+        }
+        else if (argument == "--error")
+        {
+            valid = parse_number(value, options.error_threshold) &&
+                    options.error_threshold >= 0.0f;
+        }
+        else if (argument == "--type")
+        {
+            valid = false;
+            for (std::size_t t {}; t < std::size(sample_type_names); ++t)
+            {
+                if (value == sample_type_names[t])
+                {
+                    options.sample_type = static_cast<Sample_type>(t);
+                    valid = true;
+                }
+            }
+        }
+        else if (argument == "--sampler")
+        {
+            valid = false;
+            for (std::size_t t {}; t < std::size(sampler_type_names); ++t)
+            {
+                if (value == sampler_type_names[t])
+                {
+                    options.sampler_type = static_cast<Sampler_type>(t);
+                    valid = true;
+                }
+            }
+        }
+        else if (argument == "--integrator")
+        {
+            valid = false;
+            for (std::size_t t {}; t < std::size(integrator_type_names); ++t)
+            {
+                if (value == integrator_type_names[t])
+                {
+                    options.integrator_type = static_cast<Integrator_type>(t);
+                    valid = true;
+                }
+            }
+        }
+        else if (argument == "--vertices")
+        {
+            valid = false;
+            for (std::size_t f {}; f < std::size(vertex_format_names); ++f)
+            {
+                if (value == vertex_format_names[f])
+                {
+                    options.vertex_format = static_cast<Vertex_format>(f);
+                    valid = true;
+                }
+            }
+        }
+        else if (argument == "--threads")
+        {
+            valid = parse_number(value, options.thread_count);
+        }
+        else if (argument == "--seed")
+        {
+            valid = parse_number(value, options.seed);
+        }
+        else if (argument == "--isa")
+        {
+            valid = false;
+            for (std::size_t t {}; t < std::size(isa_names); ++t)
+            {
+                if (value == isa_names[t])
+                {
+                    options.isa = static_cast<Isa>(t);
+                    valid = true;
+                }
+            }
+        }
+        else if (argument == "--save-scene")
+        {
+            options.save_scene = value;
+        }
+        else if (argument == "--aov-prefix")
+        {
+            options.aov_prefix = value;
+        }
+        else if (argument == "--denoise")
+        {
+            valid = parse_number(value, options.denoise_passes) &&
+                    options.denoise_passes >= 0 &&
+                    options.denoise_passes <= max_denoise_passes;
+        }
+        else
+        {
+            std::cerr << "Unknown option \"" << argument << "\"\n";
+            return std::nullopt;
+        }
+        if (!valid)
+        {
+            std::cerr << "Invalid value \"" << value << "\" for \"" << argument
+                      << "\"\n";
+            return std::nullopt;
+        }
+    }
+    if (options.output.empty() && options.save_scene.empty())
+    {
+        std::cerr << "No output file given\n";
+        return std::nullopt;
+    }
+    if (options.denoise_passes > 0 &&
+        options.sample_type != Sample_type::color)
+    {
+        std::cerr << "Only the color can be denoised\n";
+        return std::nullopt;
+    }
+    return options;
+}
+
+[[nodiscard]] bool write_pfm(const char *filename,
+                             int image_width,
+                             int image_height,
+                             const std::vector<f32v3> &image)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    // A negative scale means little-endian, and rows are stored bottom to top
+    file << "PF\n" << image_width << ' ' << image_height << "\n-1.0\n";
+    for (auto i = image_height - 1; i >= 0; --i)
+    {
+        file.write(
+            reinterpret_cast<const char *>(
+                image.data() + static_cast<std::size_t>(i) *
+                                   static_cast<std::size_t>(image_width)),
+            static_cast<std::streamsize>(sizeof(f32v3)) * image_width);
+    }
+    return static_cast<bool>(file);
+}
+
+[[nodiscard]] bool write_image(const char *filename,
+                               int image_width,
+                               int image_height,
+                               const std::vector<f32v3> &image)
+{
+    const std::string_view name {filename};
+    if (name.ends_with(".pfm"))
+    {
+        return write_pfm(filename, image_width, image_height, image);
+    }
+    if (name.ends_with(".hdr"))
+    {
+        static_assert(sizeof(f32v3) == 3 * sizeof(f32));
+        return stbi_write_hdr(filename,
+                              image_width,
+                              image_height,
+                              3,
+                              &image.front().x) != 0;
+    }
+    if (name.ends_with(".png"))
+    {
+        static_assert(sizeof(f32v3) == 3 * sizeof(f32));
+        static_assert(sizeof(Pixel) == 3 * sizeof(u8));
+        std::vector<Pixel> pixel_buffer(image.size());
+        linear_to_srgb(
+            &image.front().x, &pixel_buffer.front().r, image.size() * 3);
+        return stbi_write_png(filename,
+                              image_width,
+                              image_height,
+                              3,
+                              pixel_buffer.data(),
+                              image_width * 3) != 0;
+    }
+    std::cerr << "Unsupported image format, expected .png, .hdr or .pfm\n";
+    return false;
+}
+
+[[nodiscard]] f64 seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<f64>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    const auto options = parse_arguments(argc, argv);
+    if (!options.has_value())
+    {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (options->isa.has_value() && !select_kernels(*options->isa))
+    {
+        std::cerr << "The CPU does not support "
+                  << isa_names[static_cast<int>(*options->isa)] << '\n';
+        return EXIT_FAILURE;
+    }
+
+    Thread_pool thread_pool {options->thread_count};
+
+    // Cached scenes keep their vertex format
+    if (options->vertex_format != Vertex_format::full &&
+        options->scene.ends_with(".scene"))
+    {
+        std::cerr << "Cannot change the vertices of a cached scene\n";
+        return EXIT_FAILURE;
+    }
+
+    const auto load_start = std::chrono::steady_clock::now();
+    auto scene =
+        load_scene(options->scene, options->vertex_format, thread_pool);
+    if (!scene.has_value())
+    {
+        std::cerr << "Failed to load scene \"" << options->scene << "\"\n";
+        return EXIT_FAILURE;
+    }
+    const auto load_time = seconds_since(load_start);
+
+    if (!options->save_scene.empty())
+    {
+        if (!save_scene_cache(*scene,
+                              std::filesystem::path {options->save_scene}))
+        {
+            std::cerr << "Failed to write scene \"" << options->save_scene
+                      << "\"\n";
+            return EXIT_FAILURE;
+        }
+        if (options->output.empty())
+        {
+            return EXIT_SUCCESS;
+        }
+    }
+
+    auto film = make_film(options->image_width, options->image_height);
+
+    const auto render_start = std::chrono::steady_clock::now();
+    // The denoiser needs the albedo and normals along with the color
+    const auto all_sample_types =
+        !options->aov_prefix.empty() || options->denoise_passes > 0;
+    while (film.samples < options->samples)
+    {
+        if (all_sample_types)
+        {
+            accumulate_sample(*scene,
+                              options->sampler_type,
+                              options->integrator_type,
+                              options->seed,
+                              options->seed,
+                              film,
+                              thread_pool);
+        }
+        else
+        {
+            accumulate_sample(*scene,
+                              options->sample_type,
+                              options->sampler_type,
+                              options->integrator_type,
+                              options->seed,
+                              options->seed,
+                              film,
+                              thread_pool);
+        }
+        if (options->error_threshold > 0.0f &&
+            update_active_tiles(film,
+                                options->error_threshold,
+                                adaptive_min_samples) == 0)
+        {
+            break;
+        }
+    }
+    const auto render_time = seconds_since(render_start);
+
+    // Receives the denoised color, if any, then every plane that is written
+    std::vector<f32v3> image(film.sample_counts.size());
+
+    const auto denoise_start = std::chrono::steady_clock::now();
+    if (options->denoise_passes > 0 &&
+        !denoise(film, options->denoise_passes, image, thread_pool))
+    {
+        std::cerr << "Failed to denoise the image\n";
+        return EXIT_FAILURE;
+    }
+    const auto denoise_time = seconds_since(denoise_start);
+
+    const auto write = [&](const std::vector<f32v3> &pixels,
+                           const std::string &filename)
+    {
+        if (!write_image(filename.c_str(),
+                         options->image_width,
+                         options->image_height,
+                         pixels))
+        {
+            std::cerr << "Failed to write image \"" << filename << "\"\n";
+            return false;
+        }
+        return true;
+    };
+    const auto write_plane = [&](Sample_type sample_type,
+                                 const std::string &filename)
+    {
+        for (std::size_t i {}; i < image.size(); ++i)
+        {
+            image[i] = pixel_color(film, sample_type, i);
+        }
+        return write(image, filename);
+    };
+
+    const auto write_start = std::chrono::steady_clock::now();
+    const auto filename = std::string(options->output);
+    const auto written = options->denoise_passes > 0
+                             ? write(image, filename)
+                             : write_plane(options->sample_type, filename);
+    if (!written)
+    {
+        return EXIT_FAILURE;
+    }
+    if (!options->aov_prefix.empty())
+    {
+        const auto extension =
+            std::filesystem::path {options->output}.extension().string();
+        for (std::size_t t {}; t < sample_type_count; ++t)
+        {
+            if (!write_plane(static_cast<Sample_type>(t),
+                             std::string(options->aov_prefix) +
+                                 sample_type_names[t] + extension))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    const auto write_time = seconds_since(write_start);
+
+    f64 sample_count {};
+    for (const auto count : film.sample_counts)
+    {
+        sample_count += static_cast<f64>(count);
+    }
+    std::size_t vertex_count {};
+    bool quantized {};
+    for (const auto &object : scene->geometry.objects)
+    {
+        const auto &triangles = object.triangles;
+        vertex_count +=
+            triangles.vertices.size() + triangles.quantized_vertices.size();
+        quantized = quantized || !triangles.quantized_vertices.empty();
+    }
+    std::cout << "Scene:   " << triangle_count(*scene) << " triangles, "
+              << vertex_count << (quantized ? " quantized" : "")
+              << " vertices, " << scene->geometry.instances.size()
+              << " instances, " << load_time * 1000.0 << " ms\n"
+              << "Render:  " << options->image_width << 'x'
+              << options->image_height << ", "
+              << sample_count / static_cast<f64>(image.size()) << " spp ("
+              << film.samples << " max), " << thread_pool.thread_count()
+              << " threads, "
+              << isa_names[static_cast<int>(active_kernels().isa)]
+              << " kernels, " << render_time << " s, "
+              << sample_count / render_time * 1e-6
+              << " Msamples/s\n";
+    if (options->denoise_passes > 0)
+    {
+        std::cout << "Denoise: " << options->denoise_passes << " passes, "
+                  << denoise_time * 1000.0 << " ms\n";
+    }
+    std::cout << "Output:  \"" << filename << "\", " << write_time * 1000.0
+              << " ms\n";
+
+    return EXIT_SUCCESS;
+}
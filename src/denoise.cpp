@@ -0,0 +1,181 @@
+#include "denoise.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+
+// Albedo components below this are not divided out of the color, which would
+// amplify its noise
+constexpr f32 min_albedo {1e-3f};
+
+// Rows filtered by one task of a pass
+constexpr int rows_per_task {8};
+
+[[nodiscard]] constexpr f32 luminance(f32v3 color) noexcept
+{
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+// Returns the factor that the color is divided by before filtering, and
+// multiplied by afterwards
+[[nodiscard]] constexpr f32v3 modulation(f32v3 albedo) noexcept
+{
+    return {albedo.x > min_albedo ? albedo.x : 1.0f,
+            albedo.y > min_albedo ? albedo.y : 1.0f,
+            albedo.z > min_albedo ? albedo.z : 1.0f};
+}
+
+} // namespace
+
+bool denoise(const Film &film,
+             int pass_count,
+             std::span<f32v3> image,
+             Thread_pool &thread_pool)
+{
+    const auto &color_plane =
+        film.planes[static_cast<std::size_t>(Sample_type::color)];
+    const auto &albedo_plane =
+        film.planes[static_cast<std::size_t>(Sample_type::albedo)];
+    const auto &normal_plane =
+        film.planes[static_cast<std::size_t>(Sample_type::normal)];
+    if (color_plane.empty() || albedo_plane.empty() || normal_plane.empty())
+    {
+        return false;
+    }
+    pass_count = std::clamp(pass_count, 0, max_denoise_passes);
+
+    const auto width = film.image_width;
+    const auto height = film.image_height;
+    const auto border = static_cast<std::size_t>(denoise_border);
+    const auto padded_width = (width + denoise_row_alignment - 1) /
+                              denoise_row_alignment * denoise_row_alignment;
+    const auto stride = static_cast<std::size_t>(padded_width) + 2 * border;
+    const auto origin = border * stride + border;
+    const auto plane_size =
+        (static_cast<std::size_t>(height) + 2 * border) * stride;
+
+    // Albedo, normal and two signals, the border being zero
+    std::vector<f32> storage(14 * plane_size);
+    const auto plane = [&](std::size_t index)
+    { return storage.data() + index * plane_size; };
+    const Denoise_planes planes {.width = width,
+                                 .height = height,
+                                 .stride = stride,
+                                 .origin = origin,
+                                 .albedo_x = plane(0),
+                                 .albedo_y = plane(1),
+                                 .albedo_z = plane(2),
+                                 .normal_x = plane(3),
+                                 .normal_y = plane(4),
+                                 .normal_z = plane(5)};
+    const Denoise_signal signals[2] {{.x = plane(6),
+                                      .y = plane(7),
+                                      .z = plane(8),
+                                      .variance = plane(9)},
+                                     {.x = plane(10),
+                                      .y = plane(11),
+                                      .z = plane(12),
+                                      .variance = plane(13)}};
+
+    thread_pool.parallel_for(
+        static_cast<u32>(height),
+        [&](u32 i)
+        {
+            for (int j {}; j < width; ++j)
+            {
+                const auto pixel_index =
+                    static_cast<std::size_t>(i) *
+                        static_cast<std::size_t>(width) +
+                    static_cast<std::size_t>(j);
+                const auto count = film.sample_counts[pixel_index];
+                if (count == 0)
+                {
+                    continue;
+                }
+                const auto p = origin + static_cast<std::size_t>(i) * stride +
+                               static_cast<std::size_t>(j);
+                const auto n = static_cast<f32>(count);
+                const auto color = color_plane[pixel_index] / n;
+                const auto albedo = albedo_plane[pixel_index] / n;
+                const auto encoded_normal = normal_plane[pixel_index] / n;
+                plane(0)[p] = albedo.x;
+                plane(1)[p] = albedo.y;
+                plane(2)[p] = albedo.z;
+
+                // Pixels without a surface keep a zero normal, and so their
+                // color
+                const auto normal =
+                    encoded_normal * 2.0f - f32v3 {1.0f, 1.0f, 1.0f};
+                const auto normal_length = vec::length(normal);
+                if (vec::dot(encoded_normal, encoded_normal) > 0.0f &&
+                    normal_length > 1e-3f)
+                {
+                    plane(3)[p] = normal.x / normal_length;
+                    plane(4)[p] = normal.y / normal_length;
+                    plane(5)[p] = normal.z / normal_length;
+                }
+
+                const auto m = modulation(albedo);
+                const auto irradiance = color / m;
+                signals[0].x[p] = irradiance.x;
+                signals[0].y[p] = irradiance.y;
+                signals[0].z[p] = irradiance.z;
+
+                // Variance of the mean luminance, from the sample variance. A
+                // single sample is assumed to be as uncertain as it is bright
+                const auto y = film.luminance_buffer[pixel_index];
+                const auto y_square = film.luminance_square_buffer[pixel_index];
+                const auto variance =
+                    count > 1 ? std::max((y_square - y * y / n) / (n - 1.0f),
+                                         0.0f) /
+                                    n
+                              : y * y;
+                const auto scale = std::max(luminance(m), min_albedo);
+                signals[0].variance[p] = variance / (scale * scale);
+            }
+        });
+
+    const auto task_count =
+        static_cast<u32>((height + rows_per_task - 1) / rows_per_task);
+    for (int pass {}; pass < pass_count; ++pass)
+    {
+        const auto &input = signals[pass % 2];
+        const auto &output = signals[(pass + 1) % 2];
+        thread_pool.parallel_for(
+            task_count,
+            [&](u32 task_index)
+            {
+                const auto row_begin =
+                    static_cast<int>(task_index) * rows_per_task;
+                denoise_rows(planes,
+                             input,
+                             output,
+                             1 << pass,
+                             row_begin,
+                             std::min(row_begin + rows_per_task, height));
+            });
+    }
+
+    const auto &result = signals[pass_count % 2];
+    thread_pool.parallel_for(
+        static_cast<u32>(height),
+        [&](u32 i)
+        {
+            for (int j {}; j < width; ++j)
+            {
+                const auto pixel_index =
+                    static_cast<std::size_t>(i) *
+                        static_cast<std::size_t>(width) +
+                    static_cast<std::size_t>(j);
+                const auto p = origin + static_cast<std::size_t>(i) * stride +
+                               static_cast<std::size_t>(j);
+                const f32v3 albedo {plane(0)[p], plane(1)[p], plane(2)[p]};
+                image[pixel_index] =
+                    f32v3 {result.x[p], result.y[p], result.z[p]} *
+                    modulation(albedo);
+            }
+        });
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef DENOISE_HPP
+#define DENOISE_HPP
+
+#include "definitions.hpp"
+#include "render.hpp"
+#include "thread_pool.hpp"
+#include "vec.hpp"
+
+#include <cstddef>
+#include <span>
+
+// Passes of the filter, each twice as wide as the previous one
+constexpr inline int max_denoise_passes {5};
+
+// Reach of the widest pass in pixels, and the border of the denoised planes
+constexpr inline int denoise_border {2 << (max_denoise_passes - 1)};
+
+// Pixels that the rows of the denoised planes are padded to a multiple of, the
+// widest vector that the passes process
+constexpr inline int denoise_row_alignment {16};
+
+// Color divided by the albedo, and the variance of its luminance, filtered by
+// every pass from one signal into another
+struct Denoise_signal
+{
+    f32 *x;
+    f32 *y;
+    f32 *z;
+    f32 *variance;
+};
+
+// Planes of an image being denoised, stored row by row with a border of
+// denoise_border pixels, whose normals are zero so that they get no weight.
+// The rows are padded to a multiple of denoise_row_alignment pixels, so that
+// passes process whole vectors
+struct Denoise_planes
+{
+    int width;
+    int height;
+    // Floats from a pixel to the one below it
+    std::size_t stride;
+    // Index of pixel (0, 0)
+    std::size_t origin;
+    const f32 *albedo_x;
+    const f32 *albedo_y;
+    const f32 *albedo_z;
+    // Zero for pixels without a surface
+    const f32 *normal_x;
+    const f32 *normal_y;
+    const f32 *normal_z;
+};
+
+// Removes most of the noise from the color of the film, written to image.
+// The color divided by the albedo is smoothed by pass_count passes of an
+// edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering", 2010),
+// then multiplied by the albedo again. Weights drop across edges of the normal
+// and albedo planes, and between pixels whose luminance differs by more than
+// a few standard deviations, estimated from the samples as in SVGF (Schied et
+// al. 2017). Rows are filtered in parallel. Requires the color, albedo and
+// normal planes, e.g. from accumulate_sample() of every sample type, and
+// returns false without them
+[[nodiscard]] bool denoise(const Film &film,
+                           int pass_count,
+                           std::span<f32v3> image,
+                           Thread_pool &thread_pool);
+
+// Filters rows [row_begin, row_end) of input into output, with the pass of
+// the given step between taps
+void denoise_rows(const Denoise_planes &planes,
+                  const Denoise_signal &input,
+                  const Denoise_signal &output,
+                  int step,
+                  int row_begin,
+                  int row_end);
+
+#endif // DENOISE_HPP
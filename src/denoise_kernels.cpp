@@ -0,0 +1,223 @@
+#include "denoise.hpp"
+#include "kernels.hpp"
+
+namespace
+{
+
+// B3 spline, the filter of every pass, applied to taps step pixels apart
+constexpr f32 tap_weights[5] {1.0f / 16.0f,
+                              1.0f / 4.0f,
+                              3.0f / 8.0f,
+                              1.0f / 4.0f,
+                              1.0f / 16.0f};
+
+// 3x3 Gaussian that the variance is blurred with before it scales the
+// luminance weights, indexed by the distance to the center
+constexpr f32 variance_tap_weights[2] {1.0f / 2.0f, 1.0f / 4.0f};
+
+// Luminance differences are measured in luminance_sigma standard deviations,
+// as in SVGF, and albedo differences in albedo_sigma
+constexpr f32 luminance_sigma {4.0f};
+constexpr f32 albedo_sigma {0.1f};
+
+// Pixels are filtered 16 at a time with AVX-512, and 8 at a time otherwise
+#if SIMD_AVX512F
+using Row_vector = vf32x16;
+
+constexpr int row_lanes {16};
+
+[[nodiscard]] FORCE_INLINE Row_vector broadcast_row(f32 a)
+{
+    return simd::broadcast16(a);
+}
+
+[[nodiscard]] FORCE_INLINE Row_vector load_row(const f32 *p)
+{
+    return simd::load_unaligned16(p);
+}
+#else
+using Row_vector = vf32;
+
+constexpr int row_lanes {8};
+
+[[nodiscard]] FORCE_INLINE Row_vector broadcast_row(f32 a)
+{
+    return simd::broadcast(a);
+}
+
+[[nodiscard]] FORCE_INLINE Row_vector load_row(const f32 *p)
+{
+    return simd::load_unaligned(p);
+}
+#endif
+
+static_assert(denoise_row_alignment % row_lanes == 0);
+
+using Row_vector3 = v3<Row_vector>;
+
+[[nodiscard]] FORCE_INLINE Row_vector
+luminance(Row_vector x, Row_vector y, Row_vector z) noexcept
+{
+    return simd::fmadd(
+        broadcast_row(0.2126f),
+        x,
+        simd::fmadd(broadcast_row(0.7152f), y, broadcast_row(0.0722f) * z));
+}
+
+// Approximates exp(-x) for x >= 0 as (1 - x / 256)^256, with a relative error
+// below 1% up to x = 2, where the weights matter
+[[nodiscard]] FORCE_INLINE Row_vector exp_negative(Row_vector x) noexcept
+{
+    auto y = simd::max(
+        simd::fmadd(x, broadcast_row(-1.0f / 256.0f), broadcast_row(1.0f)),
+        broadcast_row(0.0f));
+    for (int i {}; i < 8; ++i)
+    {
+        y *= y;
+    }
+    return y;
+}
+
+// Returns max(c, 0)^128
+[[nodiscard]] FORCE_INLINE Row_vector pow_128(Row_vector c) noexcept
+{
+    auto y = simd::max(c, broadcast_row(0.0f));
+    for (int i {}; i < 7; ++i)
+    {
+        y *= y;
+    }
+    return y;
+}
+
+} // namespace
+
+template <Isa isa>
+void kernels::denoise_rows(const Denoise_planes &planes,
+                           const Denoise_signal &input,
+                           const Denoise_signal &output,
+                           int step,
+                           int row_begin,
+                           int row_end)
+{
+    static_assert(isa == compiled_isa);
+    const auto inverse_albedo_sigma_square =
+        broadcast_row(1.0f / (albedo_sigma * albedo_sigma));
+    for (auto i = row_begin; i < row_end; ++i)
+    {
+        // The lanes past the width read and write the border, whose zero
+        // normals keep them out of the other pixels
+        for (int j {}; j < planes.width; j += row_lanes)
+        {
+            const auto p = planes.origin +
+                           static_cast<std::size_t>(i) * planes.stride +
+                           static_cast<std::size_t>(j);
+            const Row_vector3 albedo_p {load_row(planes.albedo_x + p),
+                                       load_row(planes.albedo_y + p),
+                                       load_row(planes.albedo_z + p)};
+            const Row_vector3 normal_p {load_row(planes.normal_x + p),
+                                       load_row(planes.normal_y + p),
+                                       load_row(planes.normal_z + p)};
+            const Row_vector3 signal_p {load_row(input.x + p),
+                                       load_row(input.y + p),
+                                       load_row(input.z + p)};
+            const auto variance_p = load_row(input.variance + p);
+            const auto luminance_p =
+                luminance(signal_p.x, signal_p.y, signal_p.z);
+
+            // A variance estimated from few samples is often too low in dark
+            // pixels, which would then reject their brighter neighbors and
+            // darken the image
+            auto blurred_variance = broadcast_row(0.0f);
+            for (int dy {-1}; dy <= 1; ++dy)
+            {
+                for (int dx {-1}; dx <= 1; ++dx)
+                {
+                    const auto q = static_cast<std::size_t>(
+                        static_cast<std::ptrdiff_t>(p) +
+                        static_cast<std::ptrdiff_t>(dy) *
+                            static_cast<std::ptrdiff_t>(planes.stride) +
+                        dx);
+                    blurred_variance = simd::fmadd(
+                        broadcast_row(variance_tap_weights[dy != 0] *
+                                      variance_tap_weights[dx != 0]),
+                        load_row(input.variance + q),
+                        blurred_variance);
+                }
+            }
+            const auto inverse_luminance_sigma =
+                broadcast_row(1.0f) /
+                simd::fmadd(broadcast_row(luminance_sigma),
+                            simd::sqrt(simd::max(blurred_variance,
+                                                 broadcast_row(0.0f))),
+                            broadcast_row(1e-4f));
+
+            // The center always has its full weight, so that pixels without a
+            // surface keep their value
+            const auto center_weight =
+                broadcast_row(tap_weights[2] * tap_weights[2]);
+            auto weight_sum = center_weight;
+            auto sum = signal_p * center_weight;
+            auto variance_sum = center_weight * center_weight * variance_p;
+            for (int dy {-2}; dy <= 2; ++dy)
+            {
+                for (int dx {-2}; dx <= 2; ++dx)
+                {
+                    if (dx == 0 && dy == 0)
+                    {
+                        continue;
+                    }
+                    const auto q =
+                        static_cast<std::size_t>(
+                            static_cast<std::ptrdiff_t>(p) +
+                            (static_cast<std::ptrdiff_t>(dy) *
+                                 static_cast<std::ptrdiff_t>(planes.stride) +
+                             dx) *
+                                step);
+                    const Row_vector3 normal_q {load_row(planes.normal_x + q),
+                                                load_row(planes.normal_y + q),
+                                                load_row(planes.normal_z + q)};
+                    const Row_vector3 albedo_q {load_row(planes.albedo_x + q),
+                                                load_row(planes.albedo_y + q),
+                                                load_row(planes.albedo_z + q)};
+                    const Row_vector3 signal_q {load_row(input.x + q),
+                                                load_row(input.y + q),
+                                                load_row(input.z + q)};
+                    const auto albedo_difference = albedo_q - albedo_p;
+                    const auto luminance_difference = simd::abs(
+                        luminance(signal_q.x, signal_q.y, signal_q.z) -
+                        luminance_p);
+                    const auto edge_weight =
+                        pow_128(vec::dot(normal_p, normal_q)) *
+                        exp_negative(
+                            vec::dot(albedo_difference, albedo_difference) *
+                                inverse_albedo_sigma_square +
+                            luminance_difference * inverse_luminance_sigma);
+                    const auto weight =
+                        broadcast_row(tap_weights[dy + 2] *
+                                      tap_weights[dx + 2]) *
+                        edge_weight;
+                    weight_sum += weight;
+                    sum += signal_q * weight;
+                    variance_sum +=
+                        weight * weight *
+                        load_row(input.variance + q);
+                }
+            }
+
+            const auto inverse_weight_sum = broadcast_row(1.0f) / weight_sum;
+            simd::store_unaligned(output.x + p, sum.x * inverse_weight_sum);
+            simd::store_unaligned(output.y + p, sum.y * inverse_weight_sum);
+            simd::store_unaligned(output.z + p, sum.z * inverse_weight_sum);
+            simd::store_unaligned(output.variance + p,
+                                  variance_sum * inverse_weight_sum *
+                                      inverse_weight_sum);
+        }
+    }
+}
+
+template void kernels::denoise_rows<compiled_isa>(const Denoise_planes &,
+                                                  const Denoise_signal &,
+                                                  const Denoise_signal &,
+                                                  int,
+                                                  int,
+                                                  int);
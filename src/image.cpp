@@ -0,0 +1,17 @@
+#include "image.hpp"
+
+#include "kernels.hpp"
+
+template <Isa isa>
+void kernels::linear_to_srgb(const f32 *linear, u8 *srgb, std::size_t count)
+{
+    static_assert(isa == compiled_isa);
+    // Vectorized by the compiler, at the width of the instruction set
+    for (std::size_t i {}; i < count; ++i)
+    {
+        srgb[i] = f32_to_u8(::linear_to_srgb(linear[i]));
+    }
+}
+
+template void
+kernels::linear_to_srgb<compiled_isa>(const f32 *, u8 *, std::size_t);
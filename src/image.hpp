@@ -0,0 +1,33 @@
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+
+#include "definitions.hpp"
+#include "math.hpp"
+
+#include <cstddef>
+
+struct Pixel
+{
+    u8 r;
+    u8 g;
+    u8 b;
+};
+
+[[nodiscard]] FORCE_INLINE constexpr u8 f32_to_u8(f32 c) noexcept
+{
+    return static_cast<u8>(math::clamp(c, 0.0f, 1.0f) * 255.0f);
+}
+
+[[nodiscard]] FORCE_INLINE f32 linear_to_srgb(f32 c)
+{
+    if (c <= 0.0031308f)
+    {
+        return 12.92f * c;
+    }
+    return 1.055f * math::pow(c, 1.0f / 2.4f) - 0.055f;
+}
+
+// Converts count linear values, e.g. the components of an image, to 8-bit sRGB
+void linear_to_srgb(const f32 *linear, u8 *srgb, std::size_t count);
+
+#endif // IMAGE_HPP
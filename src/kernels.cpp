@@ -0,0 +1,184 @@
+#include "kernels.hpp"
+
+#include "image.hpp"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace
+{
+
+struct Cpuid_registers
+{
+    u32 eax;
+    u32 ebx;
+    u32 ecx;
+    u32 edx;
+};
+
+[[nodiscard]] Cpuid_registers cpuid(u32 leaf, u32 subleaf)
+{
+#if defined(_MSC_VER)
+    int registers[4] {};
+    __cpuidex(registers, static_cast<int>(leaf), static_cast<int>(subleaf));
+    return {.eax = static_cast<u32>(registers[0]),
+            .ebx = static_cast<u32>(registers[1]),
+            .ecx = static_cast<u32>(registers[2]),
+            .edx = static_cast<u32>(registers[3])};
+#else
+    Cpuid_registers registers {};
+    __cpuid_count(leaf,
+                  subleaf,
+                  registers.eax,
+                  registers.ebx,
+                  registers.ecx,
+                  registers.edx);
+    return registers;
+#endif
+}
+
+// Returns the register states that the operating system saves on context
+// switches (XCR0). Only available if cpuid reports OSXSAVE
+[[nodiscard]] u64 xgetbv()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    // The intrinsic would require compiling for XSAVE
+    u32 eax {};
+    u32 edx {};
+    __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<u64>(edx) << 32) | eax;
+#endif
+}
+
+[[nodiscard]] constexpr bool has_bits(u64 value, u64 bits) noexcept
+{
+    return (value & bits) == bits;
+}
+
+template <Isa isa>
+[[nodiscard]] constexpr Kernels make_kernels() noexcept
+{
+    return {.isa = isa,
+            .intersect = &kernels::intersect<isa>,
+            .occluded = &kernels::occluded<isa>,
+            .intersect8 = &kernels::intersect8<isa>,
+            .shade_path_vertex = &kernels::shade_path_vertex<isa>,
+            .compact_indices = &kernels::compact_indices<isa>,
+            .linear_to_srgb = &kernels::linear_to_srgb<isa>,
+            .denoise_rows = &kernels::denoise_rows<isa>};
+}
+
+// Indexed by Isa
+constexpr std::array<Kernels, 3> isa_kernels {make_kernels<Isa::sse4_2>(),
+                                              make_kernels<Isa::avx2>(),
+                                              make_kernels<Isa::avx512>()};
+
+Kernels selected_kernels {isa_kernels[static_cast<std::size_t>(detect_isa())]};
+
+} // namespace
+
+Isa detect_isa()
+{
+    if (cpuid(0, 0).eax < 7 || cpuid(0x80000000u, 0).eax < 0x80000001u)
+    {
+        return Isa::sse4_2;
+    }
+    const auto leaf_1 = cpuid(1, 0);
+    const auto leaf_7 = cpuid(7, 0);
+    const auto extended_leaf_1 = cpuid(0x80000001u, 0);
+
+    // OSXSAVE
+    if (!has_bits(leaf_1.ecx, 1u << 27))
+    {
+        return Isa::sse4_2;
+    }
+    const auto xcr0 = xgetbv();
+
+    // x86-64-v3: FMA, MOVBE, AVX and F16C, then BMI1, AVX2 and BMI2, then
+    // LZCNT, with the SSE and AVX registers saved by the operating system
+    if (!has_bits(leaf_1.ecx,
+                  (1u << 12) | (1u << 22) | (1u << 28) | (1u << 29)) ||
+        !has_bits(leaf_7.ebx, (1u << 3) | (1u << 5) | (1u << 8)) ||
+        !has_bits(extended_leaf_1.ecx, 1u << 5) || !has_bits(xcr0, 0x6))
+    {
+        return Isa::sse4_2;
+    }
+
+    // x86-64-v4: AVX512F, AVX512DQ, AVX512CD, AVX512BW and AVX512VL, with the
+    // mask and upper ZMM registers saved by the operating system
+    if (!has_bits(leaf_7.ebx,
+                  (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) |
+                      (1u << 31)) ||
+        !has_bits(xcr0, 0xe0))
+    {
+        return Isa::avx2;
+    }
+    return Isa::avx512;
+}
+
+const Kernels &active_kernels()
+{
+    return selected_kernels;
+}
+
+bool select_kernels(Isa isa)
+{
+    if (static_cast<int>(isa) > static_cast<int>(detect_isa()))
+    {
+        return false;
+    }
+    selected_kernels = isa_kernels[static_cast<std::size_t>(isa)];
+    return true;
+}
+
+Ray_payload intersect(const Ray &ray, const Scene_geometry &geometry)
+{
+    return selected_kernels.intersect(ray, geometry);
+}
+
+bool occluded(const Ray &ray, f32 t_max, const Scene_geometry &geometry)
+{
+    return selected_kernels.occluded(ray, t_max, geometry);
+}
+
+std::array<Ray_payload, 8> intersect8(const Ray_packet8 &rays,
+                                      const Scene_geometry &geometry)
+{
+    return selected_kernels.intersect8(rays, geometry);
+}
+
+bool shade_path_vertex(const Scene &scene,
+                       const Ray_payload &payload,
+                       Path_state &path,
+                       Sampler &sampler,
+                       Light_connection &connection)
+{
+    return selected_kernels.shade_path_vertex(
+        scene, payload, path, sampler, connection);
+}
+
+u32 compact_indices(const f32 *keys, u32 count, u32 first, u32 *indices)
+{
+    return selected_kernels.compact_indices(keys, count, first, indices);
+}
+
+void linear_to_srgb(const f32 *linear, u8 *srgb, std::size_t count)
+{
+    selected_kernels.linear_to_srgb(linear, srgb, count);
+}
+
+void denoise_rows(const Denoise_planes &planes,
+                  const Denoise_signal &input,
+                  const Denoise_signal &output,
+                  int step,
+                  int row_begin,
+                  int row_end)
+{
+    selected_kernels.denoise_rows(
+        planes, input, output, step, row_begin, row_end);
+}
@@ -0,0 +1,112 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include "definitions.hpp"
+#include "denoise.hpp"
+#include "path.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "simd.hpp"
+#include "trace.hpp"
+
+#include <array>
+#include <cstddef>
+
+// Instruction sets that the hot kernels are compiled for, the x86-64 levels
+// x86-64-v2 (SSE4.2), x86-64-v3 (AVX2 and FMA) and x86-64-v4 (AVX-512). The
+// rest of the program only requires the first
+enum struct Isa
+{
+    sse4_2,
+    avx2,
+    avx512,
+};
+
+constexpr inline const char *isa_names[] {"sse4_2", "avx2", "avx512"};
+
+// Instruction set that the translation unit is compiled for
+constexpr inline Isa compiled_isa {simd_avx512f ? Isa::avx512
+                                   : simd_avx2  ? Isa::avx2
+                                                : Isa::sse4_2};
+
+// Implementations of the kernels for every instruction set. They are defined
+// by the files of KERNEL_SOURCES in src/CMakeLists.txt, which are compiled once
+// per instruction set and instantiate them for compiled_isa
+namespace kernels
+{
+
+template <Isa isa>
+[[nodiscard]] Ray_payload intersect(const Ray &ray,
+                                    const Scene_geometry &geometry);
+
+template <Isa isa>
+[[nodiscard]] bool
+occluded(const Ray &ray, f32 t_max, const Scene_geometry &geometry);
+
+template <Isa isa>
+[[nodiscard]] std::array<Ray_payload, 8>
+intersect8(const Ray_packet8 &rays, const Scene_geometry &geometry);
+
+template <Isa isa>
+[[nodiscard]] bool shade_path_vertex(const Scene &scene,
+                                     const Ray_payload &payload,
+                                     Path_state &path,
+                                     Sampler &sampler,
+                                     Light_connection &connection);
+
+template <Isa isa>
+[[nodiscard]] u32
+compact_indices(const f32 *keys, u32 count, u32 first, u32 *indices);
+
+template <Isa isa>
+void linear_to_srgb(const f32 *linear, u8 *srgb, std::size_t count);
+
+template <Isa isa>
+void denoise_rows(const Denoise_planes &planes,
+                  const Denoise_signal &input,
+                  const Denoise_signal &output,
+                  int step,
+                  int row_begin,
+                  int row_end);
+
+} // namespace kernels
+
+// The kernels of one instruction set, called by intersect(), occluded(),
+// intersect8(), shade_path_vertex(), compact_indices(), linear_to_srgb() and
+// denoise_rows()
+struct Kernels
+{
+    Isa isa;
+    Ray_payload (*intersect)(const Ray &, const Scene_geometry &);
+    bool (*occluded)(const Ray &, f32, const Scene_geometry &);
+    std::array<Ray_payload, 8> (*intersect8)(const Ray_packet8 &,
+                                             const Scene_geometry &);
+    bool (*shade_path_vertex)(const Scene &,
+                              const Ray_payload &,
+                              Path_state &,
+                              Sampler &,
+                              Light_connection &);
+    u32 (*compact_indices)(const f32 *, u32, u32, u32 *);
+    void (*linear_to_srgb)(const f32 *, u8 *, std::size_t);
+    void (*denoise_rows)(const Denoise_planes &,
+                         const Denoise_signal &,
+                         const Denoise_signal &,
+                         int,
+                         int,
+                         int);
+};
+
+// Returns the newest instruction set that both the CPU and the operating
+// system support, read with cpuid and xgetbv
+[[nodiscard]] Isa detect_isa();
+
+// Returns the kernels in use, those of detect_isa() unless select_kernels()
+// was called
+[[nodiscard]] const Kernels &active_kernels();
+
+// Uses the kernels of the given instruction set from now on, e.g. to compare
+// them. Not thread-safe, to be called before rendering. Returns false, and
+// keeps the current kernels, if the CPU does not support the instruction set
+[[nodiscard]] bool select_kernels(Isa isa);
+
+#endif // KERNELS_HPP
@@ -1,7 +1,10 @@
 #include "definitions.hpp"
-#include "math.hpp"
+#include "denoise.hpp"
+#include "image.hpp"
+#include "kernels.hpp"
 #include "random.hpp"
 #include "render.hpp"
+#include "render_thread.hpp"
 
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
@@ -22,6 +25,7 @@
 
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
@@ -31,32 +35,11 @@
 namespace
 {
 
-struct Pixel
-{
-    u8 r;
-    u8 g;
-    u8 b;
-};
-
 void glfw_error_callback(int error, const char *description)
 {
     std::cerr << "GLFW Error " << error << ": " << description << '\n';
 }
 
-[[nodiscard]] FORCE_INLINE constexpr u8 f32_to_u8(f32 c) noexcept
-{
-    return static_cast<u8>(math::clamp(c, 0.0f, 1.0f) * 255.0f);
-}
-
-[[nodiscard]] FORCE_INLINE f32 linear_to_srgb(f32 c)
-{
-    if (c <= 0.0031308f)
-    {
-        return 12.92f * c;
-    }
-    return 1.055f * math::pow(c, 1.0f / 2.4f) - 0.055f;
-}
-
 } // namespace
 
 int main()
@@ -94,20 +77,39 @@ int main()
     constexpr int image_height {256};
     constexpr auto image_size {
         static_cast<std::size_t>(image_width * image_height)};
+    std::vector<f32v3> image(image_size);
     std::vector<Pixel> pixel_buffer(image_size);
-    std::vector<f32v3> accumulation_buffer(image_size);
 
     GLuint texture {};
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    const auto upload_texture = [&]
+    {
+        glTexImage2D(GL_TEXTURE_2D,
+                     0,
+                     GL_RGB,
+                     image_width,
+                     image_height,
+                     0,
+                     GL_RGB,
+                     GL_UNSIGNED_BYTE,
+                     pixel_buffer.data());
+    };
+    upload_texture();
 
-    const auto scene = cornell_box();
+    // Only used to build the scene, before the render thread starts its own
+    const auto scene = []
+    {
+        Thread_pool thread_pool {};
+        return cornell_box(Vertex_format::full, thread_pool);
+    }();
 
     int samples {0};
-    int samples_per_frame {1};
     int total_samples {1};
+    f32 error_threshold {0.0f};
+    std::size_t active_tile_count {0};
 
     char image_filename[256] {};
 
@@ -119,6 +121,31 @@ int main()
     auto color_rng_state = rng_state;
 
     Sample_type sample_type {Sample_type::primitive_id};
+    bool all_sample_types {false};
+    Sampler_type sampler_type {Sampler_type::sobol};
+    Integrator_type integrator_type {Integrator_type::depth_first};
+    int denoise_passes {0};
+
+    // Samples are rendered continuously on another thread, the UI only
+    // converts the latest published film and sends the setting changes
+    Render_thread render_thread {scene,
+                                 {.image_width = image_width,
+                                  .image_height = image_height,
+                                  .sample_type = sample_type,
+                                  .all_sample_types = all_sample_types,
+                                  .sampler_type = sampler_type,
+                                  .integrator_type = integrator_type,
+                                  .total_samples = total_samples,
+                                  .error_threshold = error_threshold,
+                                  .denoise_passes = denoise_passes,
+                                  .rng_base_state = rng_state,
+                                  .color_rng_state = color_rng_state,
+                                  .thread_count = 0}};
+
+    // The last film received stays valid until the next one, so that it can
+    // be displayed again with other settings
+    const Film *displayed_film {};
+    bool redisplay {};
 
     while (!glfwWindowShouldClose(window))
     {
@@ -134,56 +161,87 @@ int main()
                         static_cast<double>(1000.0f / ImGui::GetIO().Framerate),
                         static_cast<double>(ImGui::GetIO().Framerate));
 
-            ImGui::Text("%lld triangles", scene.triangles.size());
+            ImGui::Text("%zu triangles", triangle_count(scene));
 
-            ImGui::Text("%d samples", samples);
+            ImGui::Text("%d samples, %zu active tiles",
+                        samples,
+                        active_tile_count);
 
-            // ImGui::SliderInt("Samples per frame", &samples_per_frame, 1, 8);
+            ImGui::Text("%u threads, %s kernels",
+                        render_thread.thread_count(),
+                        isa_names[static_cast<int>(active_kernels().isa)]);
 
-            ImGui::InputInt("Total samples", &total_samples);
-            bool reset_samples {false};
-            if (total_samples < 1)
+            if (ImGui::InputInt("Total samples", &total_samples))
             {
-                total_samples = 1;
+                total_samples = std::max(total_samples, 1);
+                render_thread.set_total_samples(total_samples);
             }
-            else if (samples > total_samples)
+
+            // Relative error at which tiles stop receiving samples, 0 to
+            // sample every tile up to the total
+            if (ImGui::InputFloat("Error threshold", &error_threshold))
             {
-                reset_samples = true;
+                error_threshold = std::max(error_threshold, 0.0f);
+                render_thread.set_error_threshold(error_threshold);
             }
 
             if (ImGui::Button("Reset samples"))
             {
-                reset_samples = true;
+                render_thread.reset();
             }
 
-            constexpr const char *sample_types[] {"color",
-                                                  "albedo",
-                                                  "normal",
-                                                  "barycentric",
-                                                  "primitive_id",
-                                                  "material_id"};
             auto sample_type_int = static_cast<int>(sample_type);
             if (ImGui::Combo("Sample type",
                              &sample_type_int,
-                             sample_types,
-                             static_cast<int>(std::size(sample_types))))
+                             sample_type_names,
+                             static_cast<int>(std::size(sample_type_names))))
             {
-                reset_samples = true;
+                sample_type = static_cast<Sample_type>(sample_type_int);
+                render_thread.set_sample_type(sample_type);
+                redisplay = true;
             }
-            sample_type = static_cast<Sample_type>(sample_type_int);
 
-            if (ImGui::Button("Change colors"))
+            // Switching between the sample types then keeps the samples
+            if (ImGui::Checkbox("Render all sample types", &all_sample_types))
             {
-                color_rng_state = rng_state;
-                reset_samples = true;
+                render_thread.set_all_sample_types(all_sample_types);
             }
 
-            if (reset_samples)
+            // Only the color is denoised, and only with all sample types,
+            // which include the albedo and normals that guide the filter. The
+            // render thread denoises the films before publishing them
+            if (ImGui::SliderInt(
+                    "Denoise passes", &denoise_passes, 0, max_denoise_passes))
             {
-                std::fill(accumulation_buffer.begin(),
-                          accumulation_buffer.end(),
-                          f32v3 {});
-                samples = 0;
+                render_thread.set_denoise_passes(denoise_passes);
+            }
+
+            auto sampler_type_int = static_cast<int>(sampler_type);
+            if (ImGui::Combo("Sampler",
+                             &sampler_type_int,
+                             sampler_type_names,
+                             static_cast<int>(std::size(sampler_type_names))))
+            {
+                sampler_type = static_cast<Sampler_type>(sampler_type_int);
+                render_thread.set_sampler_type(sampler_type);
+            }
+
+            auto integrator_type_int = static_cast<int>(integrator_type);
+            if (ImGui::Combo(
+                    "Integrator",
+                    &integrator_type_int,
+                    integrator_type_names,
+                    static_cast<int>(std::size(integrator_type_names))))
+            {
+                integrator_type =
+                    static_cast<Integrator_type>(integrator_type_int);
+                render_thread.set_integrator_type(integrator_type);
+            }
+
+            if (ImGui::Button("Change colors"))
+            {
+                color_rng_state = seed(color_rng_state);
+                render_thread.set_color_rng_state(color_rng_state);
             }
 
             ImGui::InputText(
@@ -240,50 +298,40 @@ int main()
 
         ImGui::Render();
 
-        for (int s {}; s < samples_per_frame && samples < total_samples; ++s)
+        if (const auto *const film = render_thread.acquire_film())
         {
-            for (int i {}; i < image_height; ++i)
+            displayed_film = film;
+            redisplay = true;
+        }
+        if (redisplay && displayed_film != nullptr)
+        {
+            redisplay = false;
+            const auto &film = *displayed_film;
+            samples = film.samples;
+            active_tile_count = static_cast<std::size_t>(std::count(
+                film.active_tiles.begin(), film.active_tiles.end(), 1));
+            // A film published before switching to another sample type may
+            // still have its color denoised
+            const auto denoised_color = render_thread.denoised_color();
+            const auto *displayed_image = denoised_color.data();
+            if (sample_type != Sample_type::color || denoised_color.empty())
             {
-                for (int j {}; j < image_width; ++j)
+                for (std::size_t i {}; i < image_size; ++i)
                 {
-                    const auto sample_color = sample_pixel(scene,
-                                                           i,
-                                                           j,
-                                                           image_width,
-                                                           image_height,
-                                                           sample_type,
-                                                           rng_state,
-                                                           color_rng_state);
-                    const auto pixel_index =
-                        static_cast<std::size_t>(i) *
-                            static_cast<std::size_t>(image_width) +
-                        static_cast<std::size_t>(j);
-                    accumulation_buffer[pixel_index] += sample_color;
+                    image[i] = pixel_color(film, sample_type, i);
                 }
+                displayed_image = image.data();
             }
-            ++samples;
-        }
-
-        for (std::size_t i {}; i < image_size; ++i)
-        {
-            const auto color =
-                accumulation_buffer[i] / static_cast<f32>(samples);
-            pixel_buffer[i] = {f32_to_u8(linear_to_srgb(color.x)),
-                               f32_to_u8(linear_to_srgb(color.y)),
-                               f32_to_u8(linear_to_srgb(color.z))};
+            static_assert(sizeof(f32v3) == 3 * sizeof(f32));
+            static_assert(sizeof(Pixel) == 3 * sizeof(u8));
+            linear_to_srgb(&displayed_image->x,
+                           &pixel_buffer.front().r,
+                           image_size * 3);
+            upload_texture();
         }
 
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
-        glTexImage2D(GL_TEXTURE_2D,
-                     0,
-                     GL_RGB,
-                     image_width,
-                     image_height,
-                     0,
-                     GL_RGB,
-                     GL_UNSIGNED_BYTE,
-                     pixel_buffer.data());
 
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
@@ -0,0 +1,136 @@
+#include "mapped_file.hpp"
+
+#include <utility>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+std::optional<Mapped_file> Mapped_file::open(const std::filesystem::path &path)
+{
+#if defined(_WIN32)
+    const auto file = CreateFileW(path.c_str(),
+                                  GENERIC_READ,
+                                  FILE_SHARE_READ,
+                                  nullptr,
+                                  OPEN_EXISTING,
+                                  FILE_FLAG_SEQUENTIAL_SCAN,
+                                  nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return std::nullopt;
+    }
+    LARGE_INTEGER file_size {};
+    if (!GetFileSizeEx(file, &file_size))
+    {
+        CloseHandle(file);
+        return std::nullopt;
+    }
+    const auto size = static_cast<std::size_t>(file_size.QuadPart);
+    if (size == 0)
+    {
+        CloseHandle(file);
+        return Mapped_file {nullptr, 0};
+    }
+    const auto mapping =
+        CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (mapping == nullptr)
+    {
+        return std::nullopt;
+    }
+    // The view keeps the mapping alive
+    const auto *const data = static_cast<const char *>(
+        MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(mapping);
+    if (data == nullptr)
+    {
+        return std::nullopt;
+    }
+    return Mapped_file {data, size};
+#else
+    const auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return std::nullopt;
+    }
+    struct stat status {};
+    if (fstat(fd, &status) != 0)
+    {
+        close(fd);
+        return std::nullopt;
+    }
+    const auto size = static_cast<std::size_t>(status.st_size);
+    if (size == 0)
+    {
+        close(fd);
+        return Mapped_file {nullptr, 0};
+    }
+    auto *const data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file open
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return std::nullopt;
+    }
+    // Parsers read the whole file, in parallel chunks
+    madvise(data, size, MADV_WILLNEED);
+    return Mapped_file {static_cast<const char *>(data), size};
+#endif
+}
+
+Mapped_file::~Mapped_file()
+{
+    unmap();
+}
+
+Mapped_file::Mapped_file(Mapped_file &&other) noexcept
+    : m_data {std::exchange(other.m_data, nullptr)},
+      m_size {std::exchange(other.m_size, 0)}
+{
+}
+
+Mapped_file &Mapped_file::operator=(Mapped_file &&other) noexcept
+{
+    if (this != &other)
+    {
+        unmap();
+        m_data = std::exchange(other.m_data, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+    }
+    return *this;
+}
+
+std::string_view Mapped_file::contents() const noexcept
+{
+    return {m_data, m_size};
+}
+
+Mapped_file::Mapped_file(const char *data, std::size_t size) noexcept
+    : m_data {data}, m_size {size}
+{
+}
+
+void Mapped_file::unmap() noexcept
+{
+    if (m_data == nullptr)
+    {
+        return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(m_data);
+#else
+    munmap(const_cast<char *>(m_data), m_size);
+#endif
+}
@@ -0,0 +1,36 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+
+// Read-only file mapped into memory, so that parsers read the page cache
+// directly instead of copying the file into buffers
+class Mapped_file
+{
+public:
+    // Returns nothing if the file cannot be opened or mapped
+    [[nodiscard]] static std::optional<Mapped_file>
+    open(const std::filesystem::path &path);
+
+    ~Mapped_file();
+
+    Mapped_file(const Mapped_file &) = delete;
+    Mapped_file(Mapped_file &&other) noexcept;
+    Mapped_file &operator=(const Mapped_file &) = delete;
+    Mapped_file &operator=(Mapped_file &&other) noexcept;
+
+    [[nodiscard]] std::string_view contents() const noexcept;
+
+private:
+    Mapped_file(const char *data, std::size_t size) noexcept;
+
+    void unmap() noexcept;
+
+    const char *m_data;
+    std::size_t m_size;
+};
+
+#endif // MAPPED_FILE_HPP
@@ -2,16 +2,31 @@
 #define MATH_HPP
 
 #include "definitions.hpp"
+#include "simd.hpp"
 
 #include <cmath>
 
 namespace math
 {
 
+constexpr inline f32 pi {3.14159265358979f};
+
+using std::copysign;
+
+using std::cos;
+
 using std::pow;
 
+using std::sin;
+
 using std::sqrt;
 
+FORCE_INLINE void sin_cos(f32 x, f32 &sin_x, f32 &cos_x) noexcept
+{
+    sin_x = std::sin(x);
+    cos_x = std::cos(x);
+}
+
 [[nodiscard]] constexpr FORCE_INLINE f32 fmadd(f32 a, f32 b, f32 c) noexcept
 {
     return a * b + c;
@@ -41,6 +56,20 @@ using std::sqrt;
     return math::min(math::max(value, low), high);
 }
 
+using simd::copysign;
+
+using simd::fmadd;
+
+using simd::fmsub;
+
+using simd::max;
+
+using simd::min;
+
+using simd::sin_cos;
+
+using simd::sqrt;
+
 } // namespace math
 
 #endif // MATH_HPP
@@ -0,0 +1,153 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+constexpr inline std::size_t cache_line_size {64};
+
+template <typename T, std::size_t Alignment = cache_line_size>
+struct Aligned_allocator
+{
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = Aligned_allocator<U, Alignment>;
+    };
+
+    constexpr Aligned_allocator() noexcept = default;
+
+    template <typename U>
+    constexpr Aligned_allocator(
+        const Aligned_allocator<U, Alignment> &) noexcept
+    {
+    }
+
+    [[nodiscard]] T *allocate(std::size_t n)
+    {
+        return static_cast<T *>(
+            ::operator new(n * sizeof(T), std::align_val_t {Alignment}));
+    }
+
+    void deallocate(T *p, std::size_t) noexcept
+    {
+        ::operator delete(p, std::align_val_t {Alignment});
+    }
+
+    template <typename U>
+    [[nodiscard]] constexpr bool
+    operator==(const Aligned_allocator<U, Alignment> &) const noexcept
+    {
+        return true;
+    }
+};
+
+// std::vector whose storage starts on a cache line
+template <typename T>
+using Aligned_vector = std::vector<T, Aligned_allocator<T>>;
+
+// Read-only array that either owns its elements, or views elements stored in
+// memory that outlives it, such as a mapped file. Kernels use both the same
+// way, so data loaded from a file is used without being copied
+template <typename T>
+class Buffer
+{
+public:
+    Buffer() noexcept = default;
+
+    Buffer(Aligned_vector<T> elements) noexcept
+        : m_elements {std::move(elements)},
+          m_data {m_elements.data()},
+          m_size {m_elements.size()}
+    {
+    }
+
+    [[nodiscard]] static Buffer view(const T *data, std::size_t size) noexcept
+    {
+        Buffer buffer {};
+        buffer.m_data = data;
+        buffer.m_size = size;
+        return buffer;
+    }
+
+    ~Buffer() = default;
+
+    Buffer(const Buffer &other)
+        : m_elements {other.m_elements},
+          m_data {other.owns_elements() ? m_elements.data() : other.m_data},
+          m_size {other.m_size}
+    {
+    }
+
+    // Moving the vector keeps its storage, and thus m_data
+    Buffer(Buffer &&other) noexcept
+        : m_elements {std::move(other.m_elements)},
+          m_data {std::exchange(other.m_data, nullptr)},
+          m_size {std::exchange(other.m_size, 0)}
+    {
+    }
+
+    Buffer &operator=(const Buffer &other)
+    {
+        return *this = Buffer {other};
+    }
+
+    Buffer &operator=(Buffer &&other) noexcept
+    {
+        m_elements = std::move(other.m_elements);
+        m_data = std::exchange(other.m_data, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+        return *this;
+    }
+
+    [[nodiscard]] constexpr const T *data() const noexcept
+    {
+        return m_data;
+    }
+
+    [[nodiscard]] constexpr std::size_t size() const noexcept
+    {
+        return m_size;
+    }
+
+    [[nodiscard]] constexpr bool empty() const noexcept
+    {
+        return m_size == 0;
+    }
+
+    [[nodiscard]] constexpr const T &operator[](std::size_t i) const noexcept
+    {
+        return m_data[i];
+    }
+
+    [[nodiscard]] constexpr const T &front() const noexcept
+    {
+        return m_data[0];
+    }
+
+    [[nodiscard]] constexpr const T *begin() const noexcept
+    {
+        return m_data;
+    }
+
+    [[nodiscard]] constexpr const T *end() const noexcept
+    {
+        return m_data + m_size;
+    }
+
+private:
+    [[nodiscard]] bool owns_elements() const noexcept
+    {
+        return m_data == m_elements.data();
+    }
+
+    Aligned_vector<T> m_elements;
+    const T *m_data {};
+    std::size_t m_size {};
+};
+
+#endif // MEMORY_HPP
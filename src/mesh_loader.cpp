@@ -0,0 +1,1007 @@
+#include "mesh_loader.hpp"
+
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+constexpr Material default_material {.albedo = {0.75f, 0.75f, 0.75f},
+                                     .emissivity = {}};
+
+// OBJ files are split into chunks of whole lines of about this size, parsed in
+// parallel
+constexpr std::size_t obj_chunk_size {1 << 20};
+
+// Rows of PLY elements decoded by one task
+constexpr u32 ply_block_size {1 << 16};
+
+[[nodiscard]] FORCE_INLINE constexpr bool is_space(char c) noexcept
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Removes the next whitespace-separated token from the line and returns it,
+// empty at the end of the line
+[[nodiscard]] std::string_view next_token(std::string_view &line) noexcept
+{
+    std::size_t begin {};
+    while (begin < line.size() && is_space(line[begin]))
+    {
+        ++begin;
+    }
+    auto end = begin;
+    while (end < line.size() && !is_space(line[end]))
+    {
+        ++end;
+    }
+    const auto token = line.substr(begin, end - begin);
+    line.remove_prefix(end);
+    return token;
+}
+
+// Removes the next line from the text and returns it, without its newline
+[[nodiscard]] std::string_view next_line(std::string_view &text) noexcept
+{
+    const auto end = text.find('\n');
+    if (end == std::string_view::npos)
+    {
+        return std::exchange(text, {});
+    }
+    const auto line = text.substr(0, end);
+    text.remove_prefix(end + 1);
+    return line;
+}
+
+template <typename T>
+[[nodiscard]] bool parse_number(std::string_view token, T &value) noexcept
+{
+    if (token.starts_with('+'))
+    {
+        token.remove_prefix(1);
+    }
+    const auto *const last = token.data() + token.size();
+    const auto [ptr, ec] = std::from_chars(token.data(), last, value);
+    if constexpr (std::is_floating_point_v<T>)
+    {
+        // Denormals are out of range for from_chars, they are read as 0
+        if (ec == std::errc::result_out_of_range && ptr == last)
+        {
+            value = T {};
+            return true;
+        }
+    }
+    return ec == std::errc {} && ptr == last;
+}
+
+// Parses the number that starts the next token of the line and removes the
+// token, without scanning it twice. The rest of the token, if any, must start
+// with separator
+template <typename T>
+[[nodiscard]] bool parse_next(std::string_view &line,
+                              T &value,
+                              char separator = ' ') noexcept
+{
+    std::size_t begin {};
+    while (begin < line.size() && is_space(line[begin]))
+    {
+        ++begin;
+    }
+    if (begin < line.size() && line[begin] == '+')
+    {
+        ++begin;
+    }
+    const auto *const first = line.data() + begin;
+    const auto *const last = line.data() + line.size();
+    auto [ptr, ec] = std::from_chars(first, last, value);
+    if constexpr (std::is_floating_point_v<T>)
+    {
+        if (ec == std::errc::result_out_of_range)
+        {
+            value = T {};
+            ec = {};
+        }
+    }
+    if (ec != std::errc {} || ptr == first)
+    {
+        return false;
+    }
+    if (ptr != last && !is_space(*ptr))
+    {
+        if (*ptr != separator)
+        {
+            return false;
+        }
+        while (ptr != last && !is_space(*ptr))
+        {
+            ++ptr;
+        }
+    }
+    line.remove_prefix(static_cast<std::size_t>(ptr - line.data()));
+    return true;
+}
+
+[[nodiscard]] bool parse_f32v3(std::string_view &line, f32v3 &value) noexcept
+{
+    return parse_next(line, value.x) && parse_next(line, value.y) &&
+           parse_next(line, value.z);
+}
+
+// Adds the materials of an MTL library. Their names are views of the text
+void parse_mtl(std::string_view text,
+               std::vector<Material> &materials,
+               std::unordered_map<std::string_view, u32> &material_ids)
+{
+    Material *material {nullptr};
+    while (!text.empty())
+    {
+        auto line = next_line(text);
+        const auto keyword = next_token(line);
+        if (keyword == "newmtl")
+        {
+            material_ids[next_token(line)] =
+                static_cast<u32>(materials.size());
+            material = &materials.emplace_back(default_material);
+        }
+        else if (material != nullptr && keyword == "Kd")
+        {
+            f32v3 albedo {};
+            if (parse_f32v3(line, albedo))
+            {
+                material->albedo = albedo;
+            }
+        }
+        else if (material != nullptr && keyword == "Ke")
+        {
+            f32v3 emissivity {};
+            if (parse_f32v3(line, emissivity))
+            {
+                material->emissivity = emissivity;
+            }
+        }
+    }
+}
+
+// Splits the text into chunks of whole lines
+[[nodiscard]] std::vector<std::string_view>
+split_lines(std::string_view text, std::size_t chunk_size)
+{
+    std::vector<std::string_view> chunks;
+    while (!text.empty())
+    {
+        auto end = std::min(chunk_size, text.size());
+        if (end < text.size())
+        {
+            const auto newline = text.find('\n', end - 1);
+            end = newline == std::string_view::npos ? text.size()
+                                                    : newline + 1;
+        }
+        chunks.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+    return chunks;
+}
+
+struct Obj_material_use
+{
+    u32 first_triangle;
+    std::string_view name;
+};
+
+// What a chunk of lines defines. The vertices of the chunk only get their
+// final indices once the vertex counts of the previous chunks are known
+struct Obj_chunk
+{
+    std::vector<f32v3> positions;
+    // Three vertex indices per triangle. Absolute indices start at 0, and
+    // negative ones are relative to the end of the positions of the chunk
+    std::vector<i64> indices;
+    std::vector<Obj_material_use> material_uses;
+    std::vector<std::string_view> material_libraries;
+};
+
+[[nodiscard]] bool parse_obj_chunk(std::string_view text, Obj_chunk &chunk)
+{
+    struct Polygon_vertex
+    {
+        i64 index;
+        bool relative;
+    };
+    std::vector<Polygon_vertex> polygon;
+    std::vector<std::size_t> relative_indices;
+
+    while (!text.empty())
+    {
+        auto line = next_line(text);
+        const auto keyword = next_token(line);
+        if (keyword == "v")
+        {
+            f32v3 position {};
+            if (!parse_f32v3(line, position))
+            {
+                return false;
+            }
+            chunk.positions.push_back(position);
+        }
+        else if (keyword == "f")
+        {
+            polygon.clear();
+            while (line.find_first_not_of(" \t\r") != std::string_view::npos)
+            {
+                // Texture coordinate and normal indices are ignored
+                i64 index {};
+                if (!parse_next(line, index, '/') || index == 0)
+                {
+                    return false;
+                }
+                // Relative indices count back from the vertices read so far
+                const auto vertex_count =
+                    static_cast<i64>(chunk.positions.size());
+                polygon.push_back(index > 0
+                                      ? Polygon_vertex {index - 1, false}
+                                      : Polygon_vertex {vertex_count + index,
+                                                        true});
+            }
+            for (std::size_t i {2}; i < polygon.size(); ++i)
+            {
+                for (const auto &vertex :
+                     {polygon.front(), polygon[i - 1], polygon[i]})
+                {
+                    if (vertex.relative)
+                    {
+                        relative_indices.push_back(chunk.indices.size());
+                    }
+                    chunk.indices.push_back(vertex.index);
+                }
+            }
+        }
+        else if (keyword == "usemtl")
+        {
+            chunk.material_uses.push_back(
+                {.first_triangle = static_cast<u32>(chunk.indices.size() / 3),
+                 .name = next_token(line)});
+        }
+        else if (keyword == "mtllib")
+        {
+            for (auto token = next_token(line); !token.empty();
+                 token = next_token(line))
+            {
+                chunk.material_libraries.push_back(token);
+            }
+        }
+    }
+
+    const auto vertex_count = static_cast<i64>(chunk.positions.size());
+    for (const auto i : relative_indices)
+    {
+        chunk.indices[i] -= vertex_count;
+    }
+    return true;
+}
+
+enum struct Ply_type
+{
+    i8,
+    u8,
+    i16,
+    u16,
+    i32,
+    u32,
+    f32,
+    f64,
+};
+
+[[nodiscard]] std::optional<Ply_type> parse_ply_type(std::string_view name)
+{
+    constexpr std::pair<std::string_view, Ply_type> types[] {
+        {"char", Ply_type::i8},    {"int8", Ply_type::i8},
+        {"uchar", Ply_type::u8},   {"uint8", Ply_type::u8},
+        {"short", Ply_type::i16},  {"int16", Ply_type::i16},
+        {"ushort", Ply_type::u16}, {"uint16", Ply_type::u16},
+        {"int", Ply_type::i32},    {"int32", Ply_type::i32},
+        {"uint", Ply_type::u32},   {"uint32", Ply_type::u32},
+        {"float", Ply_type::f32},  {"float32", Ply_type::f32},
+        {"double", Ply_type::f64}, {"float64", Ply_type::f64}};
+    for (const auto &[type_name, type] : types)
+    {
+        if (name == type_name)
+        {
+            return type;
+        }
+    }
+    return std::nullopt;
+}
+
+[[nodiscard]] constexpr std::size_t ply_type_size(Ply_type type) noexcept
+{
+    switch (type)
+    {
+    case Ply_type::i8:
+    case Ply_type::u8: return 1;
+    case Ply_type::i16:
+    case Ply_type::u16: return 2;
+    case Ply_type::i32:
+    case Ply_type::u32:
+    case Ply_type::f32: return 4;
+    case Ply_type::f64: return 8;
+    }
+    return 0;
+}
+
+template <typename T>
+[[nodiscard]] FORCE_INLINE T load(const char *data, bool swap) noexcept
+{
+    std::array<char, sizeof(T)> bytes {};
+    std::memcpy(bytes.data(), data, sizeof(T));
+    if (swap)
+    {
+        std::reverse(bytes.begin(), bytes.end());
+    }
+    return std::bit_cast<T>(bytes);
+}
+
+// Reads a scalar of the file, whose bytes are swapped if its byte order is not
+// the native one
+[[nodiscard]] FORCE_INLINE f64 load_scalar(const char *data,
+                                           Ply_type type,
+                                           bool swap) noexcept
+{
+    switch (type)
+    {
+    case Ply_type::i8: return load<i8>(data, swap);
+    case Ply_type::u8: return load<u8>(data, swap);
+    case Ply_type::i16: return load<i16>(data, swap);
+    case Ply_type::u16: return load<u16>(data, swap);
+    case Ply_type::i32: return load<i32>(data, swap);
+    case Ply_type::u32: return load<u32>(data, swap);
+    case Ply_type::f32: return static_cast<f64>(load<f32>(data, swap));
+    case Ply_type::f64: return load<f64>(data, swap);
+    }
+    return 0.0;
+}
+
+struct Ply_property
+{
+    std::string_view name;
+    // Type of the items for lists, which start with their item count
+    Ply_type type;
+    bool is_list;
+    Ply_type count_type;
+};
+
+struct Ply_element
+{
+    std::string_view name;
+    u64 count;
+    std::vector<Ply_property> properties;
+};
+
+struct Ply_header
+{
+    std::vector<Ply_element> elements;
+    bool big_endian;
+    // Offset of the rows of the first element in the file
+    std::size_t data_offset;
+};
+
+[[nodiscard]] std::optional<Ply_header> parse_ply_header(std::string_view text)
+{
+    if (!text.starts_with("ply"))
+    {
+        return std::nullopt;
+    }
+    Ply_header header {};
+    bool has_format {false};
+    const auto size = text.size();
+    while (!text.empty())
+    {
+        auto line = next_line(text);
+        const auto keyword = next_token(line);
+        if (keyword == "format")
+        {
+            const auto format = next_token(line);
+            if (format != "binary_little_endian" &&
+                format != "binary_big_endian")
+            {
+                return std::nullopt;
+            }
+            header.big_endian = format == "binary_big_endian";
+            has_format = true;
+        }
+        else if (keyword == "element")
+        {
+            auto &element = header.elements.emplace_back();
+            element.name = next_token(line);
+            if (!parse_number(next_token(line), element.count))
+            {
+                return std::nullopt;
+            }
+        }
+        else if (keyword == "property")
+        {
+            if (header.elements.empty())
+            {
+                return std::nullopt;
+            }
+            Ply_property property {};
+            auto type_name = next_token(line);
+            if (type_name == "list")
+            {
+                const auto count_type = parse_ply_type(next_token(line));
+                if (!count_type.has_value())
+                {
+                    return std::nullopt;
+                }
+                property.is_list = true;
+                property.count_type = *count_type;
+                type_name = next_token(line);
+            }
+            const auto type = parse_ply_type(type_name);
+            if (!type.has_value())
+            {
+                return std::nullopt;
+            }
+            property.type = *type;
+            property.name = next_token(line);
+            header.elements.back().properties.push_back(property);
+        }
+        else if (keyword == "end_header")
+        {
+            if (!has_format)
+            {
+                return std::nullopt;
+            }
+            header.data_offset = size - text.size();
+            return header;
+        }
+    }
+    return std::nullopt;
+}
+
+// Returns the size of the rows of an element without lists
+[[nodiscard]] std::optional<std::size_t>
+fixed_row_size(const Ply_element &element)
+{
+    std::size_t size {};
+    for (const auto &property : element.properties)
+    {
+        if (property.is_list)
+        {
+            return std::nullopt;
+        }
+        size += ply_type_size(property.type);
+    }
+    return size;
+}
+
+// Returns the offset of the row after the one at offset, or nothing if the
+// file ends before it. When list_offset is given, it receives the offset of
+// the given list property in the row
+[[nodiscard]] std::optional<std::size_t>
+next_ply_row(std::string_view text,
+             std::size_t offset,
+             const Ply_element &element,
+             bool swap,
+             std::size_t list_property = 0,
+             std::size_t *list_offset = nullptr)
+{
+    for (std::size_t p {}; p < element.properties.size(); ++p)
+    {
+        const auto &property = element.properties[p];
+        if (!property.is_list)
+        {
+            offset += ply_type_size(property.type);
+            continue;
+        }
+        if (list_offset != nullptr && p == list_property)
+        {
+            *list_offset = offset;
+        }
+        const auto count_size = ply_type_size(property.count_type);
+        if (offset + count_size > text.size())
+        {
+            return std::nullopt;
+        }
+        const auto count =
+            load_scalar(text.data() + offset, property.count_type, swap);
+        if (count < 0.0)
+        {
+            return std::nullopt;
+        }
+        offset += count_size + static_cast<std::size_t>(count) *
+                                   ply_type_size(property.type);
+    }
+    if (offset > text.size())
+    {
+        return std::nullopt;
+    }
+    return offset;
+}
+
+[[nodiscard]] bool skip_ply_element(std::string_view text,
+                                    std::size_t &offset,
+                                    const Ply_element &element,
+                                    bool swap)
+{
+    if (const auto row_size = fixed_row_size(element); row_size.has_value())
+    {
+        if (*row_size > 0 && element.count > (text.size() - offset) / *row_size)
+        {
+            return false;
+        }
+        offset += static_cast<std::size_t>(element.count) * *row_size;
+        return true;
+    }
+    for (u64 i {}; i < element.count; ++i)
+    {
+        const auto next = next_ply_row(text, offset, element, swap);
+        if (!next.has_value())
+        {
+            return false;
+        }
+        offset = *next;
+    }
+    return true;
+}
+
+[[nodiscard]] bool read_ply_vertices(std::string_view text,
+                                     std::size_t &offset,
+                                     const Ply_element &element,
+                                     bool swap,
+                                     std::vector<f32v3> &positions,
+                                     Thread_pool &thread_pool)
+{
+    const auto row_size = fixed_row_size(element);
+    if (!row_size.has_value() || *row_size == 0 ||
+        element.count > (text.size() - offset) / *row_size ||
+        element.count > std::numeric_limits<u32>::max())
+    {
+        return false;
+    }
+
+    std::array<std::size_t, 3> property_offsets {};
+    std::array<Ply_type, 3> property_types {};
+    std::array<bool, 3> found {};
+    std::size_t property_offset {};
+    for (const auto &property : element.properties)
+    {
+        constexpr std::string_view axis_names[] {"x", "y", "z"};
+        for (std::size_t axis {}; axis < 3; ++axis)
+        {
+            if (property.name == axis_names[axis])
+            {
+                property_offsets[axis] = property_offset;
+                property_types[axis] = property.type;
+                found[axis] = true;
+            }
+        }
+        property_offset += ply_type_size(property.type);
+    }
+    if (!found[0] || !found[1] || !found[2])
+    {
+        return false;
+    }
+
+    const auto vertex_count = static_cast<u32>(element.count);
+    const auto *const data = text.data() + offset;
+    positions.resize(vertex_count);
+    thread_pool.parallel_for(
+        (vertex_count + ply_block_size - 1) / ply_block_size,
+        [&](u32 block)
+        {
+            const auto begin = block * ply_block_size;
+            const auto end = std::min(begin + ply_block_size, vertex_count);
+            for (auto i = begin; i < end; ++i)
+            {
+                const auto *const row = data + i * *row_size;
+                const auto coordinate = [&](std::size_t axis)
+                {
+                    return static_cast<f32>(
+                        load_scalar(row + property_offsets[axis],
+                                    property_types[axis],
+                                    swap));
+                };
+                positions[i] = {coordinate(0), coordinate(1), coordinate(2)};
+            }
+        });
+    offset += static_cast<std::size_t>(vertex_count) * *row_size;
+    return true;
+}
+
+[[nodiscard]] bool read_ply_faces(std::string_view text,
+                                  std::size_t &offset,
+                                  const Ply_element &element,
+                                  bool swap,
+                                  const std::vector<f32v3> &positions,
+                                  std::vector<Triangle> &triangles,
+                                  Thread_pool &thread_pool)
+{
+    const auto list_property = static_cast<std::size_t>(
+        std::find_if(element.properties.begin(),
+                     element.properties.end(),
+                     [](const Ply_property &property)
+                     {
+                         return property.is_list &&
+                                (property.name == "vertex_indices" ||
+                                 property.name == "vertex_index");
+                     }) -
+        element.properties.begin());
+    if (list_property == element.properties.size() ||
+        element.count > std::numeric_limits<u32>::max())
+    {
+        return false;
+    }
+    const auto &indices = element.properties[list_property];
+    const auto count_size = ply_type_size(indices.count_type);
+    const auto index_size = ply_type_size(indices.type);
+    const auto face_count = static_cast<u32>(element.count);
+    const auto task_count = (face_count + ply_block_size - 1) / ply_block_size;
+
+    // Writes the fan of the polygon whose list starts at list, returns false
+    // if it references a vertex that does not exist
+    const auto read_face =
+        [&](const char *list, std::size_t vertex_count, std::size_t first)
+    {
+        const auto vertex = [&](std::size_t i, f32v3 &position)
+        {
+            const auto index = load_scalar(
+                list + count_size + i * index_size, indices.type, swap);
+            if (!(index >= 0.0 && index < static_cast<f64>(positions.size())))
+            {
+                return false;
+            }
+            position = positions[static_cast<std::size_t>(index)];
+            return true;
+        };
+        if (vertex_count < 3)
+        {
+            return true;
+        }
+        f32v3 vertex0 {};
+        f32v3 previous {};
+        if (!vertex(0, vertex0) || !vertex(1, previous))
+        {
+            return false;
+        }
+        for (std::size_t i {2}; i < vertex_count; ++i)
+        {
+            f32v3 current {};
+            if (!vertex(i, current))
+            {
+                return false;
+            }
+            triangles[first + i - 2] = {vertex0, previous, current, 0};
+            previous = current;
+        }
+        return true;
+    };
+
+    // Most files only have the list of indices and the same number of
+    // vertices in every face, so the rows have a fixed size and are decoded
+    // directly in parallel. Otherwise their offsets are found by a serial pass
+    std::size_t scalar_size {};
+    std::size_t list_offset {};
+    bool fixed_size {true};
+    for (std::size_t p {}; p < element.properties.size(); ++p)
+    {
+        const auto &property = element.properties[p];
+        fixed_size = fixed_size && (p == list_property || !property.is_list);
+        if (p == list_property)
+        {
+            list_offset = scalar_size;
+        }
+        else if (!property.is_list)
+        {
+            scalar_size += ply_type_size(property.type);
+        }
+    }
+    if (fixed_size && face_count > 0 &&
+        offset + list_offset + count_size <= text.size())
+    {
+        const auto first_count = load_scalar(
+            text.data() + offset + list_offset, indices.count_type, swap);
+        const auto vertex_count =
+            static_cast<std::size_t>(std::max(first_count, 0.0));
+        const auto row_size =
+            scalar_size + count_size + vertex_count * index_size;
+        if (vertex_count >= 3 &&
+            face_count <= (text.size() - offset) / row_size &&
+            face_count * (vertex_count - 2) <=
+                std::numeric_limits<u32>::max())
+        {
+            triangles.resize(face_count * (vertex_count - 2));
+            std::atomic<bool> valid {true};
+            const auto *const data = text.data() + offset + list_offset;
+            thread_pool.parallel_for(
+                task_count,
+                [&](u32 block)
+                {
+                    const auto begin = block * ply_block_size;
+                    const auto end =
+                        std::min(begin + ply_block_size, face_count);
+                    for (auto i = begin; i < end; ++i)
+                    {
+                        const auto *const list = data + i * row_size;
+                        if (load_scalar(list, indices.count_type, swap) !=
+                                first_count ||
+                            !read_face(
+                                list, vertex_count, i * (vertex_count - 2)))
+                        {
+                            valid.store(false, std::memory_order_relaxed);
+                            return;
+                        }
+                    }
+                });
+            if (valid.load(std::memory_order_relaxed))
+            {
+                offset += face_count * row_size;
+                return true;
+            }
+        }
+    }
+
+    std::vector<std::size_t> list_offsets(face_count);
+    std::vector<std::size_t> first_triangles(face_count + 1);
+    for (u32 i {}; i < face_count; ++i)
+    {
+        const auto next = next_ply_row(
+            text, offset, element, swap, list_property, &list_offsets[i]);
+        if (!next.has_value())
+        {
+            return false;
+        }
+        const auto vertex_count = static_cast<std::size_t>(load_scalar(
+            text.data() + list_offsets[i], indices.count_type, swap));
+        first_triangles[i + 1] =
+            first_triangles[i] + std::max(vertex_count, std::size_t {2}) - 2;
+        offset = *next;
+    }
+    if (first_triangles.back() > std::numeric_limits<u32>::max())
+    {
+        return false;
+    }
+    triangles.resize(first_triangles.back());
+    std::atomic<bool> valid {true};
+    thread_pool.parallel_for(
+        task_count,
+        [&](u32 block)
+        {
+            const auto begin = block * ply_block_size;
+            const auto end = std::min(begin + ply_block_size, face_count);
+            for (auto i = begin; i < end; ++i)
+            {
+                if (!read_face(text.data() + list_offsets[i],
+                               first_triangles[i + 1] - first_triangles[i] + 2,
+                               first_triangles[i]))
+                {
+                    valid.store(false, std::memory_order_relaxed);
+                    return;
+                }
+            }
+        });
+    return valid.load(std::memory_order_relaxed);
+}
+
+} // namespace
+
+std::optional<Mesh> load_obj(const std::filesystem::path &path,
+                             Thread_pool &thread_pool)
+{
+    const auto file = Mapped_file::open(path);
+    if (!file.has_value())
+    {
+        return std::nullopt;
+    }
+
+    const auto chunk_texts = split_lines(file->contents(), obj_chunk_size);
+    const auto chunk_count = static_cast<u32>(chunk_texts.size());
+    std::vector<Obj_chunk> chunks(chunk_count);
+    std::atomic<bool> valid {true};
+    thread_pool.parallel_for(chunk_count,
+                             [&](u32 c)
+                             {
+                                 if (!parse_obj_chunk(chunk_texts[c],
+                                                      chunks[c]))
+                                 {
+                                     valid.store(false,
+                                                 std::memory_order_relaxed);
+                                 }
+                             });
+    if (!valid.load(std::memory_order_relaxed))
+    {
+        return std::nullopt;
+    }
+
+    // Missing libraries and unknown material names use the default material.
+    // The libraries stay mapped while their material names are looked up
+    Mesh mesh {.triangles = {}, .materials = {default_material}};
+    std::vector<std::string_view> library_names;
+    std::vector<Mapped_file> libraries;
+    std::unordered_map<std::string_view, u32> material_ids;
+    for (const auto &chunk : chunks)
+    {
+        for (const auto name : chunk.material_libraries)
+        {
+            if (std::find(library_names.begin(), library_names.end(), name) !=
+                library_names.end())
+            {
+                continue;
+            }
+            library_names.push_back(name);
+            if (auto library = Mapped_file::open(path.parent_path() /
+                                                 std::filesystem::path {name});
+                library.has_value())
+            {
+                parse_mtl(library->contents(), mesh.materials, material_ids);
+                libraries.push_back(std::move(*library));
+            }
+        }
+    }
+    const auto material_id = [&](std::string_view name)
+    {
+        const auto it = material_ids.find(name);
+        return it != material_ids.end() ? it->second : 0;
+    };
+
+    // The vertices and triangles of every chunk follow those of the previous
+    // ones, and its first faces use the last material of the previous ones
+    std::vector<std::size_t> first_vertices(chunk_count + 1);
+    std::vector<std::size_t> first_triangles(chunk_count + 1);
+    std::vector<u32> first_material_ids(chunk_count);
+    u32 current_material_id {0};
+    for (u32 c {}; c < chunk_count; ++c)
+    {
+        const auto &chunk = chunks[c];
+        first_vertices[c + 1] = first_vertices[c] + chunk.positions.size();
+        first_triangles[c + 1] = first_triangles[c] + chunk.indices.size() / 3;
+        first_material_ids[c] = current_material_id;
+        if (!chunk.material_uses.empty())
+        {
+            current_material_id = material_id(chunk.material_uses.back().name);
+        }
+    }
+    const auto vertex_count = first_vertices.back();
+    const auto triangle_count = first_triangles.back();
+    if (triangle_count == 0 ||
+        triangle_count > std::numeric_limits<u32>::max())
+    {
+        return std::nullopt;
+    }
+
+    std::vector<f32v3> positions(vertex_count);
+    thread_pool.parallel_for(chunk_count,
+                             [&](u32 c)
+                             {
+                                 std::copy(chunks[c].positions.begin(),
+                                           chunks[c].positions.end(),
+                                           positions.begin() +
+                                               static_cast<std::ptrdiff_t>(
+                                                   first_vertices[c]));
+                                 chunks[c].positions = {};
+                             });
+
+    mesh.triangles.resize(triangle_count);
+    thread_pool.parallel_for(
+        chunk_count,
+        [&](u32 c)
+        {
+            const auto &chunk = chunks[c];
+            const auto chunk_end = static_cast<i64>(first_vertices[c + 1]);
+            auto current_material = first_material_ids[c];
+            auto use = chunk.material_uses.begin();
+            for (std::size_t t {}; t < chunk.indices.size() / 3; ++t)
+            {
+                for (; use != chunk.material_uses.end() &&
+                       use->first_triangle == t;
+                     ++use)
+                {
+                    current_material = material_id(use->name);
+                }
+                std::array<f32v3, 3> vertices {};
+                for (std::size_t k {}; k < 3; ++k)
+                {
+                    auto index = chunk.indices[3 * t + k];
+                    if (index < 0)
+                    {
+                        index += chunk_end;
+                    }
+                    if (index < 0 || static_cast<u64>(index) >= vertex_count)
+                    {
+                        valid.store(false, std::memory_order_relaxed);
+                        return;
+                    }
+                    vertices[k] = positions[static_cast<std::size_t>(index)];
+                }
+                mesh.triangles[first_triangles[c] + t] = {
+                    vertices[0], vertices[1], vertices[2], current_material};
+            }
+        });
+    if (!valid.load(std::memory_order_relaxed))
+    {
+        return std::nullopt;
+    }
+    return mesh;
+}
+
+std::optional<Mesh> load_ply(const std::filesystem::path &path,
+                             Thread_pool &thread_pool)
+{
+    const auto file = Mapped_file::open(path);
+    if (!file.has_value())
+    {
+        return std::nullopt;
+    }
+    const auto text = file->contents();
+    const auto header = parse_ply_header(text);
+    if (!header.has_value())
+    {
+        return std::nullopt;
+    }
+    const auto swap =
+        header->big_endian != (std::endian::native == std::endian::big);
+
+    Mesh mesh {.triangles = {}, .materials = {default_material}};
+    std::vector<f32v3> positions;
+    auto offset = header->data_offset;
+    for (const auto &element : header->elements)
+    {
+        bool valid {};
+        if (element.name == "vertex")
+        {
+            valid = read_ply_vertices(
+                text, offset, element, swap, positions, thread_pool);
+        }
+        else if (element.name == "face")
+        {
+            valid = read_ply_faces(text,
+                                   offset,
+                                   element,
+                                   swap,
+                                   positions,
+                                   mesh.triangles,
+                                   thread_pool);
+        }
+        else
+        {
+            valid = skip_ply_element(text, offset, element, swap);
+        }
+        if (!valid)
+        {
+            return std::nullopt;
+        }
+    }
+    if (mesh.triangles.empty())
+    {
+        return std::nullopt;
+    }
+    return mesh;
+}
+
+std::optional<Mesh> load_mesh(const std::filesystem::path &path,
+                              Thread_pool &thread_pool)
+{
+    const auto extension = path.extension();
+    if (extension == ".obj")
+    {
+        return load_obj(path, thread_pool);
+    }
+    if (extension == ".ply")
+    {
+        return load_ply(path, thread_pool);
+    }
+    return std::nullopt;
+}
@@ -0,0 +1,37 @@
+#ifndef MESH_LOADER_HPP
+#define MESH_LOADER_HPP
+
+#include "render.hpp"
+#include "thread_pool.hpp"
+
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+// Triangles read from a file, whose material ids index materials. Material 0
+// is a white diffuse one, used by the faces without a material
+struct Mesh
+{
+    std::vector<Triangle> triangles;
+    std::vector<Material> materials;
+};
+
+// Loads a Wavefront OBJ file, with the materials of its MTL libraries (Kd as
+// the albedo and Ke as the emissivity). Polygons are triangulated as fans.
+// The file is mapped and its lines are parsed in parallel chunks. Returns
+// nothing if the file cannot be read, is malformed or has no faces
+[[nodiscard]] std::optional<Mesh> load_obj(const std::filesystem::path &path,
+                                           Thread_pool &thread_pool);
+
+// Loads the vertex positions and the faces of a binary PLY file, in either
+// byte order. Polygons are triangulated as fans. The file is mapped and its
+// rows are decoded in parallel. Returns nothing if the file cannot be read,
+// is malformed, is ASCII or has no faces
+[[nodiscard]] std::optional<Mesh> load_ply(const std::filesystem::path &path,
+                                           Thread_pool &thread_pool);
+
+// Calls load_obj() or load_ply() depending on the extension of the path
+[[nodiscard]] std::optional<Mesh> load_mesh(const std::filesystem::path &path,
+                                            Thread_pool &thread_pool);
+
+#endif // MESH_LOADER_HPP
@@ -0,0 +1,222 @@
+#include "path.hpp"
+
+#include "kernels.hpp"
+#include "random.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+
+[[nodiscard]] constexpr f32 power_heuristic(f32 pdf_a, f32 pdf_b) noexcept
+{
+    const auto a = pdf_a * pdf_a;
+    const auto b = pdf_b * pdf_b;
+    return a / (a + b);
+}
+
+// Probability density, per unit solid angle, of sampling a point of a light
+// seen at the given distance and cosine from the light's normal
+[[nodiscard]] constexpr f32
+light_pdf(const Lights &lights, f32 distance, f32 cos_light) noexcept
+{
+    return distance * distance / (cos_light * lights.total_area);
+}
+
+struct Light_sample
+{
+    f32v3 direction;
+    f32 distance;
+    f32 pdf;
+    u32 instance_id;
+    u32 triangle_id;
+};
+
+// Samples a point uniformly over the total area of the lights. Returns false if
+// the point cannot contribute to the illumination of position
+[[nodiscard]] bool sample_light(const Scene &scene,
+                                f32v3 position,
+                                Sampler &sampler,
+                                Light_sample &sample)
+{
+    const auto &lights = scene.lights;
+    const auto it = std::lower_bound(
+        lights.cdf.begin(), lights.cdf.end(), next_1d(sampler));
+    const auto light_index =
+        std::min(static_cast<std::size_t>(it - lights.cdf.begin()),
+                 lights.cdf.size() - 1);
+    const auto instance_id = lights.instance_ids[light_index];
+    const auto triangle_id = lights.triangle_ids[light_index];
+
+    // Affine transforms preserve the uniformity of the point over the triangle
+    f32 u {};
+    f32 v {};
+    next_2d(sampler, u, v);
+    const auto sqrt_u = math::sqrt(u);
+    const auto point = surface_point(scene.geometry,
+                                     instance_id,
+                                     triangle_id,
+                                     sqrt_u * (1.0f - v),
+                                     sqrt_u * v);
+
+    const auto to_light = point - position;
+    const auto distance = vec::length(to_light);
+    if (distance < 1e-6f)
+    {
+        return false;
+    }
+    const auto direction = to_light * (1.0f / distance);
+    // Lights emit on both sides, like when they are hit by a bounce
+    const auto cos_light = std::abs(vec::dot(
+        surface_normal(scene.geometry, instance_id, triangle_id), direction));
+    if (cos_light < 1e-6f)
+    {
+        return false;
+    }
+    sample = {.direction = direction,
+              .distance = distance,
+              .pdf = light_pdf(lights, distance, cos_light),
+              .instance_id = instance_id,
+              .triangle_id = triangle_id};
+    return true;
+}
+
+} // namespace
+
+template <Isa isa>
+bool kernels::shade_path_vertex(const Scene &scene,
+                                const Ray_payload &payload,
+                                Path_state &path,
+                                Sampler &sampler,
+                                Light_connection &connection)
+{
+    static_assert(isa == compiled_isa);
+    connection.t_max = 0.0f;
+
+    if (payload.primitive_id == 0xffffffffu)
+    {
+        path.color += path.reflectance * scene.background_color;
+        return false;
+    }
+
+    const auto triangle_normal = surface_normal(
+        scene.geometry, payload.instance_id, payload.primitive_id);
+    const auto cos_hit = vec::dot(triangle_normal, path.ray.direction);
+    const auto normal = cos_hit < 0.0f ? triangle_normal : -triangle_normal;
+    const auto &material = scene.materials[surface_material_id(
+        scene.geometry, payload.instance_id, payload.primitive_id)];
+
+    if (material.emissivity.x + material.emissivity.y + material.emissivity.z >
+        0.0f)
+    {
+        auto weight = 1.0f;
+        if (path.bounce_pdf > 0.0f)
+        {
+            const auto distance =
+                vec::length(payload.position - path.ray.origin);
+            weight = power_heuristic(
+                path.bounce_pdf,
+                light_pdf(scene.lights, distance, std::abs(cos_hit)));
+        }
+        path.color += weight * path.reflectance * material.emissivity;
+    }
+
+    auto albedo = material.albedo;
+    const auto p = albedo.x > albedo.y && albedo.x > albedo.z ? albedo.x
+                   : albedo.y > albedo.z                      ? albedo.y
+                                                              : albedo.z;
+    if (p < 1e-6f)
+    {
+        return false;
+    }
+
+    const auto origin = offset_ray_origin(payload.position, normal);
+
+    // The bounce gets the first and best stratified pair of dimensions of the
+    // vertex, although it is only used after the light sample
+    start_vertex(sampler, path.depth);
+    f32 u1 {};
+    f32 u2 {};
+    next_2d(sampler, u1, u2);
+
+    if (Light_sample light {};
+        !scene.lights.triangle_ids.empty() &&
+        sample_light(scene, origin, sampler, light))
+    {
+        const auto cos_surface = vec::dot(normal, light.direction);
+        if (cos_surface > 0.0f)
+        {
+            const auto &light_material =
+                scene.materials[surface_material_id(
+                    scene.geometry, light.instance_id, light.triangle_id)];
+            const auto surface_pdf = cos_surface / math::pi;
+            const auto weight = power_heuristic(light.pdf, surface_pdf);
+            connection.ray = {.origin = origin, .direction = light.direction};
+            // Shortened so that the light itself is not an occluder
+            connection.t_max = light.distance * (1.0f - 1e-4f);
+            // Lambertian BRDF albedo / pi
+            connection.contribution =
+                (weight * cos_surface / (math::pi * light.pdf)) *
+                path.reflectance * albedo * light_material.emissivity;
+        }
+    }
+
+    if (path.depth > 5)
+    {
+        if (next_1d(sampler) >= p)
+        {
+            return false;
+        }
+        albedo *= (1.0f / p);
+    }
+    path.reflectance *= albedo;
+
+    const auto new_direction = sample_cosine_hemisphere(normal, u1, u2);
+    path.bounce_pdf = vec::dot(normal, new_direction) / math::pi;
+    path.ray = {.origin = origin, .direction = new_direction};
+    ++path.depth;
+    return true;
+}
+
+template bool
+kernels::shade_path_vertex<compiled_isa>(const Scene &,
+                                         const Ray_payload &,
+                                         Path_state &,
+                                         Sampler &,
+                                         Light_connection &);
+
+template <Isa isa>
+u32 kernels::compact_indices(const f32 *keys,
+                             u32 count,
+                             u32 first,
+                             u32 *indices)
+{
+    static_assert(isa == compiled_isa);
+    u32 size {};
+    u32 k {};
+#if SIMD_AVX512F
+    // The indices of 16 keys at a time, those of the positive ones being
+    // stored contiguously
+    for (; k + 16 <= count; k += 16)
+    {
+        const auto selected =
+            simd::load_unaligned16(keys + k) > simd::zero16();
+        size += simd::compress_store(reinterpret_cast<f32 *>(indices + size),
+                                     simd::index_bits16(first + k),
+                                     selected);
+    }
+#endif
+    // Without branches, every index is written and only kept if selected
+    for (; k < count; ++k)
+    {
+        indices[size] = first + k;
+        size += keys[k] > 0.0f ? 1u : 0u;
+    }
+    return size;
+}
+
+template u32 kernels::compact_indices<compiled_isa>(const f32 *,
+                                                    u32,
+                                                    u32,
+                                                    u32 *);
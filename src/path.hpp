@@ -0,0 +1,57 @@
+#ifndef PATH_HPP
+#define PATH_HPP
+
+#include "render.hpp"
+#include "sampler.hpp"
+#include "trace.hpp"
+#include "vec.hpp"
+
+// State of a path between two vertices, the ray leaving its last vertex
+struct Path_state
+{
+    Ray ray;
+    // Radiance gathered so far
+    f32v3 color;
+    // Product of the albedos of the vertices so far
+    f32v3 reflectance;
+    // Solid angle density of the bounce that produced ray, 0 for camera rays
+    f32 bounce_pdf;
+    int depth;
+};
+
+// Shadow ray from a path vertex to a point of a light, and the radiance it adds
+// to the path unless it is occluded. A t_max of 0 means no connection
+struct Light_connection
+{
+    Ray ray;
+    f32 t_max;
+    f32v3 contribution;
+};
+
+[[nodiscard]] constexpr Path_state start_path(const Ray &camera_ray) noexcept
+{
+    return {.ray = camera_ray,
+            .color = {},
+            .reflectance = {1.0f, 1.0f, 1.0f},
+            .bounce_pdf = 0.0f,
+            .depth = 0};
+}
+
+// Shades the vertex where path.ray hits the scene (or the background): adds
+// its emission, weighted against light sampling by multiple importance
+// sampling, samples a point on a light to connect to, and bounces. Returns
+// false when the path is terminated, otherwise path.ray is the bounce ray.
+// Tracing is left to the caller, so that integrators can schedule it freely
+[[nodiscard]] bool shade_path_vertex(const Scene &scene,
+                                     const Ray_payload &payload,
+                                     Path_state &path,
+                                     Sampler &sampler,
+                                     Light_connection &connection);
+
+// Writes the indices first + k of the positive keys[k], k < count, to indices
+// in increasing order, and returns their number, e.g. to compact a queue to
+// its live entries. indices must have room for count of them
+[[nodiscard]] u32
+compact_indices(const f32 *keys, u32 count, u32 first, u32 *indices);
+
+#endif // PATH_HPP
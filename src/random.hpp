@@ -4,6 +4,7 @@
 #include "definitions.hpp"
 #include "vec.hpp"
 
+#include <concepts>
 #include <limits>
 
 [[nodiscard]] FORCE_INLINE constexpr u32 seed(u32 x) noexcept
@@ -16,6 +17,16 @@
     return x;
 }
 
+// Returns a non-zero generator state that only depends on its arguments, so
+// that every pixel and sample gets its own stream regardless of the thread
+// that renders it
+[[nodiscard]] FORCE_INLINE constexpr u32
+pixel_rng_state(u32 base_state, u32 pixel_index, u32 sample_index) noexcept
+{
+    const auto state = seed(pixel_index + seed(sample_index + seed(base_state)));
+    return state != 0 ? state : 123456789;
+}
+
 [[nodiscard]] FORCE_INLINE constexpr float random(u32 &rng_state) noexcept
 {
     rng_state ^= rng_state << 13;
@@ -25,34 +36,44 @@
            (1.0f / static_cast<float>(std::numeric_limits<u32>::max()));
 }
 
-// Returns a random f32v3 with length <= 1
-[[nodiscard]] FORCE_INLINE constexpr f32v3 random_in_sphere(u32 &state) noexcept
+// Maps two uniform numbers in [0, 1) to a cosine-distributed direction in the
+// hemisphere around the normalized normal, in closed form and without
+// branches. The density of the result is dot(normal, direction) / pi
+template <typename T>
+[[nodiscard]] FORCE_INLINE v3<T>
+sample_cosine_hemisphere(v3<T> normal, T u1, T u2) noexcept
 {
-    for (;;)
+    T one {};
+    T two_pi {};
+    if constexpr (std::same_as<T, vf32>)
     {
-        const f32v3 v {random(state) * 2.0f - 1.0f,
-                        random(state) * 2.0f - 1.0f,
-                        random(state) * 2.0f - 1.0f};
-        if (vec::dot(v, v) <= 1.0f)
-        {
-            return v;
-        }
+        one = simd::broadcast(1.0f);
+        two_pi = simd::broadcast(2.0f * math::pi);
     }
+    else
+    {
+        one = 1.0f;
+        two_pi = 2.0f * math::pi;
+    }
+    // Uniform point on the unit disk projected up to the hemisphere
+    const auto radius = math::sqrt(u1);
+    T sin_phi {};
+    T cos_phi {};
+    math::sin_cos(two_pi * u2, sin_phi, cos_phi);
+    const auto z = math::sqrt(math::max(one - u1, T {}));
+    v3<T> tangent {};
+    v3<T> bitangent {};
+    vec::orthonormal_basis(normal, tangent, bitangent);
+    return tangent * (radius * cos_phi) + bitangent * (radius * sin_phi) +
+           normal * z;
 }
 
-[[nodiscard]] FORCE_INLINE f32v3 random_unit_vector(u32 &rng_state) noexcept
+[[nodiscard]] FORCE_INLINE f32v3 random_cosine_direction(f32v3 normal,
+                                                         u32 &rng_state)
 {
-    for (;;)
-    {
-        const f32v3 v {random(rng_state) * 2.0f - 1.0f,
-                        random(rng_state) * 2.0f - 1.0f,
-                        random(rng_state) * 2.0f - 1.0f};
-        if (const auto length_sq {vec::dot(v, v)};
-            length_sq > 1e-8f && length_sq <= 1.0f)
-        {
-            return v * (1.0f / math::sqrt(length_sq));
-        }
-    }
+    const auto u1 = random(rng_state);
+    const auto u2 = random(rng_state);
+    return sample_cosine_hemisphere(normal, u1, u2);
 }
 
 #endif // RANDOM_HPP
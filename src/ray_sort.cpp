@@ -0,0 +1,93 @@
+#include "ray_sort.hpp"
+
+#include <algorithm>
+#include <array>
+#include <utility>
+
+namespace
+{
+
+constexpr u32 radix_bits {8};
+constexpr std::size_t radix_size {1u << radix_bits};
+constexpr std::size_t block_size {4096};
+
+} // namespace
+
+std::vector<u32> sort_keys(std::span<const u32> keys, Thread_pool &thread_pool)
+{
+    const auto size = keys.size();
+    const auto block_count =
+        static_cast<u32>((size + block_size - 1) / block_size);
+
+    std::vector<u32> sorted_keys(keys.begin(), keys.end());
+    std::vector<u32> order(size);
+    for (std::size_t i {}; i < size; ++i)
+    {
+        order[i] = static_cast<u32>(i);
+    }
+    std::vector<u32> next_keys(size);
+    std::vector<u32> next_order(size);
+    // offsets[block][digit] is where the block writes its next key with digit
+    std::vector<std::array<u32, radix_size>> offsets(block_count);
+
+    u32 all_bits {};
+    for (const auto key : keys)
+    {
+        all_bits |= key;
+    }
+
+    for (u32 shift {}; shift < 32; shift += radix_bits)
+    {
+        // Passes over digits that are 0 in every key would not move anything
+        if ((all_bits >> shift) == 0)
+        {
+            break;
+        }
+
+        thread_pool.parallel_for(
+            block_count,
+            [&](u32 block)
+            {
+                auto &histogram = offsets[block];
+                histogram.fill(0);
+                const auto begin = block * block_size;
+                const auto end = std::min(begin + block_size, size);
+                for (auto i = begin; i < end; ++i)
+                {
+                    ++histogram[(sorted_keys[i] >> shift) & (radix_size - 1)];
+                }
+            });
+
+        // Keys go by digit, then by block, which keeps the sort stable
+        u32 offset {};
+        for (std::size_t digit {}; digit < radix_size; ++digit)
+        {
+            for (auto &block_offsets : offsets)
+            {
+                offset += std::exchange(block_offsets[digit], offset);
+            }
+        }
+
+        thread_pool.parallel_for(
+            block_count,
+            [&](u32 block)
+            {
+                auto &block_offsets = offsets[block];
+                const auto begin = block * block_size;
+                const auto end = std::min(begin + block_size, size);
+                for (auto i = begin; i < end; ++i)
+                {
+                    const auto key = sorted_keys[i];
+                    const auto j =
+                        block_offsets[(key >> shift) & (radix_size - 1)]++;
+                    next_keys[j] = key;
+                    next_order[j] = order[i];
+                }
+            });
+
+        sorted_keys.swap(next_keys);
+        order.swap(next_order);
+    }
+
+    return order;
+}
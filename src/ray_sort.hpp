@@ -0,0 +1,64 @@
+#ifndef RAY_SORT_HPP
+#define RAY_SORT_HPP
+
+#include "definitions.hpp"
+#include "math.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "vec.hpp"
+
+#include <span>
+#include <vector>
+
+namespace morton
+{
+
+// Spreads the 9 low bits of x to every third bit
+[[nodiscard]] FORCE_INLINE constexpr u32 expand_bits(u32 x) noexcept
+{
+    x &= 0x1ffu;
+    x = (x | (x << 16)) & 0x030000ffu;
+    x = (x | (x << 8)) & 0x0300f00fu;
+    x = (x | (x << 4)) & 0x030c30c3u;
+    x = (x | (x << 2)) & 0x09249249u;
+    return x;
+}
+
+// Interleaves the 9 low bits of x, y and z into a 27 bit code
+[[nodiscard]] FORCE_INLINE constexpr u32 encode(u32 x, u32 y, u32 z) noexcept
+{
+    return expand_bits(x) | (expand_bits(y) << 1) | (expand_bits(z) << 2);
+}
+
+} // namespace morton
+
+// Key that orders rays by the octant of their direction, then along a Morton
+// curve through their origins, quantized to 512^3 cells of the given bounds.
+// Rays with close keys start close to each other in the same general
+// direction, so they tend to visit the same BVH nodes and triangles
+[[nodiscard]] FORCE_INLINE u32 ray_sort_key(const Ray &ray,
+                                            f32v3 bounds_min,
+                                            f32v3 bounds_max) noexcept
+{
+    const auto cell = [](f32 p, f32 low, f32 high)
+    {
+        const auto extent = math::max(high - low, 1e-6f);
+        return static_cast<u32>(
+            math::clamp((p - low) / extent, 0.0f, 1.0f) * 511.0f);
+    };
+    const auto octant = static_cast<u32>(ray.direction.x < 0.0f) |
+                        (static_cast<u32>(ray.direction.y < 0.0f) << 1) |
+                        (static_cast<u32>(ray.direction.z < 0.0f) << 2);
+    return (octant << 27) |
+           morton::encode(cell(ray.origin.x, bounds_min.x, bounds_max.x),
+                          cell(ray.origin.y, bounds_min.y, bounds_max.y),
+                          cell(ray.origin.z, bounds_min.z, bounds_max.z));
+}
+
+// Returns the permutation that stably sorts the keys in increasing order. LSD
+// radix sort, with the histograms and scatters of every pass parallel over
+// blocks of keys
+[[nodiscard]] std::vector<u32> sort_keys(std::span<const u32> keys,
+                                         Thread_pool &thread_pool);
+
+#endif // RAY_SORT_HPP
@@ -1,6 +1,18 @@
 #include "render.hpp"
 
+#include "mesh_loader.hpp"
+#include "path.hpp"
 #include "random.hpp"
+#include "sampler.hpp"
+#include "scene_cache.hpp"
+#include "wavefront.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <filesystem>
+#include <span>
+#include <utility>
 
 namespace
 {
@@ -11,61 +23,506 @@ namespace
     return {random(rng_state), random(rng_state), random(rng_state)};
 }
 
-[[nodiscard]] f32v3 radiance(const Scene &scene, const Ray &ray, u32 &rng_state)
+[[nodiscard]] constexpr f32 luminance(f32v3 color) noexcept
 {
-    f32v3 accumulated_color {};
-    f32v3 accumulated_reflectance {1.0f, 1.0f, 1.0f};
-    auto r = ray;
-    for (int depth {};; ++depth)
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+// Path tracing with next event estimation: at every diffuse vertex, a point on
+// a light is sampled and connected with a shadow ray, and combined with the
+// emission found by the cosine-weighted bounce using multiple importance
+// sampling (power heuristic). Every path is traced to completion, depth-first.
+// The intersection of the ray with the scene is given, so that primary rays
+// can be traced separately, e.g. as packets
+[[nodiscard]] f32v3 radiance(const Scene &scene,
+                             const Ray &ray,
+                             const Ray_payload &primary_payload,
+                             Sampler &sampler)
+{
+    auto path = start_path(ray);
+    auto payload = primary_payload;
+    for (;;)
+    {
+        Light_connection connection {};
+        const auto alive =
+            shade_path_vertex(scene, payload, path, sampler, connection);
+        if (connection.t_max > 0.0f &&
+            !occluded(connection.ray, connection.t_max, scene.geometry))
+        {
+            path.color += connection.contribution;
+        }
+        if (!alive)
+        {
+            return path.color;
+        }
+        payload = intersect(path.ray, scene.geometry);
+    }
+}
+
+// The sample types other than color only depend on the primary hit
+template <Sample_type sample_type>
+[[nodiscard]] FORCE_INLINE f32v3 shade_primary_hit(const Scene &scene,
+                                                   const Ray_payload &payload,
+                                                   u32 color_rng_state)
+{
+    if constexpr (sample_type == Sample_type::albedo)
     {
-        const auto payload = intersect(r, scene.triangles);
         if (payload.primitive_id == 0xffffffffu)
         {
             return scene.background_color;
         }
+        return scene
+            .materials[surface_material_id(
+                scene.geometry, payload.instance_id, payload.primitive_id)]
+            .albedo;
+    }
+    else if constexpr (sample_type == Sample_type::normal)
+    {
+        if (payload.primitive_id == 0xffffffffu)
+        {
+            return {};
+        }
+        const auto normal = surface_normal(
+            scene.geometry, payload.instance_id, payload.primitive_id);
+        return (normal + f32v3 {1.0f, 1.0f, 1.0f}) * 0.5f;
+    }
+    else if constexpr (sample_type == Sample_type::barycentric)
+    {
+        if (payload.primitive_id == 0xffffffffu)
+        {
+            return {};
+        }
+        return {1.0f - payload.u - payload.v, payload.u, payload.v};
+    }
+    else if constexpr (sample_type == Sample_type::primitive_id)
+    {
+        if (payload.primitive_id == 0xffffffffu)
+        {
+            return {};
+        }
+        return random_color(color_rng_state, payload.primitive_id);
+    }
+    else
+    {
+        static_assert(sample_type == Sample_type::material_id);
+        if (payload.primitive_id == 0xffffffffu)
+        {
+            return {};
+        }
+        return random_color(
+            color_rng_state,
+            surface_material_id(
+                scene.geometry, payload.instance_id, payload.primitive_id));
+    }
+}
+
+template <Sample_type sample_type>
+[[nodiscard]] FORCE_INLINE f32v3 shade(const Scene &scene,
+                                       const Ray &ray,
+                                       const Ray_payload &payload,
+                                       Sampler &sampler,
+                                       u32 color_rng_state)
+{
+    if constexpr (sample_type == Sample_type::color)
+    {
+        return radiance(scene, ray, payload, sampler);
+    }
+    else
+    {
+        return shade_primary_hit<sample_type>(scene, payload, color_rng_state);
+    }
+}
+
+// A sample of every sample type, indexed by Sample_type
+using Sample_set = std::array<f32v3, sample_type_count>;
+
+// Fills the samples of every sample type but color
+FORCE_INLINE void shade_primary_hit(const Scene &scene,
+                                    const Ray_payload &payload,
+                                    u32 color_rng_state,
+                                    Sample_set &samples)
+{
+    const auto set = [&]<Sample_type type>()
+    {
+        samples[static_cast<std::size_t>(type)] =
+            shade_primary_hit<type>(scene, payload, color_rng_state);
+    };
+    set.template operator()<Sample_type::albedo>();
+    set.template operator()<Sample_type::normal>();
+    set.template operator()<Sample_type::barycentric>();
+    set.template operator()<Sample_type::primitive_id>();
+    set.template operator()<Sample_type::material_id>();
+}
+
+// Returns the indices of the active tiles of the film
+[[nodiscard]] std::vector<u32> active_tile_indices(const Film &film)
+{
+    std::vector<u32> tile_indices;
+    for (std::size_t t {}; t < film.active_tiles.size(); ++t)
+    {
+        if (film.active_tiles[t] != 0)
+        {
+            tile_indices.push_back(static_cast<u32>(t));
+        }
+    }
+    return tile_indices;
+}
+
+// Allocates the planes of the film that are missing, with no samples
+void allocate_planes(Film &film, std::span<const Sample_type> sample_types)
+{
+    const auto image_size = static_cast<std::size_t>(film.image_width) *
+                            static_cast<std::size_t>(film.image_height);
+    for (const auto sample_type : sample_types)
+    {
+        auto &plane = film.planes[static_cast<std::size_t>(sample_type)];
+        if (plane.empty())
+        {
+            plane.resize(image_size);
+        }
+    }
+}
 
-        const auto &triangle = scene.triangles[payload.primitive_id];
-        const auto triangle_normal =
-            vec::normalize(vec::cross(triangle.vertex1 - triangle.vertex0,
-                                      triangle.vertex2 - triangle.vertex0));
-        const auto normal = vec::dot(triangle_normal, r.direction) < 0.0f
-                                ? triangle_normal
-                                : -triangle_normal;
-        auto albedo = scene.materials[triangle.material_id].albedo;
-        const auto p = albedo.x > albedo.y && albedo.x > albedo.z ? albedo.x
-                       : albedo.y > albedo.z                      ? albedo.y
-                                                                  : albedo.z;
-        accumulated_color += accumulated_reflectance *
-                             scene.materials[triangle.material_id].emissivity;
-        if (depth > 5)
+// Adds the sample of a pixel to the plane of its type, which is the one whose
+// luminance is tracked
+FORCE_INLINE void add_sample(Film &film,
+                             Sample_type sample_type,
+                             std::size_t pixel_index,
+                             f32v3 color)
+{
+    const auto y = luminance(color);
+    film.planes[static_cast<std::size_t>(sample_type)][pixel_index] += color;
+    film.luminance_buffer[pixel_index] += y;
+    film.luminance_square_buffer[pixel_index] += y * y;
+    ++film.sample_counts[pixel_index];
+}
+
+FORCE_INLINE void
+add_sample(Film &film, std::size_t pixel_index, const Sample_set &samples)
+{
+    for (std::size_t t {}; t < samples.size(); ++t)
+    {
+        film.planes[t][pixel_index] += samples[t];
+    }
+    const auto y =
+        luminance(samples[static_cast<std::size_t>(Sample_type::color)]);
+    film.luminance_buffer[pixel_index] += y;
+    film.luminance_square_buffer[pixel_index] += y * y;
+    ++film.sample_counts[pixel_index];
+}
+
+// Calls sample8(i, j, pixel_index, samplers) for the runs of 8 pixels
+// (i, j + k) of the rows of the tiles, and sample(i, j, pixel_index, sampler)
+// for the remaining pixels, with their samplers. Tiles do not overlap, so they
+// are rendered in parallel, and every thread writes to its own pixels of the
+// film without synchronization
+template <typename F8, typename F>
+void sample_tiles(const Film &film,
+                  const std::vector<u32> &tile_indices,
+                  Sampler_type sampler_type,
+                  u32 rng_base_state,
+                  Thread_pool &thread_pool,
+                  F8 &&sample8,
+                  F &&sample)
+{
+    const auto image_width = film.image_width;
+    const auto image_height = film.image_height;
+    const auto tiles_x = (image_width + tile_size - 1) / tile_size;
+    thread_pool.parallel_for(
+        static_cast<u32>(tile_indices.size()),
+        [&](u32 task_index)
         {
-            if (random(rng_state) >= p || p < 1e-6f)
+            const auto tile_index = static_cast<int>(tile_indices[task_index]);
+            const auto tile_i = tile_index / tiles_x;
+            const auto tile_j = tile_index % tiles_x;
+            const auto i_end =
+                std::min((tile_i + 1) * tile_size, image_height);
+            const auto j_end = std::min((tile_j + 1) * tile_size, image_width);
+            for (auto i = tile_i * tile_size; i < i_end; ++i)
             {
-                return accumulated_color;
+                const auto row_index = static_cast<std::size_t>(i) *
+                                       static_cast<std::size_t>(image_width);
+                auto j = tile_j * tile_size;
+                for (; j + 8 <= j_end; j += 8)
+                {
+                    const auto pixel_index =
+                        row_index + static_cast<std::size_t>(j);
+                    std::array<Sampler, 8> samplers {};
+                    for (std::size_t k {}; k < samplers.size(); ++k)
+                    {
+                        samplers[k] =
+                            make_sampler(sampler_type,
+                                         rng_base_state,
+                                         static_cast<u32>(pixel_index + k),
+                                         film.sample_counts[pixel_index + k]);
+                    }
+                    sample8(i, j, pixel_index, samplers);
+                }
+                for (; j < j_end; ++j)
+                {
+                    const auto pixel_index =
+                        row_index + static_cast<std::size_t>(j);
+                    auto sampler =
+                        make_sampler(sampler_type,
+                                     rng_base_state,
+                                     static_cast<u32>(pixel_index),
+                                     film.sample_counts[pixel_index]);
+                    sample(i, j, pixel_index, sampler);
+                }
             }
-            else
+        });
+}
+
+// Lists the pixels of the tiles, in tile order so that the camera rays of
+// neighboring entries are coherent, with their samplers
+void list_tile_pixels(const Film &film,
+                      const std::vector<u32> &tile_indices,
+                      Sampler_type sampler_type,
+                      u32 rng_base_state,
+                      std::vector<u32> &pixel_indices,
+                      std::vector<Sampler> &samplers)
+{
+    const auto image_width = film.image_width;
+    const auto image_height = film.image_height;
+    const auto tiles_x = (image_width + tile_size - 1) / tile_size;
+    for (const auto tile_index : tile_indices)
+    {
+        const auto tile_i = static_cast<int>(tile_index) / tiles_x;
+        const auto tile_j = static_cast<int>(tile_index) % tiles_x;
+        const auto i_end = std::min((tile_i + 1) * tile_size, image_height);
+        const auto j_end = std::min((tile_j + 1) * tile_size, image_width);
+        for (auto i = tile_i * tile_size; i < i_end; ++i)
+        {
+            for (auto j = tile_j * tile_size; j < j_end; ++j)
             {
-                albedo *= (1.0f / p);
+                const auto pixel_index = static_cast<u32>(i * image_width + j);
+                pixel_indices.push_back(pixel_index);
+                samplers.push_back(
+                    make_sampler(sampler_type,
+                                 rng_base_state,
+                                 pixel_index,
+                                 film.sample_counts[pixel_index]));
             }
         }
-        accumulated_reflectance *= albedo;
+    }
+}
 
-        auto new_direction = normal + random_unit_vector(rng_state);
-        if (vec::length(new_direction) < 1e-6f)
+// Appends a sphere whose radius varies by 10% in a regular bumpy pattern, of
+// about 4 * resolution^2 triangles
+void append_bumpy_sphere(std::vector<Triangle> &triangles,
+                         f32v3 center,
+                         f32 radius,
+                         int resolution,
+                         u32 material_id)
+{
+    const auto rings = std::max(resolution, 2);
+    const auto segments = 2 * rings;
+    // Computed once each, so that the triangles sharing a vertex have the
+    // exact same position for it
+    std::vector<f32v3> vertices;
+    vertices.reserve(static_cast<std::size_t>(rings + 1) *
+                     static_cast<std::size_t>(segments + 1));
+    for (int ring {}; ring <= rings; ++ring)
+    {
+        for (int segment {}; segment <= segments; ++segment)
         {
-            new_direction = normal;
+            const auto theta =
+                math::pi * static_cast<f32>(ring) / static_cast<f32>(rings);
+            const auto phi = 2.0f * math::pi * static_cast<f32>(segment) /
+                             static_cast<f32>(segments);
+            const auto r =
+                radius * (1.0f + 0.1f * math::sin(6.0f * theta) *
+                                     math::sin(6.0f * phi));
+            vertices.push_back(center +
+                               r * f32v3 {math::sin(theta) * math::cos(phi),
+                                          math::cos(theta),
+                                          math::sin(theta) * math::sin(phi)});
         }
-        else
+    }
+    const auto vertex = [&](int ring, int segment)
+    {
+        return vertices[static_cast<std::size_t>(ring * (segments + 1) +
+                                                 segment)];
+    };
+
+    triangles.reserve(triangles.size() + 4 * static_cast<std::size_t>(rings) *
+                                             static_cast<std::size_t>(rings));
+    for (int i {}; i < rings; ++i)
+    {
+        for (int j {}; j < segments; ++j)
         {
-            new_direction = vec::normalize(new_direction);
+            const auto v00 = vertex(i, j);
+            const auto v01 = vertex(i, j + 1);
+            const auto v10 = vertex(i + 1, j);
+            const auto v11 = vertex(i + 1, j + 1);
+            // The quads touching the poles are degenerate into one triangle
+            if (i != 0)
+            {
+                triangles.push_back({v00, v01, v11, material_id});
+            }
+            if (i != rings - 1)
+            {
+                triangles.push_back({v00, v11, v10, material_id});
+            }
         }
-        r.origin = payload.position + 1e-6f * normal;
-        r.direction = new_direction;
     }
 }
 
+// The mesh seen from +z, framed by the camera. If it has no emissive
+// triangles, it is lit by a white background
+[[nodiscard]] Scene mesh_scene(Mesh mesh,
+                               Vertex_format vertex_format,
+                               Thread_pool &thread_pool)
+{
+    Scene scene {.camera = {},
+                 .triangles = std::move(mesh.triangles),
+                 .meshes = {},
+                 .mesh_instances = {},
+                 .materials = std::move(mesh.materials),
+                 .background_color = {},
+                 .geometry = {},
+                 .lights = {},
+                 .mapped_file = {}};
+    prepare_scene(scene, vertex_format, thread_pool);
+    if (scene.lights.triangle_ids.empty())
+    {
+        scene.background_color = {1.0f, 1.0f, 1.0f};
+    }
+
+    // Far enough for the bounding sphere to fit in the field of view
+    constexpr f32 focal_length {0.035f};
+    constexpr f32 sensor_size {0.025f};
+    const auto &root = scene.geometry.bvh.nodes.front();
+    const auto center = (root.aabb_min + root.aabb_max) * 0.5f;
+    const auto radius = vec::length(root.aabb_max - root.aabb_min) * 0.5f;
+    const auto distance =
+        radius * std::hypot(2.0f * focal_length / sensor_size, 1.0f);
+    scene.camera = create_camera(center + f32v3 {0.0f, 0.0f, distance},
+                                 {0.0f, 0.0f, -1.0f},
+                                 {0.0f, 1.0f, 0.0f},
+                                 focal_length,
+                                 sensor_size,
+                                 sensor_size);
+    return scene;
+}
+
+// Parses the positive integer ending the name of a built-in scene
+[[nodiscard]] std::optional<int> parse_scene_size(std::string_view digits)
+{
+    const auto *const last = digits.data() + digits.size();
+    int size {};
+    const auto [ptr, ec] = std::from_chars(digits.data(), last, size);
+    if (ec != std::errc {} || ptr != last || size <= 0)
+    {
+        return std::nullopt;
+    }
+    return size;
+}
+
 } // namespace
 
+void prepare_scene(Scene &scene, Thread_pool &thread_pool)
+{
+    prepare_scene(scene, Vertex_format::full, thread_pool);
+}
+
+void prepare_scene(Scene &scene,
+                   Vertex_format vertex_format,
+                   Thread_pool &thread_pool)
+{
+    const auto make_object = [&](std::vector<Triangle> &triangles)
+    {
+        std::optional<Vertex_grid> grid {};
+        if (vertex_format == Vertex_format::quantized)
+        {
+            grid = make_vertex_grid(triangles);
+            if (grid.has_value())
+            {
+                snap_to_grid(triangles, *grid);
+            }
+        }
+        auto bvh = build_bvh(triangles, thread_pool);
+        return Object {.triangles = make_triangle_soa(triangles, grid),
+                       .bvh = std::move(bvh)};
+    };
+
+    // One object per mesh, followed by the object of the triangles, placed as
+    // they are
+    std::vector<Object> objects;
+    objects.reserve(scene.meshes.size() + 1);
+    for (auto &mesh : scene.meshes)
+    {
+        objects.push_back(make_object(mesh));
+        // Released as soon as their object holds them, to lower the peak
+        mesh = {};
+    }
+    objects.push_back(make_object(scene.triangles));
+
+    std::vector<Instance> instances;
+    instances.reserve(scene.mesh_instances.size() + 1);
+    for (const auto &mesh_instance : scene.mesh_instances)
+    {
+        instances.push_back(
+            {.object_to_world = mesh_instance.transform,
+             .world_to_object = inverse(mesh_instance.transform),
+             .object_id = mesh_instance.mesh_id,
+             .material_id = mesh_instance.material_id});
+    }
+    instances.push_back({.object_to_world = identity_transform,
+                         .world_to_object = identity_transform,
+                         .object_id = static_cast<u32>(scene.meshes.size()),
+                         .material_id = no_material_override});
+    scene.geometry = build_scene_geometry(
+        std::move(objects), std::move(instances), thread_pool);
+    scene.triangles = {};
+    scene.meshes = {};
+
+    // Every instance of an emissive triangle is a light of its own, whose
+    // area depends on the transform of the instance
+    const auto &geometry = scene.geometry;
+    Aligned_vector<u32> light_instance_ids;
+    Aligned_vector<u32> light_triangle_ids;
+    Aligned_vector<f32> light_cdf;
+    f32 total_area {};
+    for (u32 i {}; i < geometry.instances.size(); ++i)
+    {
+        const auto &instance = geometry.instances[i];
+        const auto &triangles = geometry.objects[instance.object_id].triangles;
+        for (u32 j {}; j < triangles.indices.size(); ++j)
+        {
+            const auto &emissivity =
+                scene.materials[surface_material_id(geometry, i, j)]
+                    .emissivity;
+            if (emissivity.x + emissivity.y + emissivity.z <= 0.0f)
+            {
+                continue;
+            }
+            const auto [vertex0, edge1, edge2] = triangle_edges(triangles, j);
+            const auto world_edge1 =
+                transform_vector(instance.object_to_world, edge1);
+            const auto world_edge2 =
+                transform_vector(instance.object_to_world, edge2);
+            const auto area =
+                0.5f * vec::length(vec::cross(world_edge1, world_edge2));
+            if (area > 0.0f)
+            {
+                total_area += area;
+                light_instance_ids.push_back(i);
+                light_triangle_ids.push_back(j);
+                light_cdf.push_back(total_area);
+            }
+        }
+    }
+    for (auto &c : light_cdf)
+    {
+        c /= total_area;
+    }
+    scene.lights = {.instance_ids = std::move(light_instance_ids),
+                    .triangle_ids = std::move(light_triangle_ids),
+                    .cdf = std::move(light_cdf),
+                    .total_area = total_area};
+}
+
 Camera create_camera(f32v3 position,
                      f32v3 direction,
                      f32v3 up,
@@ -84,7 +541,12 @@ Camera create_camera(f32v3 position,
                    .sensor_height = sensor_height};
 }
 
-Scene cornell_box()
+namespace
+{
+
+// The Cornell box before prepare_scene(), to which the other built-in scenes
+// add their objects
+[[nodiscard]] Scene cornell_box_input()
 {
     // Adapted from http://www.graphics.cornell.edu/online/box/data.html
 
@@ -158,7 +620,7 @@ Scene cornell_box()
     constexpr Material emissive {.albedo = {},
                                  .emissivity = {12.0f, 12.0f, 12.0f}};
 
-    return Scene {
+    Scene scene {
         .camera = create_camera(
             {278, 273, -800}, {0, 0, 1}, {0, 1, 0}, 0.035f, 0.025f, 0.025f),
         .triangles =
@@ -194,91 +656,541 @@ Scene cornell_box()
              {tall_block[12 + 0], tall_block[12 + 2], tall_block[12 + 3], 0},
              {tall_block[16 + 0], tall_block[16 + 1], tall_block[16 + 2], 0},
              {tall_block[16 + 0], tall_block[16 + 2], tall_block[16 + 3], 0}},
+        .meshes = {},
+        .mesh_instances = {},
         .materials = {white, green, red, emissive},
-        .background_color = {}};
+        .background_color = {},
+        .geometry = {},
+        .lights = {},
+        .mapped_file = {}};
+    return scene;
 }
 
-f32v3 sample_pixel(const Scene &scene,
-                   int pixel_i,
-                   int pixel_j,
-                   int image_width,
-                   int image_height,
-                   Sample_type sample_type,
-                   u32 &rng_state,
-                   u32 color_rng_state)
+} // namespace
+
+Scene cornell_box(Vertex_format vertex_format, Thread_pool &thread_pool)
 {
-    const auto x = (static_cast<f32>(pixel_j) + random(rng_state)) /
-                       static_cast<f32>(image_width) -
-                   0.5f;
-    const auto y =
-        (static_cast<f32>(image_height - 1 - pixel_i) + random(rng_state)) /
-            static_cast<f32>(image_height) -
-        0.5f;
-    const Ray ray {.origin = scene.camera.position,
-                   .direction = vec::normalize(
-                       scene.camera.focal_length * scene.camera.direction +
-                       x * scene.camera.sensor_width * scene.camera.local_x +
-                       y * scene.camera.sensor_height * scene.camera.local_y)};
+    auto scene = cornell_box_input();
+    prepare_scene(scene, vertex_format, thread_pool);
+    return scene;
+}
 
-    switch (sample_type)
-    {
-    case Sample_type::color:
+Scene cornell_box_sphere(int resolution,
+                         Vertex_format vertex_format,
+                         Thread_pool &thread_pool)
+{
+    auto scene = cornell_box_input();
+
+    const auto material_id = static_cast<u32>(scene.materials.size());
+    scene.materials.push_back(
+        {.albedo = {0.75f, 0.75f, 0.25f}, .emissivity = {}});
+    append_bumpy_sphere(scene.triangles,
+                        {200.0f, 420.0f, 300.0f},
+                        70.0f,
+                        resolution,
+                        material_id);
+
+    prepare_scene(scene, vertex_format, thread_pool);
+    return scene;
+}
+
+Scene cornell_box_instances(int count,
+                            Vertex_format vertex_format,
+                            Thread_pool &thread_pool)
+{
+    auto scene = cornell_box_input();
+
+    // Materials of the instances, cycled through
+    const auto first_material_id = static_cast<u32>(scene.materials.size());
+    constexpr f32v3 albedos[] {{0.75f, 0.75f, 0.25f},
+                               {0.25f, 0.75f, 0.75f},
+                               {0.75f, 0.25f, 0.75f},
+                               {0.75f, 0.75f, 0.75f}};
+    constexpr auto albedo_count = static_cast<u32>(std::size(albedos));
+    for (const auto &albedo : albedos)
     {
-        return radiance(scene, ray, rng_state);
+        scene.materials.push_back({.albedo = albedo, .emissivity = {}});
     }
-    case Sample_type::albedo:
+
+    // A unit sphere at the origin, placed on a grid in front of the blocks
+    scene.meshes.emplace_back();
+    append_bumpy_sphere(
+        scene.meshes.back(), {}, 1.0f, 32, no_material_override);
+    const auto n = std::max(count, 1);
+    const auto cell_size = 500.0f / static_cast<f32>(n);
+    for (int i {}; i < n; ++i)
     {
-        const auto payload = intersect(ray, scene.triangles);
-        if (payload.primitive_id == 0xffffffffu)
+        for (int j {}; j < n; ++j)
         {
-            return scene.background_color;
+            const auto k = static_cast<u32>(i * n + j);
+            auto rng_state = seed(k);
+            const auto angle = 2.0f * math::pi * random(rng_state);
+            const auto radius = cell_size * (0.25f + 0.15f * random(rng_state));
+            const auto c = math::cos(angle);
+            const auto s = math::sin(angle);
+            const auto x = 28.0f + cell_size * (static_cast<f32>(j) + 0.5f);
+            const auto y = 24.0f + cell_size * (static_cast<f32>(i) + 0.5f);
+            // Rotated about y, and squashed vertically
+            const Transform transform {.x = f32v3 {c, 0.0f, -s} * radius,
+                                       .y = f32v3 {0.0f, 0.75f, 0.0f} * radius,
+                                       .z = f32v3 {s, 0.0f, c} * radius,
+                                       .translation = {x, y, 40.0f}};
+            scene.mesh_instances.push_back(
+                {.mesh_id = 0,
+                 .transform = transform,
+                 .material_id = first_material_id + k % albedo_count});
         }
-        return scene
-            .materials[scene.triangles[payload.primitive_id].material_id]
-            .albedo;
     }
-    case Sample_type::normal:
+
+    prepare_scene(scene, vertex_format, thread_pool);
+    return scene;
+}
+
+std::optional<Scene> load_scene(std::string_view name,
+                                Vertex_format vertex_format,
+                                Thread_pool &thread_pool)
+{
+    if (name.ends_with(".scene"))
+    {
+        return load_scene_cache(std::filesystem::path {name});
+    }
+    if (name.ends_with(".obj") || name.ends_with(".ply"))
     {
-        const auto payload = intersect(ray, scene.triangles);
-        if (payload.primitive_id == 0xffffffffu)
+        auto mesh = load_mesh(std::filesystem::path {name}, thread_pool);
+        if (!mesh.has_value())
         {
-            return {};
+            return std::nullopt;
         }
-        const auto &triangle = scene.triangles[payload.primitive_id];
-        const auto normal =
-            vec::normalize(vec::cross(triangle.vertex1 - triangle.vertex0,
-                                      triangle.vertex2 - triangle.vertex0));
-        return (normal + f32v3 {1.0f, 1.0f, 1.0f}) * 0.5f;
+        return mesh_scene(std::move(*mesh), vertex_format, thread_pool);
     }
-    case Sample_type::barycentric:
+    if (name == "cornell_box")
     {
-        const auto payload = intersect(ray, scene.triangles);
-        if (payload.primitive_id == 0xffffffffu)
+        return cornell_box(vertex_format, thread_pool);
+    }
+    if (constexpr std::string_view prefix {"sphere_"}; name.starts_with(prefix))
+    {
+        const auto resolution = parse_scene_size(name.substr(prefix.size()));
+        if (resolution.has_value())
         {
-            return {};
+            return cornell_box_sphere(*resolution, vertex_format, thread_pool);
         }
-        return {1.0f - payload.u - payload.v, payload.u, payload.v};
     }
-    case Sample_type::primitive_id:
+    if (constexpr std::string_view prefix {"instances_"};
+        name.starts_with(prefix))
     {
-        const auto payload = intersect(ray, scene.triangles);
-        if (payload.primitive_id == 0xffffffffu)
+        const auto count = parse_scene_size(name.substr(prefix.size()));
+        if (count.has_value())
         {
-            return {};
+            return cornell_box_instances(*count, vertex_format, thread_pool);
         }
-        return random_color(color_rng_state, payload.primitive_id);
     }
-    case Sample_type::material_id:
+    return std::nullopt;
+}
+
+Ray generate_ray(const Camera &camera,
+                 int pixel_i,
+                 int pixel_j,
+                 int image_width,
+                 int image_height,
+                 Sampler &sampler)
+{
+    f32 jitter_x {};
+    f32 jitter_y {};
+    next_2d(sampler, jitter_x, jitter_y);
+    const auto x = (static_cast<f32>(pixel_j) + jitter_x) /
+                       static_cast<f32>(image_width) -
+                   0.5f;
+    const auto y = (static_cast<f32>(image_height - 1 - pixel_i) + jitter_y) /
+                       static_cast<f32>(image_height) -
+                   0.5f;
+    return {.origin = camera.position,
+            .direction =
+                vec::normalize(camera.focal_length * camera.direction +
+                               x * camera.sensor_width * camera.local_x +
+                               y * camera.sensor_height * camera.local_y)};
+}
+
+template <Sample_type sample_type>
+f32v3 sample_pixel(const Scene &scene,
+                   int pixel_i,
+                   int pixel_j,
+                   int image_width,
+                   int image_height,
+                   Sampler &sampler,
+                   u32 color_rng_state)
+{
+    const auto ray = generate_ray(
+        scene.camera, pixel_i, pixel_j, image_width, image_height, sampler);
+    const auto payload = intersect(ray, scene.geometry);
+    return shade<sample_type>(scene, ray, payload, sampler, color_rng_state);
+}
+
+template <Sample_type sample_type>
+std::array<f32v3, 8> sample_pixel8(const Scene &scene,
+                                   int pixel_i,
+                                   int pixel_j,
+                                   int image_width,
+                                   int image_height,
+                                   std::array<Sampler, 8> &samplers,
+                                   u32 color_rng_state)
+{
+    std::array<Ray, 8> rays {};
+    for (std::size_t k {}; k < rays.size(); ++k)
+    {
+        rays[k] = generate_ray(scene.camera,
+                               pixel_i,
+                               pixel_j + static_cast<int>(k),
+                               image_width,
+                               image_height,
+                               samplers[k]);
+    }
+    const auto packet = make_packet(rays);
+    const auto payloads = intersect8(packet, scene.geometry);
+
+    std::array<f32v3, 8> colors {};
+    for (std::size_t k {}; k < colors.size(); ++k)
     {
-        const auto payload = intersect(ray, scene.triangles);
-        if (payload.primitive_id == 0xffffffffu)
+        colors[k] = shade<sample_type>(
+            scene, rays[k], payloads[k], samplers[k], color_rng_state);
+    }
+    return colors;
+}
+
+template f32v3 sample_pixel<Sample_type::color>(
+    const Scene &, int, int, int, int, Sampler &, u32);
+template std::array<f32v3, 8> sample_pixel8<Sample_type::color>(
+    const Scene &, int, int, int, int, std::array<Sampler, 8> &, u32);
+
+template f32v3 sample_pixel<Sample_type::albedo>(
+    const Scene &, int, int, int, int, Sampler &, u32);
+template std::array<f32v3, 8> sample_pixel8<Sample_type::albedo>(
+    const Scene &, int, int, int, int, std::array<Sampler, 8> &, u32);
+
+template f32v3 sample_pixel<Sample_type::normal>(
+    const Scene &, int, int, int, int, Sampler &, u32);
+template std::array<f32v3, 8> sample_pixel8<Sample_type::normal>(
+    const Scene &, int, int, int, int, std::array<Sampler, 8> &, u32);
+
+template f32v3 sample_pixel<Sample_type::barycentric>(
+    const Scene &, int, int, int, int, Sampler &, u32);
+template std::array<f32v3, 8> sample_pixel8<Sample_type::barycentric>(
+    const Scene &, int, int, int, int, std::array<Sampler, 8> &, u32);
+
+template f32v3 sample_pixel<Sample_type::primitive_id>(
+    const Scene &, int, int, int, int, Sampler &, u32);
+template std::array<f32v3, 8> sample_pixel8<Sample_type::primitive_id>(
+    const Scene &, int, int, int, int, std::array<Sampler, 8> &, u32);
+
+template f32v3 sample_pixel<Sample_type::material_id>(
+    const Scene &, int, int, int, int, Sampler &, u32);
+template std::array<f32v3, 8> sample_pixel8<Sample_type::material_id>(
+    const Scene &, int, int, int, int, std::array<Sampler, 8> &, u32);
+
+Film make_film(int image_width, int image_height)
+{
+    const auto image_size = static_cast<std::size_t>(image_width) *
+                            static_cast<std::size_t>(image_height);
+    const auto tile_count =
+        static_cast<std::size_t>((image_width + tile_size - 1) / tile_size) *
+        static_cast<std::size_t>((image_height + tile_size - 1) / tile_size);
+    return {.image_width = image_width,
+            .image_height = image_height,
+            .planes = {},
+            .luminance_buffer = std::vector<f32>(image_size),
+            .luminance_square_buffer = std::vector<f32>(image_size),
+            .sample_counts = std::vector<u32>(image_size),
+            .active_tiles = std::vector<u8>(tile_count, 1),
+            .samples = 0};
+}
+
+void clear_film(Film &film)
+{
+    // The capacity is kept for the next planes
+    for (auto &plane : film.planes)
+    {
+        plane.clear();
+    }
+    std::fill(
+        film.luminance_buffer.begin(), film.luminance_buffer.end(), 0.0f);
+    std::fill(film.luminance_square_buffer.begin(),
+              film.luminance_square_buffer.end(),
+              0.0f);
+    std::fill(film.sample_counts.begin(), film.sample_counts.end(), 0u);
+    std::fill(film.active_tiles.begin(), film.active_tiles.end(), u8 {1});
+    film.samples = 0;
+}
+
+void accumulate_sample(const Scene &scene,
+                       Sample_type sample_type,
+                       Sampler_type sampler_type,
+                       Integrator_type integrator_type,
+                       u32 rng_base_state,
+                       u32 color_rng_state,
+                       Film &film,
+                       Thread_pool &thread_pool)
+{
+    const auto tile_indices = active_tile_indices(film);
+    allocate_planes(film, {&sample_type, 1});
+
+    // The other sample types only need the primary hit, which the depth-first,
+    // wavefront and sorted wavefront integrators all compute the same way
+    if (integrator_type != Integrator_type::depth_first &&
+        sample_type == Sample_type::color)
+    {
+        std::vector<u32> pixel_indices;
+        std::vector<Sampler> samplers;
+        list_tile_pixels(film,
+                         tile_indices,
+                         sampler_type,
+                         rng_base_state,
+                         pixel_indices,
+                         samplers);
+        std::vector<f32v3> colors(pixel_indices.size());
+        trace_paths_wavefront(scene,
+                              film.image_width,
+                              film.image_height,
+                              pixel_indices,
+                              samplers,
+                              colors,
+                              integrator_type ==
+                                  Integrator_type::wavefront_sorted,
+                              thread_pool);
+        for (std::size_t k {}; k < pixel_indices.size(); ++k)
         {
-            return {};
+            add_sample(film, sample_type, pixel_indices[k], colors[k]);
         }
-        return random_color(color_rng_state,
-                            scene.triangles[payload.primitive_id].material_id);
+        ++film.samples;
+        return;
     }
+
+    // The sample type is dispatched once for the whole film
+    const auto render_tiles = [&]<Sample_type type>()
+    {
+        sample_tiles(
+            film,
+            tile_indices,
+            sampler_type,
+            rng_base_state,
+            thread_pool,
+            [&](int i,
+                int j,
+                std::size_t pixel_index,
+                std::array<Sampler, 8> &samplers)
+            {
+                const auto colors = sample_pixel8<type>(scene,
+                                                        i,
+                                                        j,
+                                                        film.image_width,
+                                                        film.image_height,
+                                                        samplers,
+                                                        color_rng_state);
+                for (std::size_t k {}; k < colors.size(); ++k)
+                {
+                    add_sample(film, type, pixel_index + k, colors[k]);
+                }
+            },
+            [&](int i, int j, std::size_t pixel_index, Sampler &sampler)
+            {
+                add_sample(film,
+                           type,
+                           pixel_index,
+                           sample_pixel<type>(scene,
+                                              i,
+                                              j,
+                                              film.image_width,
+                                              film.image_height,
+                                              sampler,
+                                              color_rng_state));
+            });
+    };
+    dispatch_sample_type(sample_type, render_tiles);
+
+    ++film.samples;
+}
+
+void accumulate_sample(const Scene &scene,
+                       Sampler_type sampler_type,
+                       Integrator_type integrator_type,
+                       u32 rng_base_state,
+                       u32 color_rng_state,
+                       Film &film,
+                       Thread_pool &thread_pool)
+{
+    const auto tile_indices = active_tile_indices(film);
+    constexpr Sample_type sample_types[] {Sample_type::color,
+                                          Sample_type::albedo,
+                                          Sample_type::normal,
+                                          Sample_type::barycentric,
+                                          Sample_type::primitive_id,
+                                          Sample_type::material_id};
+    static_assert(std::size(sample_types) == sample_type_count);
+    allocate_planes(film, sample_types);
+
+    if (integrator_type != Integrator_type::depth_first)
+    {
+        std::vector<u32> pixel_indices;
+        std::vector<Sampler> samplers;
+        list_tile_pixels(film,
+                         tile_indices,
+                         sampler_type,
+                         rng_base_state,
+                         pixel_indices,
+                         samplers);
+        std::vector<f32v3> colors(pixel_indices.size());
+        std::vector<Ray_payload> payloads(pixel_indices.size());
+        trace_paths_wavefront(scene,
+                              film.image_width,
+                              film.image_height,
+                              pixel_indices,
+                              samplers,
+                              colors,
+                              payloads,
+                              integrator_type ==
+                                  Integrator_type::wavefront_sorted,
+                              thread_pool);
+        // Every pixel is listed once, so chunks of them are shaded in
+        // parallel without synchronization
+        constexpr auto chunk_size =
+            static_cast<std::size_t>(tile_size * tile_size);
+        const auto chunk_count = static_cast<u32>(
+            (pixel_indices.size() + chunk_size - 1) / chunk_size);
+        thread_pool.parallel_for(
+            chunk_count,
+            [&](u32 chunk)
+            {
+                const auto begin = chunk * chunk_size;
+                const auto end =
+                    std::min(begin + chunk_size, pixel_indices.size());
+                for (auto k = begin; k < end; ++k)
+                {
+                    Sample_set samples {};
+                    samples[static_cast<std::size_t>(Sample_type::color)] =
+                        colors[k];
+                    shade_primary_hit(
+                        scene, payloads[k], color_rng_state, samples);
+                    add_sample(film, pixel_indices[k], samples);
+                }
+            });
+        ++film.samples;
+        return;
     }
 
-    return {};
+    sample_tiles(
+        film,
+        tile_indices,
+        sampler_type,
+        rng_base_state,
+        thread_pool,
+        [&](int i,
+            int j,
+            std::size_t pixel_index,
+            std::array<Sampler, 8> &samplers)
+        {
+            std::array<Ray, 8> rays {};
+            for (std::size_t k {}; k < rays.size(); ++k)
+            {
+                rays[k] = generate_ray(scene.camera,
+                                       i,
+                                       j + static_cast<int>(k),
+                                       film.image_width,
+                                       film.image_height,
+                                       samplers[k]);
+            }
+            const auto payloads =
+                intersect8(make_packet(rays), scene.geometry);
+            for (std::size_t k {}; k < payloads.size(); ++k)
+            {
+                Sample_set samples {};
+                samples[static_cast<std::size_t>(Sample_type::color)] =
+                    radiance(scene, rays[k], payloads[k], samplers[k]);
+                shade_primary_hit(
+                    scene, payloads[k], color_rng_state, samples);
+                add_sample(film, pixel_index + k, samples);
+            }
+        },
+        [&](int i, int j, std::size_t pixel_index, Sampler &sampler)
+        {
+            const auto ray = generate_ray(scene.camera,
+                                          i,
+                                          j,
+                                          film.image_width,
+                                          film.image_height,
+                                          sampler);
+            const auto payload = intersect(ray, scene.geometry);
+            Sample_set samples {};
+            samples[static_cast<std::size_t>(Sample_type::color)] =
+                radiance(scene, ray, payload, sampler);
+            shade_primary_hit(scene, payload, color_rng_state, samples);
+            add_sample(film, pixel_index, samples);
+        });
+
+    ++film.samples;
+}
+
+u32 update_active_tiles(Film &film, f32 error_threshold, int min_samples)
+{
+    const auto tiles_x = (film.image_width + tile_size - 1) / tile_size;
+    u32 active_count {};
+    for (std::size_t t {}; t < film.active_tiles.size(); ++t)
+    {
+        if (film.active_tiles[t] == 0)
+        {
+            continue;
+        }
+        const auto tile_i = static_cast<int>(t) / tiles_x;
+        const auto tile_j = static_cast<int>(t) % tiles_x;
+        const auto i_begin = tile_i * tile_size;
+        const auto j_begin = tile_j * tile_size;
+        const auto i_end = std::min(i_begin + tile_size, film.image_height);
+        const auto j_end = std::min(j_begin + tile_size, film.image_width);
+
+        // All the pixels of an active tile have the same sample count. Tiles
+        // are only evaluated when it doubles, so that a few lucky samples do
+        // not retire them early, and so that the tile is a complete net of
+        // the Sobol sequence
+        const auto n =
+            film.sample_counts[static_cast<std::size_t>(i_begin) *
+                                   static_cast<std::size_t>(film.image_width) +
+                               static_cast<std::size_t>(j_begin)];
+        if (n < static_cast<u32>(std::max(min_samples, 2)) ||
+            (n & (n - 1)) != 0)
+        {
+            ++active_count;
+            continue;
+        }
+
+        const auto count = static_cast<f32>(n);
+        f32 error_square_sum {};
+        for (auto i = i_begin; i < i_end; ++i)
+        {
+            for (auto j = j_begin; j < j_end; ++j)
+            {
+                const auto pixel_index =
+                    static_cast<std::size_t>(i) *
+                        static_cast<std::size_t>(film.image_width) +
+                    static_cast<std::size_t>(j);
+                const auto mean = film.luminance_buffer[pixel_index] / count;
+                const auto variance = math::max(
+                    (film.luminance_square_buffer[pixel_index] -
+                     count * mean * mean) /
+                        (count - 1.0f),
+                    0.0f);
+                // Squared standard error of the mean, relative to the mean.
+                // The offset keeps black pixels from needing infinitely many
+                // samples
+                const auto reference = mean + 1e-2f;
+                error_square_sum += variance / (count * reference * reference);
+            }
+        }
+
+        const auto pixel_count = static_cast<f32>((i_end - i_begin) *
+                                                  (j_end - j_begin));
+        if (error_square_sum / pixel_count < error_threshold * error_threshold)
+        {
+            film.active_tiles[t] = 0;
+            continue;
+        }
+        ++active_count;
+    }
+    return active_count;
 }
@@ -1,9 +1,17 @@
 #ifndef RENDER_HPP
 #define RENDER_HPP
 
+#include "sampler.hpp"
+#include "thread_pool.hpp"
 #include "trace.hpp"
 #include "vec.hpp"
 
+#include <array>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
 struct Camera
 {
     f32v3 position;
@@ -21,14 +29,71 @@ struct Material
     f32v3 emissivity;
 };
 
+// Emissive triangles of the instances, sampled proportionally to their area in
+// world space
+struct Lights
+{
+    Buffer<u32> instance_ids;
+    Buffer<u32> triangle_ids;
+    // Cumulative areas, normalized such that the last one is 1
+    Buffer<f32> cdf;
+    f32 total_area;
+};
+
+// Places a mesh of the scene
+struct Mesh_instance
+{
+    u32 mesh_id;
+    Transform transform;
+    // Material of every triangle of the mesh, or no_material_override to keep
+    // theirs
+    u32 material_id;
+};
+
+class Mapped_file;
+
 struct Scene
 {
     Camera camera;
+    // Input of prepare_scene(): triangles in world space, and meshes in their
+    // own space placed by instances. The triangles and the meshes are released
+    // once built into the geometry, and empty for the scenes loaded from a
+    // cache, which only have the data used for rendering
     std::vector<Triangle> triangles;
+    std::vector<std::vector<Triangle>> meshes;
+    std::vector<Mesh_instance> mesh_instances;
     std::vector<Material> materials;
     f32v3 background_color;
+    // Built from the triangles and the meshes, whose triangles are stored in
+    // the order of the BVH leaves
+    Scene_geometry geometry;
+    Lights lights;
+    // Mapped cache file viewed by the arrays of the scene, if any
+    std::shared_ptr<const Mapped_file> mapped_file {};
 };
 
+// Number of triangles stored, counting those of an instanced mesh once
+[[nodiscard]] FORCE_INLINE std::size_t triangle_count(const Scene &scene)
+{
+    std::size_t count {};
+    for (const auto &object : scene.geometry.objects)
+    {
+        count += object.triangles.indices.size();
+    }
+    return count;
+}
+
+// Vertex positions are stored as floats, or as 16-bit coordinates on a grid
+// over their object, which takes half the memory but moves every vertex by
+// less than 1/65534 of the extent of the object
+enum struct Vertex_format
+{
+    full,
+    quantized,
+};
+
+constexpr inline const char *vertex_format_names[] {"full", "quantized"};
+
 enum struct Sample_type
 {
     color,
@@ -39,6 +104,101 @@ enum struct Sample_type
     material_id,
 };
 
+constexpr inline const char *sample_type_names[] {"color",
+                                                   "albedo",
+                                                   "normal",
+                                                   "barycentric",
+                                                   "primitive_id",
+                                                   "material_id"};
+
+constexpr inline std::size_t sample_type_count {std::size(sample_type_names)};
+
+// Calls f.template operator()<sample_type>(), e.g. of a lambda
+// []<Sample_type type>() {...}, so that code specialized for every sample type
+// is selected once, rather than for every sample
+template <typename F>
+FORCE_INLINE void dispatch_sample_type(Sample_type sample_type, F &&f)
+{
+    switch (sample_type)
+    {
+    case Sample_type::color:
+        f.template operator()<Sample_type::color>();
+        return;
+    case Sample_type::albedo:
+        f.template operator()<Sample_type::albedo>();
+        return;
+    case Sample_type::normal:
+        f.template operator()<Sample_type::normal>();
+        return;
+    case Sample_type::barycentric:
+        f.template operator()<Sample_type::barycentric>();
+        return;
+    case Sample_type::primitive_id:
+        f.template operator()<Sample_type::primitive_id>();
+        return;
+    case Sample_type::material_id:
+        f.template operator()<Sample_type::material_id>();
+        return;
+    }
+}
+
+// The depth-first integrator traces every path to completion before starting
+// the next one, the wavefront integrator advances all the paths of a pass
+// together, one bounce at a time, and wavefront_sorted also sorts the bounce
+// rays for coherence before tracing them. All produce the same images, and
+// only differ for the color sample type
+enum struct Integrator_type
+{
+    depth_first,
+    wavefront,
+    wavefront_sorted,
+};
+
+constexpr inline const char *integrator_type_names[] {
+    "depth_first", "wavefront", "wavefront_sorted"};
+
+// Images are rendered in square tiles of tile_size pixels, which are also the
+// unit of adaptive sampling
+constexpr inline int tile_size {16};
+
+// Samples that every pixel gets before adaptive sampling estimates its error
+constexpr inline int adaptive_min_samples {16};
+
+// Sum of the samples of every pixel, to be divided by its sample count, in one
+// plane per sample type, and of their luminance and squared luminance, from
+// which the variance of the pixel is estimated. Only the planes of the sample
+// types being rendered are allocated, and the luminance is that of the color
+// when all of them are. Only the active tiles receive new samples
+struct Film
+{
+    int image_width;
+    int image_height;
+    // Indexed by Sample_type
+    std::array<std::vector<f32v3>, sample_type_count> planes;
+    std::vector<f32> luminance_buffer;
+    std::vector<f32> luminance_square_buffer;
+    std::vector<u32> sample_counts;
+    std::vector<u8> active_tiles;
+    // Number of passes over the image, the largest sample count of any pixel
+    int samples;
+};
+
+// Builds the data derived from the triangles and the meshes: an object with
+// its BVH for the triangles and for every mesh, the instances placing them
+// with the BVH over the instances, and the list of lights. Must be called
+// once the triangles, the meshes and their instances are set, and releases the
+// triangles and the meshes, which are then only stored in the objects, in the
+// order of the BVH leaves. The vertices are stored as floats
+void prepare_scene(Scene &scene, Thread_pool &thread_pool);
+
+// With quantized vertices, the triangles of every object are first snapped to
+// a grid over the object, so that its BVH bounds them exactly. Objects too far
+// from their origin, relative to their extent, for the grid to be exact keep
+// floats
+void prepare_scene(Scene &scene,
+                   Vertex_format vertex_format,
+                   Thread_pool &thread_pool);
+
 [[nodiscard]] Camera create_camera(f32v3 position,
                                    f32v3 direction,
                                    f32v3 up,
@@ -46,15 +206,110 @@ enum struct Sample_type
                                    f32 sensor_width,
                                    f32 sensor_height);
 
-[[nodiscard]] Scene cornell_box();
+// The built-in scenes are prepared with the given vertex format
+[[nodiscard]] Scene cornell_box(Vertex_format vertex_format,
+                                Thread_pool &thread_pool);
+
+// Cornell box with a bumpy sphere of about 4 * resolution^2 triangles, used to
+// test larger meshes
+[[nodiscard]] Scene cornell_box_sphere(int resolution,
+                                       Vertex_format vertex_format,
+                                       Thread_pool &thread_pool);
+
+// Cornell box filled with count^2 instances of a bumpy sphere of about 4000
+// triangles, rotated, scaled and colored differently, used to test instancing
+[[nodiscard]] Scene cornell_box_instances(int count,
+                                          Vertex_format vertex_format,
+                                          Thread_pool &thread_pool);
 
+// Returns the built-in scene with the given name: "cornell_box",
+// "sphere_<resolution>" for cornell_box_sphere(resolution),
+// "instances_<count>" for cornell_box_instances(count), the mesh of a
+// .obj or .ply file seen from +z, lit by a white background if it has no
+// emissive triangles, or a .scene file written by save_scene_cache(). Returns
+// nothing for an unknown name or a file that cannot be loaded. The BVHs are
+// built, and the mesh files parsed, with the threads of the pool. Cached
+// scenes keep the vertex format that they were saved with
+[[nodiscard]] std::optional<Scene> load_scene(std::string_view name,
+                                              Vertex_format vertex_format,
+                                              Thread_pool &thread_pool);
+
+// Returns a camera ray through a random point of the pixel
+[[nodiscard]] Ray generate_ray(const Camera &camera,
+                               int pixel_i,
+                               int pixel_j,
+                               int image_width,
+                               int image_height,
+                               Sampler &sampler);
+
+// Instantiated for every sample type, see dispatch_sample_type()
+template <Sample_type sample_type>
 [[nodiscard]] f32v3 sample_pixel(const Scene &scene,
                                  int pixel_i,
                                  int pixel_j,
                                  int image_width,
                                  int image_height,
-                                 Sample_type sample_type,
-                                 u32 &rng_state,
+                                 Sampler &sampler,
                                  u32 color_rng_state);
 
+// Samples the 8 pixels (pixel_i, pixel_j + k), tracing their primary rays as a
+// packet. samplers[k] is the sampler of pixel k
+template <Sample_type sample_type>
+[[nodiscard]] std::array<f32v3, 8>
+sample_pixel8(const Scene &scene,
+              int pixel_i,
+              int pixel_j,
+              int image_width,
+              int image_height,
+              std::array<Sampler, 8> &samplers,
+              u32 color_rng_state);
+
+[[nodiscard]] Film make_film(int image_width, int image_height);
+
+// Removes every sample and plane, and activates every tile
+void clear_film(Film &film);
+
+// Returns black if the sample type is not rendered
+[[nodiscard]] FORCE_INLINE f32v3 pixel_color(const Film &film,
+                                             Sample_type sample_type,
+                                             std::size_t pixel_index)
+{
+    const auto &plane = film.planes[static_cast<std::size_t>(sample_type)];
+    const auto count = film.sample_counts[pixel_index];
+    return count > 0 && !plane.empty()
+               ? plane[pixel_index] * (1.0f / static_cast<f32>(count))
+               : f32v3 {};
+}
+
+// Adds one sample to every pixel of the active tiles of the film. Tiles are
+// rendered in parallel, and the random numbers of every pixel only depend on
+// the pixel and its sample count, so the result does not depend on the number
+// of threads or on the integrator
+void accumulate_sample(const Scene &scene,
+                       Sample_type sample_type,
+                       Sampler_type sampler_type,
+                       Integrator_type integrator_type,
+                       u32 rng_base_state,
+                       u32 color_rng_state,
+                       Film &film,
+                       Thread_pool &thread_pool);
+
+// Adds one sample of every sample type to its plane, all from the same primary
+// hits, e.g. to switch between them or to guide a denoiser without rendering
+// the image again. Adaptive sampling follows the color
+void accumulate_sample(const Scene &scene,
+                       Sampler_type sampler_type,
+                       Integrator_type integrator_type,
+                       u32 rng_base_state,
+                       u32 color_rng_state,
+                       Film &film,
+                       Thread_pool &thread_pool);
+
+// Estimates the error of every tile as the root mean square of the relative
+// standard errors of its pixels, and deactivates the tiles whose error is below
+// error_threshold. Tiles are evaluated when their sample count reaches a power
+// of two of at least min_samples. Returns the number of tiles that are still
+// active
+u32 update_active_tiles(Film &film, f32 error_threshold, int min_samples);
+
 #endif // RENDER_HPP
@@ -0,0 +1,291 @@
+#include "render_thread.hpp"
+
+#include "denoise.hpp"
+
+#include <algorithm>
+
+Render_thread::Render_thread(const Scene &scene, const Settings &settings)
+    : m_scene {scene},
+      m_settings {settings},
+      m_thread_pool {settings.thread_count},
+      m_film {make_film(settings.image_width, settings.image_height)},
+      m_active_tile_count {static_cast<u32>(m_film.active_tiles.size())}
+{
+    for (auto &film : m_films)
+    {
+        film = m_film;
+    }
+    for (auto &denoised_color : m_denoised_colors)
+    {
+        denoised_color.resize(static_cast<std::size_t>(settings.image_width) *
+                              static_cast<std::size_t>(settings.image_height));
+    }
+    m_thread = std::thread([this] { thread_main(); });
+}
+
+Render_thread::~Render_thread()
+{
+    {
+        const std::lock_guard lock {m_mutex};
+        m_stop = true;
+    }
+    m_condition.notify_one();
+    m_thread.join();
+}
+
+u32 Render_thread::thread_count() const noexcept
+{
+    return m_thread_pool.thread_count();
+}
+
+void Render_thread::reset()
+{
+    push(Reset {});
+}
+
+void Render_thread::set_sample_type(Sample_type sample_type)
+{
+    push(Set_sample_type {sample_type});
+}
+
+void Render_thread::set_all_sample_types(bool all_sample_types)
+{
+    push(Set_all_sample_types {all_sample_types});
+}
+
+void Render_thread::set_sampler_type(Sampler_type sampler_type)
+{
+    push(Set_sampler_type {sampler_type});
+}
+
+void Render_thread::set_integrator_type(Integrator_type integrator_type)
+{
+    push(Set_integrator_type {integrator_type});
+}
+
+void Render_thread::set_total_samples(int total_samples)
+{
+    push(Set_total_samples {total_samples});
+}
+
+void Render_thread::set_error_threshold(f32 error_threshold)
+{
+    push(Set_error_threshold {error_threshold});
+}
+
+void Render_thread::set_denoise_passes(int denoise_passes)
+{
+    push(Set_denoise_passes {denoise_passes});
+}
+
+void Render_thread::set_color_rng_state(u32 color_rng_state)
+{
+    push(Set_color_rng_state {color_rng_state});
+}
+
+const Film *Render_thread::acquire_film()
+{
+    if ((m_ready_state.load(std::memory_order_relaxed) & fresh_bit) == 0)
+    {
+        return nullptr;
+    }
+    m_front_index =
+        m_ready_state.exchange(m_front_index, std::memory_order_acq_rel) &
+        ~fresh_bit;
+    return &m_films[m_front_index];
+}
+
+std::span<const f32v3> Render_thread::denoised_color() const noexcept
+{
+    if (!m_denoised[m_front_index])
+    {
+        return {};
+    }
+    return m_denoised_colors[m_front_index];
+}
+
+void Render_thread::push(const Command &command)
+{
+    {
+        const std::lock_guard lock {m_mutex};
+        m_commands.push_back(command);
+    }
+    m_condition.notify_one();
+}
+
+void Render_thread::apply(const Command &command)
+{
+    const auto reset_film = [this]
+    {
+        clear_film(m_film);
+        m_active_tile_count = static_cast<u32>(m_film.active_tiles.size());
+    };
+
+    if (std::holds_alternative<Reset>(command))
+    {
+        reset_film();
+    }
+    else if (const auto *const set_sample_type =
+                 std::get_if<Set_sample_type>(&command))
+    {
+        m_settings.sample_type = set_sample_type->sample_type;
+        // Otherwise the film already has the new sample type
+        if (!m_settings.all_sample_types)
+        {
+            reset_film();
+        }
+    }
+    else if (const auto *const set_all_sample_types =
+                 std::get_if<Set_all_sample_types>(&command))
+    {
+        m_settings.all_sample_types = set_all_sample_types->all_sample_types;
+        reset_film();
+    }
+    else if (const auto *const set_sampler_type =
+                 std::get_if<Set_sampler_type>(&command))
+    {
+        m_settings.sampler_type = set_sampler_type->sampler_type;
+        reset_film();
+    }
+    else if (const auto *const set_integrator_type =
+                 std::get_if<Set_integrator_type>(&command))
+    {
+        // Every integrator computes the same samples, so the film is kept
+        m_settings.integrator_type = set_integrator_type->integrator_type;
+    }
+    else if (const auto *const set_total_samples =
+                 std::get_if<Set_total_samples>(&command))
+    {
+        m_settings.total_samples = set_total_samples->total_samples;
+        if (m_film.samples > m_settings.total_samples)
+        {
+            reset_film();
+        }
+    }
+    else if (const auto *const set_error_threshold =
+                 std::get_if<Set_error_threshold>(&command))
+    {
+        // The samples remain valid, only the tiles to continue change
+        m_settings.error_threshold = set_error_threshold->error_threshold;
+        std::fill(
+            m_film.active_tiles.begin(), m_film.active_tiles.end(), u8 {1});
+        update_active_tiles();
+    }
+    else if (const auto *const set_denoise_passes =
+                 std::get_if<Set_denoise_passes>(&command))
+    {
+        // The film is kept, and published again with the new passes
+        m_settings.denoise_passes = set_denoise_passes->denoise_passes;
+    }
+    else if (const auto *const set_color_rng_state =
+                 std::get_if<Set_color_rng_state>(&command))
+    {
+        m_settings.color_rng_state = set_color_rng_state->color_rng_state;
+        reset_film();
+    }
+}
+
+void Render_thread::publish()
+{
+    auto &back = m_films[m_back_index];
+    back.image_width = m_film.image_width;
+    back.image_height = m_film.image_height;
+    back.planes = m_film.planes;
+    back.luminance_buffer = m_film.luminance_buffer;
+    back.luminance_square_buffer = m_film.luminance_square_buffer;
+    back.sample_counts = m_film.sample_counts;
+    back.active_tiles = m_film.active_tiles;
+    back.samples = m_film.samples;
+    // Filtered here on every thread of the pool, once per film, rather than by
+    // the caller, which would otherwise block its own frames on the filter
+    m_denoised[m_back_index] =
+        m_settings.denoise_passes > 0 &&
+        m_settings.sample_type == Sample_type::color &&
+        denoise(back,
+                m_settings.denoise_passes,
+                m_denoised_colors[m_back_index],
+                m_thread_pool);
+    m_back_index =
+        m_ready_state.exchange(m_back_index | fresh_bit,
+                               std::memory_order_acq_rel) &
+        ~fresh_bit;
+}
+
+void Render_thread::update_active_tiles()
+{
+    if (m_settings.error_threshold > 0.0f)
+    {
+        m_active_tile_count = ::update_active_tiles(
+            m_film, m_settings.error_threshold, adaptive_min_samples);
+    }
+    else
+    {
+        std::fill(
+            m_film.active_tiles.begin(), m_film.active_tiles.end(), u8 {1});
+        m_active_tile_count = static_cast<u32>(m_film.active_tiles.size());
+    }
+}
+
+bool Render_thread::film_complete() const noexcept
+{
+    return m_film.samples >= m_settings.total_samples ||
+           m_active_tile_count == 0;
+}
+
+void Render_thread::thread_main()
+{
+    std::vector<Command> commands;
+    for (;;)
+    {
+        {
+            std::unique_lock lock {m_mutex};
+            // Sleep once the film is complete, until a command arrives
+            m_condition.wait(lock,
+                             [this]
+                             {
+                                 return m_stop || !m_commands.empty() ||
+                                        !film_complete();
+                             });
+            if (m_stop)
+            {
+                return;
+            }
+            commands.swap(m_commands);
+        }
+
+        if (!commands.empty())
+        {
+            for (const auto &command : commands)
+            {
+                apply(command);
+            }
+            commands.clear();
+            publish();
+            continue;
+        }
+
+        if (m_settings.all_sample_types)
+        {
+            accumulate_sample(m_scene,
+                              m_settings.sampler_type,
+                              m_settings.integrator_type,
+                              m_settings.rng_base_state,
+                              m_settings.color_rng_state,
+                              m_film,
+                              m_thread_pool);
+        }
+        else
+        {
+            accumulate_sample(m_scene,
+                              m_settings.sample_type,
+                              m_settings.sampler_type,
+                              m_settings.integrator_type,
+                              m_settings.rng_base_state,
+                              m_settings.color_rng_state,
+                              m_film,
+                              m_thread_pool);
+        }
+        update_active_tiles();
+        publish();
+    }
+}
@@ -0,0 +1,183 @@
+#ifndef RENDER_THREAD_HPP
+#define RENDER_THREAD_HPP
+
+#include "render.hpp"
+#include "thread_pool.hpp"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <variant>
+#include <vector>
+
+// Accumulates samples continuously on its own thread (and thread pool),
+// independently of the caller's frame rate, until the film has total_samples
+// or, with adaptive sampling, until every tile is below error_threshold.
+// Settings are changed with commands that are applied between two samples, and
+// every completed sample is published through a triple buffer that the caller
+// picks up with acquire_film(). With denoise_passes, the color of every
+// published film is also denoised on the thread pool, see denoised_color()
+class Render_thread
+{
+public:
+    struct Settings
+    {
+        int image_width;
+        int image_height;
+        Sample_type sample_type;
+        // Renders every sample type from the same primary hits, so that
+        // changing sample_type keeps the film
+        bool all_sample_types;
+        Sampler_type sampler_type;
+        Integrator_type integrator_type;
+        int total_samples;
+        // Relative error of the tiles at which they stop receiving samples, 0
+        // to disable adaptive sampling
+        f32 error_threshold;
+        // Passes of denoise() over the published color, 0 to disable it
+        int denoise_passes;
+        u32 rng_base_state;
+        u32 color_rng_state;
+        u32 thread_count;
+    };
+
+    Render_thread(const Scene &scene, const Settings &settings);
+
+    ~Render_thread();
+
+    Render_thread(const Render_thread &) = delete;
+    Render_thread(Render_thread &&) = delete;
+    Render_thread &operator=(const Render_thread &) = delete;
+    Render_thread &operator=(Render_thread &&) = delete;
+
+    [[nodiscard]] u32 thread_count() const noexcept;
+
+    void reset();
+
+    void set_sample_type(Sample_type sample_type);
+
+    void set_all_sample_types(bool all_sample_types);
+
+    void set_sampler_type(Sampler_type sampler_type);
+
+    void set_integrator_type(Integrator_type integrator_type);
+
+    // Resets the film if it already has more samples
+    void set_total_samples(int total_samples);
+
+    void set_error_threshold(f32 error_threshold);
+
+    void set_denoise_passes(int denoise_passes);
+
+    void set_color_rng_state(u32 color_rng_state);
+
+    // Returns the most recently published film if it has not been acquired
+    // yet, nullptr otherwise. The film stays valid until the next call
+    [[nodiscard]] const Film *acquire_film();
+
+    // Returns the denoised color of the film last acquired, or an empty span if
+    // it was not denoised: without denoise_passes, while another sample type
+    // is rendered, or without the albedo and normals of every sample type
+    [[nodiscard]] std::span<const f32v3> denoised_color() const noexcept;
+
+private:
+    struct Reset
+    {
+    };
+
+    struct Set_sample_type
+    {
+        Sample_type sample_type;
+    };
+
+    struct Set_all_sample_types
+    {
+        bool all_sample_types;
+    };
+
+    struct Set_sampler_type
+    {
+        Sampler_type sampler_type;
+    };
+
+    struct Set_integrator_type
+    {
+        Integrator_type integrator_type;
+    };
+
+    struct Set_total_samples
+    {
+        int total_samples;
+    };
+
+    struct Set_error_threshold
+    {
+        f32 error_threshold;
+    };
+
+    struct Set_denoise_passes
+    {
+        int denoise_passes;
+    };
+
+    struct Set_color_rng_state
+    {
+        u32 color_rng_state;
+    };
+
+    using Command = std::variant<Reset,
+                                 Set_sample_type,
+                                 Set_all_sample_types,
+                                 Set_sampler_type,
+                                 Set_integrator_type,
+                                 Set_total_samples,
+                                 Set_error_threshold,
+                                 Set_denoise_passes,
+                                 Set_color_rng_state>;
+
+    void push(const Command &command);
+
+    void apply(const Command &command);
+
+    void publish();
+
+    // Updates the active tiles of the film after a sample, or activates all of
+    // them if adaptive sampling is disabled
+    void update_active_tiles();
+
+    [[nodiscard]] bool film_complete() const noexcept;
+
+    void thread_main();
+
+    const Scene &m_scene;
+    Settings m_settings;
+    Thread_pool m_thread_pool;
+
+    // Owned by the render thread
+    Film m_film;
+    u32 m_active_tile_count;
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::vector<Command> m_commands;
+    bool m_stop {};
+
+    // Triple buffer: the render thread writes into m_films[m_back_index], the
+    // caller reads from m_films[m_front_index], and the last published film is
+    // the index stored in m_ready_state, with fresh_bit set until acquired
+    static constexpr u32 fresh_bit {4};
+    std::array<Film, 3> m_films;
+    u32 m_back_index {0};
+    u32 m_front_index {1};
+    std::atomic<u32> m_ready_state {2};
+    // Denoised color of each film, if its flag is set
+    std::array<std::vector<f32v3>, 3> m_denoised_colors;
+    std::array<bool, 3> m_denoised {};
+
+    std::thread m_thread;
+};
+
+#endif // RENDER_THREAD_HPP
@@ -0,0 +1,197 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include "definitions.hpp"
+#include "random.hpp"
+
+#include <array>
+
+enum struct Sampler_type
+{
+    independent,
+    sobol,
+};
+
+constexpr inline const char *sampler_type_names[] {"independent", "sobol"};
+
+// Source of the random numbers of one pixel sample. Every number is identified
+// by (pixel, sample, dimension), where the dimension is advanced by every call,
+// so the result does not depend on the order in which pixels are rendered
+struct Sampler
+{
+    Sampler_type type;
+    u32 pixel_seed;
+    u32 sample_index;
+    u32 dimension;
+    // Only used by the independent sampler
+    u32 rng_state;
+};
+
+namespace sobol
+{
+
+[[nodiscard]] FORCE_INLINE constexpr u32 reverse_bits(u32 x) noexcept
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Generator matrices of the first 4 dimensions, from the primitive polynomials
+// and initial direction numbers of Joe and Kuo
+[[nodiscard]] constexpr std::array<std::array<u32, 32>, 4> make_directions()
+{
+    constexpr u32 degrees[] {1, 2, 3};
+    constexpr u32 coefficients[] {0, 1, 1};
+    constexpr u32 initial_numbers[][3] {{1}, {1, 3}, {1, 3, 1}};
+
+    std::array<std::array<u32, 32>, 4> directions {};
+    for (u32 bit {}; bit < 32; ++bit)
+    {
+        directions[0][bit] = 1u << (31 - bit);
+    }
+    for (std::size_t d {}; d < 3; ++d)
+    {
+        const auto s = degrees[d];
+        const auto a = coefficients[d];
+        auto &v = directions[d + 1];
+        for (u32 bit {}; bit < 32; ++bit)
+        {
+            if (bit < s)
+            {
+                v[bit] = initial_numbers[d][bit] << (31 - bit);
+                continue;
+            }
+            v[bit] = v[bit - s] ^ (v[bit - s] >> s);
+            for (u32 k {1}; k < s; ++k)
+            {
+                v[bit] ^= ((a >> (s - 1 - k)) & 1u) * v[bit - k];
+            }
+        }
+    }
+    return directions;
+}
+
+// Owen scrambling works on bit-reversed numbers, so the points are generated
+// directly in that domain: entry [d][n][bits] is the reversed point of
+// dimension d for the reversed index whose nibble n is bits and every other
+// nibble is 0. A point is then the XOR of one entry per nibble
+[[nodiscard]] constexpr std::array<std::array<std::array<u32, 16>, 8>, 4>
+make_reversed_tables()
+{
+    const auto directions = make_directions();
+    std::array<std::array<std::array<u32, 16>, 8>, 4> tables {};
+    for (std::size_t d {}; d < 4; ++d)
+    {
+        for (std::size_t nibble {}; nibble < 8; ++nibble)
+        {
+            for (u32 bits {}; bits < 16; ++bits)
+            {
+                for (std::size_t bit {}; bit < 4; ++bit)
+                {
+                    if ((bits >> bit) & 1u)
+                    {
+                        tables[d][nibble][bits] ^= reverse_bits(
+                            directions[d][31 - (nibble * 4 + bit)]);
+                    }
+                }
+            }
+        }
+    }
+    return tables;
+}
+
+constexpr inline auto reversed_tables = make_reversed_tables();
+
+// Returns the bit-reversed point of the given dimension for the bit-reversed
+// index
+[[nodiscard]] FORCE_INLINE constexpr u32 generate_reversed(u32 reversed_index,
+                                                           u32 dimension)
+{
+    const auto &tables = reversed_tables[dimension];
+    u32 x {};
+    for (std::size_t nibble {}; nibble < 8; ++nibble, reversed_index >>= 4)
+    {
+        x ^= tables[nibble][reversed_index & 15u];
+    }
+    return x;
+}
+
+// Owen scrambling of a bit-reversed number, with the hash of Laine and Karras
+// as improved in "Practical Hash-based Owen Scrambling" by Burley
+[[nodiscard]] FORCE_INLINE constexpr u32
+laine_karras_permutation(u32 x, u32 scramble_seed)
+{
+    x += scramble_seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Dimensions are padded with shuffled and scrambled 4D Sobol sets, so that
+// every group of 4 dimensions is well stratified and the groups are
+// decorrelated from each other and across pixels
+[[nodiscard]] FORCE_INLINE constexpr f32
+sample(u32 pixel_seed, u32 sample_index, u32 dimension)
+{
+    const auto group_seed = seed(pixel_seed ^ seed(dimension / 4 + 1));
+    // Shuffles the order of the points, then scrambles their digits
+    const auto reversed_index =
+        laine_karras_permutation(reverse_bits(sample_index), group_seed);
+    const auto x = reverse_bits(laine_karras_permutation(
+        generate_reversed(reversed_index, dimension % 4),
+        seed(group_seed + dimension % 4)));
+    // 24 bits, so that the result is exactly representable and below 1
+    return static_cast<f32>(x >> 8) * 0x1p-24f;
+}
+
+} // namespace sobol
+
+[[nodiscard]] FORCE_INLINE constexpr Sampler make_sampler(Sampler_type type,
+                                                          u32 base_state,
+                                                          u32 pixel_index,
+                                                          u32 sample_index)
+{
+    return {.type = type,
+            .pixel_seed = seed(pixel_index + seed(base_state)),
+            .sample_index = sample_index,
+            .dimension = 0,
+            .rng_state =
+                pixel_rng_state(base_state, pixel_index, sample_index)};
+}
+
+// Returns a number in [0, 1]
+[[nodiscard]] FORCE_INLINE constexpr f32 next_1d(Sampler &sampler)
+{
+    const auto dimension = sampler.dimension++;
+    if (sampler.type == Sampler_type::sobol)
+    {
+        return sobol::sample(
+            sampler.pixel_seed, sampler.sample_index, dimension);
+    }
+    return random(sampler.rng_state);
+}
+
+// Returns two numbers from a pair of dimensions of the same 4D group, which
+// are stratified together
+FORCE_INLINE constexpr void next_2d(Sampler &sampler, f32 &u1, f32 &u2)
+{
+    sampler.dimension += sampler.dimension & 1u;
+    u1 = next_1d(sampler);
+    u2 = next_1d(sampler);
+}
+
+// Moves to the first dimension of the given path vertex, so that every vertex
+// always uses the same dimensions regardless of the numbers that the previous
+// ones consumed
+FORCE_INLINE constexpr void start_vertex(Sampler &sampler, int depth)
+{
+    // The camera uses the first 4 dimensions and every vertex 8
+    sampler.dimension = 4 + 8 * static_cast<u32>(depth);
+}
+
+#endif // SAMPLER_HPP
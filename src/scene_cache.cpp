@@ -0,0 +1,388 @@
+#include "scene_cache.hpp"
+
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+constexpr std::array<char, 8> scene_cache_magic {
+    'P', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+// Incremented whenever the layout of the file or of a stored type changes
+constexpr u32 scene_cache_version {3};
+constexpr u32 scene_cache_byte_order {0x01020304};
+constexpr std::size_t scene_cache_alignment {4096};
+
+// The arrays of the objects are concatenated into one section each, in the
+// order of the objects, and sliced again on loading from the counts of the
+// object table
+enum struct Section
+{
+    materials,
+    objects,
+    vertices,
+    quantized_vertices,
+    indices,
+    normal,
+    material_id,
+    nodes,
+    wide_nodes,
+    instances,
+    instance_nodes,
+    instance_wide_nodes,
+    light_instance_ids,
+    light_triangle_ids,
+    light_cdf,
+    count,
+};
+
+constexpr auto section_count = static_cast<std::size_t>(Section::count);
+
+struct Section_entry
+{
+    u64 offset;
+    u64 count;
+    // Checked on loading, as a cheap guard against layout changes that the
+    // version was not incremented for
+    u64 element_size;
+};
+
+struct Header
+{
+    std::array<char, 8> magic;
+    u32 version;
+    // Written in the native byte order, to reject files from machines with
+    // another one
+    u32 byte_order;
+    Camera camera;
+    f32v3 background_color;
+    f32 light_total_area;
+    std::array<Section_entry, section_count> sections;
+};
+
+static_assert(std::is_trivially_copyable_v<Header>);
+static_assert(sizeof(Header) <= scene_cache_alignment);
+
+// Sizes of the arrays of an object in the concatenated sections. The normals
+// and material ids have one element per triangle
+struct Object_entry
+{
+    u64 vertex_count;
+    u64 quantized_vertex_count;
+    u64 triangle_count;
+    u64 node_count;
+    u64 wide_node_count;
+    Vertex_grid grid;
+};
+
+static_assert(std::is_trivially_copyable_v<Object_entry>);
+
+[[nodiscard]] constexpr u64 align_up(u64 offset) noexcept
+{
+    return (offset + scene_cache_alignment - 1) / scene_cache_alignment *
+           scene_cache_alignment;
+}
+
+// Consecutive arrays of the same type, written one after the other
+struct Section_data
+{
+    std::vector<std::span<const std::byte>> parts;
+    u64 count;
+    u64 element_size;
+};
+
+template <typename T>
+void append(Section_data &section, const T *data, std::size_t count)
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+    section.parts.push_back(std::as_bytes(std::span {data, count}));
+    section.count += count;
+    section.element_size = sizeof(T);
+}
+
+template <typename T>
+void append(Section_data &section, const Buffer<T> &buffer)
+{
+    append(section, buffer.data(), buffer.size());
+}
+
+// Returns a view of the elements of the section, after checking that they fit
+// in the file
+template <typename T>
+[[nodiscard]] std::optional<Buffer<T>> section_view(std::string_view contents,
+                                                    const Header &header,
+                                                    Section section)
+{
+    const auto &entry = header.sections[static_cast<std::size_t>(section)];
+    if (entry.element_size != sizeof(T) ||
+        entry.offset % scene_cache_alignment != 0 ||
+        entry.offset > contents.size() ||
+        entry.count > (contents.size() - entry.offset) / sizeof(T))
+    {
+        return std::nullopt;
+    }
+    // The mapping starts on a page, so the section is aligned for any type
+    return Buffer<T>::view(
+        reinterpret_cast<const T *>(contents.data() + entry.offset),
+        static_cast<std::size_t>(entry.count));
+}
+
+// Returns a view of the next count elements of a concatenated section, after
+// checking that they are within it. offset is advanced past them
+template <typename T>
+[[nodiscard]] std::optional<Buffer<T>>
+slice(const Buffer<T> &section, u64 count, u64 &offset)
+{
+    if (count > section.size() - offset)
+    {
+        return std::nullopt;
+    }
+    auto view = Buffer<T>::view(section.data() + offset,
+                                static_cast<std::size_t>(count));
+    offset += count;
+    return view;
+}
+
+} // namespace
+
+bool save_scene_cache(const Scene &scene, const std::filesystem::path &path)
+{
+    const auto &geometry = scene.geometry;
+    std::array<Section_data, section_count> sections {};
+    const auto section = [&](Section s) -> Section_data &
+    { return sections[static_cast<std::size_t>(s)]; };
+
+    std::vector<Object_entry> object_entries;
+    object_entries.reserve(geometry.objects.size());
+    for (const auto &object : geometry.objects)
+    {
+        const auto &soa = object.triangles;
+        object_entries.push_back(
+            {.vertex_count = soa.vertices.size(),
+             .quantized_vertex_count = soa.quantized_vertices.size(),
+             .triangle_count = soa.indices.size(),
+             .node_count = object.bvh.nodes.size(),
+             .wide_node_count = object.bvh.wide_nodes.size(),
+             .grid = soa.grid});
+    }
+    append(section(Section::materials),
+           scene.materials.data(),
+           scene.materials.size());
+    append(section(Section::objects),
+           object_entries.data(),
+           object_entries.size());
+    for (const auto &object : geometry.objects)
+    {
+        const auto &soa = object.triangles;
+        append(section(Section::vertices), soa.vertices);
+        append(section(Section::quantized_vertices), soa.quantized_vertices);
+        append(section(Section::indices), soa.indices);
+        append(section(Section::normal), soa.normal);
+        append(section(Section::material_id), soa.material_id);
+        append(section(Section::nodes), object.bvh.nodes);
+        append(section(Section::wide_nodes), object.bvh.wide_nodes);
+    }
+    append(section(Section::instances), geometry.instances);
+    append(section(Section::instance_nodes), geometry.bvh.nodes);
+    append(section(Section::instance_wide_nodes), geometry.bvh.wide_nodes);
+    append(section(Section::light_instance_ids), scene.lights.instance_ids);
+    append(section(Section::light_triangle_ids), scene.lights.triangle_ids);
+    append(section(Section::light_cdf), scene.lights.cdf);
+
+    Header header {.magic = scene_cache_magic,
+                   .version = scene_cache_version,
+                   .byte_order = scene_cache_byte_order,
+                   .camera = scene.camera,
+                   .background_color = scene.background_color,
+                   .light_total_area = scene.lights.total_area,
+                   .sections = {}};
+    auto offset = align_up(sizeof(Header));
+    for (std::size_t s {}; s < section_count; ++s)
+    {
+        header.sections[s] = {.offset = offset,
+                              .count = sections[s].count,
+                              .element_size = sections[s].element_size};
+        offset =
+            align_up(offset + sections[s].count * sections[s].element_size);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    // The padding is zeroed, so that the same scene always gives the same file
+    std::vector<char> padding(scene_cache_alignment);
+    std::memcpy(padding.data(), &header, sizeof(Header));
+    file.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+    std::memset(padding.data(), 0, padding.size());
+    for (const auto &data : sections)
+    {
+        for (const auto &bytes : data.parts)
+        {
+            file.write(reinterpret_cast<const char *>(bytes.data()),
+                       static_cast<std::streamsize>(bytes.size()));
+        }
+        const auto size = data.count * data.element_size;
+        file.write(padding.data(),
+                   static_cast<std::streamsize>(align_up(size) - size));
+    }
+    return static_cast<bool>(file);
+}
+
+std::optional<Scene> load_scene_cache(const std::filesystem::path &path)
+{
+    auto file = Mapped_file::open(path);
+    if (!file.has_value() || file->contents().size() < sizeof(Header))
+    {
+        return std::nullopt;
+    }
+    Header header {};
+    std::memcpy(&header, file->contents().data(), sizeof(Header));
+    if (header.magic != scene_cache_magic ||
+        header.version != scene_cache_version ||
+        header.byte_order != scene_cache_byte_order)
+    {
+        return std::nullopt;
+    }
+
+    // Moving the mapping does not move the mapped memory
+    auto mapped_file = std::make_shared<const Mapped_file>(std::move(*file));
+    const auto contents = mapped_file->contents();
+    const auto materials =
+        section_view<Material>(contents, header, Section::materials);
+    const auto object_entries =
+        section_view<Object_entry>(contents, header, Section::objects);
+    const auto vertices =
+        section_view<f32v3>(contents, header, Section::vertices);
+    const auto quantized_vertices =
+        section_view<u16v3>(contents, header, Section::quantized_vertices);
+    const auto indices =
+        section_view<u32v3>(contents, header, Section::indices);
+    const auto normal = section_view<f32v3>(contents, header, Section::normal);
+    const auto material_id =
+        section_view<u32>(contents, header, Section::material_id);
+    const auto nodes = section_view<Bvh_node>(contents, header, Section::nodes);
+    const auto wide_nodes =
+        section_view<Bvh8_node>(contents, header, Section::wide_nodes);
+    auto instances =
+        section_view<Instance>(contents, header, Section::instances);
+    auto instance_nodes =
+        section_view<Bvh_node>(contents, header, Section::instance_nodes);
+    auto instance_wide_nodes =
+        section_view<Bvh8_node>(contents, header, Section::instance_wide_nodes);
+    auto light_instance_ids =
+        section_view<u32>(contents, header, Section::light_instance_ids);
+    auto light_triangle_ids =
+        section_view<u32>(contents, header, Section::light_triangle_ids);
+    auto light_cdf = section_view<f32>(contents, header, Section::light_cdf);
+    if (!materials || !object_entries || !vertices || !quantized_vertices ||
+        !indices || !normal || !material_id || !nodes || !wide_nodes ||
+        !instances || !instance_nodes || !instance_wide_nodes ||
+        !light_instance_ids || !light_triangle_ids || !light_cdf)
+    {
+        return std::nullopt;
+    }
+
+    // Only the sizes are checked, and the object of every instance, the
+    // indices stored in the other arrays are not, which would read the whole
+    // file
+    std::vector<Object> objects;
+    objects.reserve(object_entries->size());
+    u64 vertex_offset {};
+    u64 quantized_vertex_offset {};
+    u64 triangle_offset {};
+    u64 normal_offset {};
+    u64 material_id_offset {};
+    u64 node_offset {};
+    u64 wide_node_offset {};
+    for (const auto &entry : *object_entries)
+    {
+        const auto has_triangles = entry.triangle_count > 0;
+        if ((entry.vertex_count > 0) + (entry.quantized_vertex_count > 0) !=
+                static_cast<int>(has_triangles) ||
+            (entry.node_count > 0) != has_triangles ||
+            (entry.wide_node_count > 0) != has_triangles)
+        {
+            return std::nullopt;
+        }
+        auto object_vertices =
+            slice(*vertices, entry.vertex_count, vertex_offset);
+        auto object_quantized_vertices = slice(*quantized_vertices,
+                                               entry.quantized_vertex_count,
+                                               quantized_vertex_offset);
+        auto object_indices =
+            slice(*indices, entry.triangle_count, triangle_offset);
+        auto object_normal =
+            slice(*normal, entry.triangle_count, normal_offset);
+        auto object_material_id =
+            slice(*material_id, entry.triangle_count, material_id_offset);
+        auto object_nodes = slice(*nodes, entry.node_count, node_offset);
+        auto object_wide_nodes =
+            slice(*wide_nodes, entry.wide_node_count, wide_node_offset);
+        if (!object_vertices || !object_quantized_vertices ||
+            !object_indices || !object_normal || !object_material_id ||
+            !object_nodes || !object_wide_nodes)
+        {
+            return std::nullopt;
+        }
+        objects.push_back(
+            {.triangles = {.vertices = std::move(*object_vertices),
+                           .quantized_vertices =
+                               std::move(*object_quantized_vertices),
+                           .grid = entry.grid,
+                           .indices = std::move(*object_indices),
+                           .normal = std::move(*object_normal),
+                           .material_id = std::move(*object_material_id)},
+             .bvh = {.nodes = std::move(*object_nodes),
+                     .wide_nodes = std::move(*object_wide_nodes)}});
+    }
+    const auto object_count = objects.size();
+    if (vertex_offset != vertices->size() ||
+        quantized_vertex_offset != quantized_vertices->size() ||
+        triangle_offset != indices->size() ||
+        normal_offset != normal->size() ||
+        material_id_offset != material_id->size() ||
+        node_offset != nodes->size() ||
+        wide_node_offset != wide_nodes->size() ||
+        instances->empty() || instance_nodes->empty() ||
+        instance_wide_nodes->empty() ||
+        std::any_of(instances->begin(),
+                    instances->end(),
+                    [&](const Instance &instance)
+                    {
+                        return instance.object_id >= object_count ||
+                               objects[instance.object_id].bvh.nodes.empty();
+                    }) ||
+        light_instance_ids->size() != light_cdf->size() ||
+        light_triangle_ids->size() != light_cdf->size())
+    {
+        return std::nullopt;
+    }
+
+    return Scene {
+        .camera = header.camera,
+        .triangles = {},
+        .meshes = {},
+        .mesh_instances = {},
+        .materials = {materials->begin(), materials->end()},
+        .background_color = header.background_color,
+        .geometry = {.objects = std::move(objects),
+                     .instances = std::move(*instances),
+                     .bvh = {.nodes = std::move(*instance_nodes),
+                             .wide_nodes = std::move(*instance_wide_nodes)}},
+        .lights = {.instance_ids = std::move(*light_instance_ids),
+                   .triangle_ids = std::move(*light_triangle_ids),
+                   .cdf = std::move(*light_cdf),
+                   .total_area = header.light_total_area},
+        .mapped_file = std::move(mapped_file)};
+}
@@ -0,0 +1,25 @@
+#ifndef SCENE_CACHE_HPP
+#define SCENE_CACHE_HPP
+
+#include "render.hpp"
+
+#include <filesystem>
+#include <optional>
+
+// Writes the camera, materials and lights of a prepared scene, with the
+// triangle streams and BVHs of its objects and its instances, to a binary
+// file. Every array starts on its own page, so that the file can be mapped and
+// used as is. Returns false if the file cannot be written
+[[nodiscard]] bool save_scene_cache(const Scene &scene,
+                                    const std::filesystem::path &path);
+
+// Maps a file written by save_scene_cache(). The arrays of the scene view the
+// mapping, which the scene keeps alive, so loading takes a few milliseconds
+// regardless of the size of the scene and nothing is parsed or built. The
+// scene has no triangles or meshes, only their streams. Returns
+// nothing if the file cannot be mapped, is truncated, or was written by
+// another version or by a build with other data layouts
+[[nodiscard]] std::optional<Scene>
+load_scene_cache(const std::filesystem::path &path);
+
+#endif // SCENE_CACHE_HPP
@@ -43,9 +43,20 @@
 #else
 #define SIMD_FMA 0
 #endif
+#ifdef __AVX512F__
+#define SIMD_AVX512F 1
+#else
+#define SIMD_AVX512F 0
+#endif
+#ifdef __AVX512VL__
+#define SIMD_AVX512VL 1
+#else
+#define SIMD_AVX512VL 0
+#endif
 
-#if !SIMD_AVX
-#error "The implementation currently only supports AVX"
+// MSVC accepts the intrinsics of any instruction set, whatever /arch is
+#if !SIMD_SSE4_1 && !defined(_MSC_VER)
+#error "The implementation requires at least SSE4.1"
 #endif
 
 constexpr inline bool simd_sse {SIMD_SSE};
@@ -56,20 +67,45 @@ constexpr inline bool simd_sse4_2 {SIMD_SSE4_2};
 constexpr inline bool simd_avx {SIMD_AVX};
 constexpr inline bool simd_avx2 {SIMD_AVX2};
 constexpr inline bool simd_fma {SIMD_FMA};
+constexpr inline bool simd_avx512f {SIMD_AVX512F};
+constexpr inline bool simd_avx512vl {SIMD_AVX512VL};
 
-#if SIMD_SSE || SIMD_SSE2 || SIMD_SSE3 || SIMD_SSE4_1 || SIMD_SSE4_2 ||        \
-    SIMD_AVX || SIMD_AVX2 || SIMD_FMA
 #include <immintrin.h>
+
+#include <bit>
+#include <concepts>
+
+// Every translation unit uses the widest implementation that its instruction
+// set allows. The inline namespace gives each instruction set its own names,
+// so that translation units compiled for different ones can be linked
+// together. vf32 has 8 lanes with every instruction set, the width of the ray
+// packets and of the BVH nodes, in one register with AVX and in two 4-wide
+// ones without it, so there is no separate 4-wide type. AVX-512 adds vf32x16
+// with 16 lanes, for kernels over arrays such as denoise_rows()
+#if SIMD_AVX512F
+#define SIMD_NAMESPACE avx512
+#elif SIMD_AVX2
+#define SIMD_NAMESPACE avx2
+#elif SIMD_AVX
+#define SIMD_NAMESPACE avx
+#else
+#define SIMD_NAMESPACE sse4
 #endif
 
+namespace simd
+{
+inline namespace SIMD_NAMESPACE
+{
+
+#if SIMD_AVX
+
+// Defined in the simd namespace so that the operators below are found by
+// argument-dependent lookup, e.g. from the v3<T> templates
 struct vf32
 {
     __m256 v;
 };
 
-namespace simd
-{
-
 [[nodiscard]] FORCE_INLINE vf32 zero()
 {
     return {_mm256_setzero_ps()};
@@ -88,7 +124,14 @@ template <typename F>
              }
 [[nodiscard]] FORCE_INLINE vf32 fill(F &&f)
 {
-    return {_mm256_set_ps(f(0), f(1), f(2), f(3), f(4), f(5), f(6), f(7))};
+    return {_mm256_setr_ps(f(0), f(1), f(2), f(3), f(4), f(5), f(6), f(7))};
+}
+
+// Broadcasts the bit pattern of an integer, e.g. to carry indices through
+// select()
+[[nodiscard]] FORCE_INLINE vf32 broadcast_bits(u32 a)
+{
+    return {_mm256_castsi256_ps(_mm256_set1_epi32(static_cast<int>(a)))};
 }
 
 [[nodiscard]] FORCE_INLINE vf32 broadcast(const f32 *p)
@@ -116,11 +159,6 @@ FORCE_INLINE void store_unaligned(f32 *p, vf32 a)
     _mm256_storeu_ps(p, a.v);
 }
 
-[[nodiscard]] FORCE_INLINE vf32 operator+(vf32 a)
-{
-    return a;
-}
-
 [[nodiscard]] FORCE_INLINE vf32 operator-(vf32 a)
 {
     return {_mm256_sub_ps(_mm256_setzero_ps(), a.v)};
@@ -146,30 +184,6 @@ FORCE_INLINE void store_unaligned(f32 *p, vf32 a)
     return {_mm256_div_ps(a.v, b.v)};
 }
 
-FORCE_INLINE vf32 &operator+=(vf32 &a, vf32 b)
-{
-    a = a + b;
-    return a;
-}
-
-FORCE_INLINE vf32 &operator-=(vf32 &a, vf32 b)
-{
-    a = a - b;
-    return a;
-}
-
-FORCE_INLINE vf32 &operator*=(vf32 &a, vf32 b)
-{
-    a = a * b;
-    return a;
-}
-
-FORCE_INLINE vf32 &operator/=(vf32 &a, vf32 b)
-{
-    a = a / b;
-    return a;
-}
-
 [[nodiscard]] FORCE_INLINE vf32 min(vf32 a, vf32 b)
 {
     return {_mm256_min_ps(a.v, b.v)};
@@ -201,6 +215,22 @@ FORCE_INLINE vf32 &operator/=(vf32 &a, vf32 b)
     return {_mm256_rcp_ps(a.v)};
 }
 
+[[nodiscard]] FORCE_INLINE f32 reduce_min(vf32 a)
+{
+    auto m = _mm256_min_ps(a.v, _mm256_permute2f128_ps(a.v, a.v, 1));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm256_cvtss_f32(m);
+}
+
+[[nodiscard]] FORCE_INLINE f32 reduce_max(vf32 a)
+{
+    auto m = _mm256_max_ps(a.v, _mm256_permute2f128_ps(a.v, a.v, 1));
+    m = _mm256_max_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_max_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm256_cvtss_f32(m);
+}
+
 [[nodiscard]] FORCE_INLINE bool all_positive(vf32 a)
 {
     return _mm256_testz_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
@@ -231,16 +261,145 @@ FORCE_INLINE vf32 &operator/=(vf32 &a, vf32 b)
     return {_mm256_round_ps(a.v, _MM_FROUND_TRUNC)};
 }
 
+// Returns the magnitude of a with the sign of b
+[[nodiscard]] FORCE_INLINE vf32 copysign(vf32 a, vf32 b)
+{
+    const auto sign_mask = _mm256_set1_ps(-0.0f);
+    return {_mm256_or_ps(_mm256_andnot_ps(sign_mask, a.v),
+                         _mm256_and_ps(sign_mask, b.v))};
+}
+
 [[nodiscard]] FORCE_INLINE vf32 fmadd(vf32 a, vf32 b, vf32 c)
 {
+#if SIMD_FMA
     return {_mm256_fmadd_ps(a.v, b.v, c.v)};
+#else
+    return {_mm256_add_ps(_mm256_mul_ps(a.v, b.v), c.v)};
+#endif
 }
 
 [[nodiscard]] FORCE_INLINE vf32 fmsub(vf32 a, vf32 b, vf32 c)
 {
+#if SIMD_FMA
     return {_mm256_fmsub_ps(a.v, b.v, c.v)};
+#else
+    return {_mm256_sub_ps(_mm256_mul_ps(a.v, b.v), c.v)};
+#endif
+}
+
+#if SIMD_AVX512VL
+
+// With AVX-512, comparisons write a predicate register, one bit per lane,
+// which select() and masked() use directly
+struct mask
+{
+    __mmask8 v;
+};
+
+[[nodiscard]] FORCE_INLINE mask operator==(vf32 a, vf32 b)
+{
+    return {_mm256_cmp_ps_mask(a.v, b.v, _CMP_EQ_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator!=(vf32 a, vf32 b)
+{
+    return {_mm256_cmp_ps_mask(a.v, b.v, _CMP_NEQ_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator<(vf32 a, vf32 b)
+{
+    return {_mm256_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator<=(vf32 a, vf32 b)
+{
+    return {_mm256_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator>(vf32 a, vf32 b)
+{
+    return {_mm256_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator>=(vf32 a, vf32 b)
+{
+    return {_mm256_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 masked(vf32 a, mask m)
+{
+    return {_mm256_maskz_mov_ps(m.v, a.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 select(vf32 a, vf32 b, mask m)
+{
+    return {_mm256_mask_blend_ps(m.v, a.v, b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator~(mask m)
+{
+    return {static_cast<__mmask8>(~m.v)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator&(mask a, mask b)
+{
+    return {static_cast<__mmask8>(a.v & b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator|(mask a, mask b)
+{
+    return {static_cast<__mmask8>(a.v | b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE bool none(mask m)
+{
+    return m.v == 0;
+}
+
+[[nodiscard]] FORCE_INLINE bool all(mask m)
+{
+    return m.v == 0xff;
+}
+
+// Returns the lanes of the mask as the bits of an integer, lane 0 being the
+// least significant bit
+[[nodiscard]] FORCE_INLINE u32 bits(mask m)
+{
+    return m.v;
+}
+
+// Returns the lanes of a selected by m packed to the front, in order, the
+// other lanes being zero. With the bit patterns of indices, compacts a queue
+// to its live entries
+[[nodiscard]] FORCE_INLINE vf32 compress(vf32 a, mask m)
+{
+    return {_mm256_maskz_compress_ps(m.v, a.v)};
+}
+
+// Writes the lanes of a selected by m contiguously from p, which needs no
+// alignment, and returns their number
+FORCE_INLINE u32 compress_store(f32 *p, vf32 a, mask m)
+{
+    _mm256_mask_compressstoreu_ps(p, m.v, a.v);
+    return static_cast<u32>(std::popcount(m.v));
+}
+
+// Inverse of compress(): moves the first lanes of a, in order, to the lanes
+// selected by m, the other lanes being zero
+[[nodiscard]] FORCE_INLINE vf32 expand(vf32 a, mask m)
+{
+    return {_mm256_maskz_expand_ps(m.v, a.v)};
+}
+
+// Reads as many contiguous values from p as m selects lanes, which receive
+// them in order, the other lanes being zero
+[[nodiscard]] FORCE_INLINE vf32 expand_load(const f32 *p, mask m)
+{
+    return {_mm256_maskz_expandloadu_ps(m.v, p)};
 }
 
+#else
+
 struct mask
 {
     __m256 v;
@@ -311,6 +470,688 @@ struct mask
     return _mm256_testc_ps(m.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
 }
 
-} // namespace simd
+// Returns the lanes of the mask as the bits of an integer, lane 0 being the
+// least significant bit
+[[nodiscard]] FORCE_INLINE u32 bits(mask m)
+{
+    return static_cast<u32>(_mm256_movemask_ps(m.v));
+}
+
+#endif
+
+#else
+
+// Without AVX, the 8 lanes are split over two SSE registers, lanes 0 to 3 in
+// lo and 4 to 7 in hi
+struct vf32
+{
+    __m128 lo;
+    __m128 hi;
+};
+
+[[nodiscard]] FORCE_INLINE vf32 zero()
+{
+    return {_mm_setzero_ps(), _mm_setzero_ps()};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 broadcast(f32 a)
+{
+    const auto v = _mm_set1_ps(a);
+    return {v, v};
+}
+
+template <typename F>
+    requires requires(F f, int i) {
+                 {
+                     f(i)
+                 } -> std::same_as<f32>;
+             }
+[[nodiscard]] FORCE_INLINE vf32 fill(F &&f)
+{
+    return {_mm_setr_ps(f(0), f(1), f(2), f(3)),
+            _mm_setr_ps(f(4), f(5), f(6), f(7))};
+}
+
+// Broadcasts the bit pattern of an integer, e.g. to carry indices through
+// select()
+[[nodiscard]] FORCE_INLINE vf32 broadcast_bits(u32 a)
+{
+    const auto v = _mm_castsi128_ps(_mm_set1_epi32(static_cast<int>(a)));
+    return {v, v};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 broadcast(const f32 *p)
+{
+    const auto v = _mm_load1_ps(p);
+    return {v, v};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 load_aligned(const f32 *p)
+{
+    return {_mm_load_ps(p), _mm_load_ps(p + 4)};
+}
+
+FORCE_INLINE void store_aligned(f32 *p, vf32 a)
+{
+    _mm_store_ps(p, a.lo);
+    _mm_store_ps(p + 4, a.hi);
+}
+
+[[nodiscard]] FORCE_INLINE vf32 load_unaligned(const f32 *p)
+{
+    return {_mm_loadu_ps(p), _mm_loadu_ps(p + 4)};
+}
+
+FORCE_INLINE void store_unaligned(f32 *p, vf32 a)
+{
+    _mm_storeu_ps(p, a.lo);
+    _mm_storeu_ps(p + 4, a.hi);
+}
+
+[[nodiscard]] FORCE_INLINE vf32 operator-(vf32 a)
+{
+    return {_mm_sub_ps(_mm_setzero_ps(), a.lo),
+            _mm_sub_ps(_mm_setzero_ps(), a.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 operator+(vf32 a, vf32 b)
+{
+    return {_mm_add_ps(a.lo, b.lo), _mm_add_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 operator-(vf32 a, vf32 b)
+{
+    return {_mm_sub_ps(a.lo, b.lo), _mm_sub_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 operator*(vf32 a, vf32 b)
+{
+    return {_mm_mul_ps(a.lo, b.lo), _mm_mul_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 operator/(vf32 a, vf32 b)
+{
+    return {_mm_div_ps(a.lo, b.lo), _mm_div_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 min(vf32 a, vf32 b)
+{
+    return {_mm_min_ps(a.lo, b.lo), _mm_min_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 max(vf32 a, vf32 b)
+{
+    return {_mm_max_ps(a.lo, b.lo), _mm_max_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 abs(vf32 a)
+{
+    const auto abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    return {_mm_and_ps(a.lo, abs_mask), _mm_and_ps(a.hi, abs_mask)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 sqrt(vf32 a)
+{
+    return {_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 rsqrt(vf32 a)
+{
+    return {_mm_rsqrt_ps(a.lo), _mm_rsqrt_ps(a.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 rcp(vf32 a)
+{
+    return {_mm_rcp_ps(a.lo), _mm_rcp_ps(a.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE f32 reduce_min(vf32 a)
+{
+    auto m = _mm_min_ps(a.lo, a.hi);
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(m);
+}
+
+[[nodiscard]] FORCE_INLINE f32 reduce_max(vf32 a)
+{
+    auto m = _mm_max_ps(a.lo, a.hi);
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(m);
+}
+
+[[nodiscard]] FORCE_INLINE bool all_positive(vf32 a)
+{
+    return _mm_movemask_ps(_mm_or_ps(a.lo, a.hi)) == 0;
+}
+
+[[nodiscard]] FORCE_INLINE bool all_negative(vf32 a)
+{
+    return _mm_movemask_ps(_mm_and_ps(a.lo, a.hi)) == 0xf;
+}
+
+[[nodiscard]] FORCE_INLINE vf32 round(vf32 a)
+{
+    return {_mm_round_ps(a.lo, _MM_FROUND_NINT),
+            _mm_round_ps(a.hi, _MM_FROUND_NINT)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 floor(vf32 a)
+{
+    return {_mm_round_ps(a.lo, _MM_FROUND_FLOOR),
+            _mm_round_ps(a.hi, _MM_FROUND_FLOOR)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 ceil(vf32 a)
+{
+    return {_mm_round_ps(a.lo, _MM_FROUND_CEIL),
+            _mm_round_ps(a.hi, _MM_FROUND_CEIL)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 trunc(vf32 a)
+{
+    return {_mm_round_ps(a.lo, _MM_FROUND_TRUNC),
+            _mm_round_ps(a.hi, _MM_FROUND_TRUNC)};
+}
+
+// Returns the magnitude of a with the sign of b
+[[nodiscard]] FORCE_INLINE vf32 copysign(vf32 a, vf32 b)
+{
+    const auto sign_mask = _mm_set1_ps(-0.0f);
+    return {_mm_or_ps(_mm_andnot_ps(sign_mask, a.lo),
+                      _mm_and_ps(sign_mask, b.lo)),
+            _mm_or_ps(_mm_andnot_ps(sign_mask, a.hi),
+                      _mm_and_ps(sign_mask, b.hi))};
+}
+
+// No FMA without AVX
+[[nodiscard]] FORCE_INLINE vf32 fmadd(vf32 a, vf32 b, vf32 c)
+{
+    return a * b + c;
+}
+
+[[nodiscard]] FORCE_INLINE vf32 fmsub(vf32 a, vf32 b, vf32 c)
+{
+    return a * b - c;
+}
+
+struct mask
+{
+    __m128 lo;
+    __m128 hi;
+};
+
+[[nodiscard]] FORCE_INLINE mask operator==(vf32 a, vf32 b)
+{
+    return {_mm_cmpeq_ps(a.lo, b.lo), _mm_cmpeq_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator!=(vf32 a, vf32 b)
+{
+    return {_mm_cmpneq_ps(a.lo, b.lo), _mm_cmpneq_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator<(vf32 a, vf32 b)
+{
+    return {_mm_cmplt_ps(a.lo, b.lo), _mm_cmplt_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator<=(vf32 a, vf32 b)
+{
+    return {_mm_cmple_ps(a.lo, b.lo), _mm_cmple_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator>(vf32 a, vf32 b)
+{
+    return {_mm_cmpgt_ps(a.lo, b.lo), _mm_cmpgt_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator>=(vf32 a, vf32 b)
+{
+    return {_mm_cmpge_ps(a.lo, b.lo), _mm_cmpge_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 masked(vf32 a, mask m)
+{
+    return {_mm_and_ps(a.lo, m.lo), _mm_and_ps(a.hi, m.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32 select(vf32 a, vf32 b, mask m)
+{
+    return {_mm_blendv_ps(a.lo, b.lo, m.lo), _mm_blendv_ps(a.hi, b.hi, m.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator~(mask m)
+{
+    const auto ones = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    return {_mm_xor_ps(m.lo, ones), _mm_xor_ps(m.hi, ones)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator&(mask a, mask b)
+{
+    return {_mm_and_ps(a.lo, b.lo), _mm_and_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE mask operator|(mask a, mask b)
+{
+    return {_mm_or_ps(a.lo, b.lo), _mm_or_ps(a.hi, b.hi)};
+}
+
+[[nodiscard]] FORCE_INLINE bool none(mask m)
+{
+    return _mm_movemask_ps(_mm_or_ps(m.lo, m.hi)) == 0;
+}
+
+[[nodiscard]] FORCE_INLINE bool all(mask m)
+{
+    return _mm_movemask_ps(_mm_and_ps(m.lo, m.hi)) == 0xf;
+}
+
+// Returns the lanes of the mask as the bits of an integer, lane 0 being the
+// least significant bit
+[[nodiscard]] FORCE_INLINE u32 bits(mask m)
+{
+    return static_cast<u32>(_mm_movemask_ps(m.lo) |
+                            (_mm_movemask_ps(m.hi) << 4));
+}
+
+#endif
+
+[[nodiscard]] FORCE_INLINE vf32 operator+(vf32 a)
+{
+    return a;
+}
+
+FORCE_INLINE vf32 &operator+=(vf32 &a, vf32 b)
+{
+    a = a + b;
+    return a;
+}
+
+FORCE_INLINE vf32 &operator-=(vf32 &a, vf32 b)
+{
+    a = a - b;
+    return a;
+}
+
+FORCE_INLINE vf32 &operator*=(vf32 &a, vf32 b)
+{
+    a = a * b;
+    return a;
+}
+
+FORCE_INLINE vf32 &operator/=(vf32 &a, vf32 b)
+{
+    a = a / b;
+    return a;
+}
+
+// Computes the sine and cosine of x by reduction to [-pi/4, pi/4] and
+// polynomial approximations, with an absolute error below 2e-7 for
+// |x| <= 2 pi. Without FMA, -ffast-math lets the compiler merge the two steps
+// of the reduction, and the error grows with |x| beyond that
+FORCE_INLINE void sin_cos(vf32 x, vf32 &sin_x, vf32 &cos_x)
+{
+    const auto quadrant = round(x * broadcast(0.636619772f));
+    // Cody-Waite reduction, pi/2 split in two parts
+    auto r = fmadd(quadrant, broadcast(-1.57079625f), x);
+    r = fmadd(quadrant, broadcast(-7.54978995e-8f), r);
+    const auto r2 = r * r;
+
+    auto s = fmadd(r2, broadcast(2.75573192e-6f), broadcast(-1.98412698e-4f));
+    s = fmadd(s, r2, broadcast(8.33333333e-3f));
+    s = fmadd(s, r2, broadcast(-1.66666667e-1f));
+    s = fmadd(s * r2, r, r);
+
+    auto c = fmadd(r2, broadcast(2.48015873e-5f), broadcast(-1.38888889e-3f));
+    c = fmadd(c, r2, broadcast(4.16666667e-2f));
+    c = fmadd(c, r2, broadcast(-0.5f));
+    c = fmadd(c, r2, broadcast(1.0f));
+
+    // quadrant mod 4 selects which of the two is returned and its sign
+    const auto q =
+        quadrant - broadcast(4.0f) * floor(quadrant * broadcast(0.25f));
+    const auto swap = (q == broadcast(1.0f)) | (q == broadcast(3.0f));
+    const auto negate_sin = q >= broadcast(2.0f);
+    const auto negate_cos = (q == broadcast(1.0f)) | (q == broadcast(2.0f));
+    sin_x = select(s, c, swap);
+    cos_x = select(c, s, swap);
+    sin_x = select(sin_x, -sin_x, negate_sin);
+    cos_x = select(cos_x, -cos_x, negate_cos);
+}
+
+#if SIMD_AVX512F
+
+// 16 lanes in one AVX-512 register, for kernels that process twice as many
+// elements per instruction. Comparisons write a predicate register, one bit
+// per lane. The creators are suffixed with the lane count, since they only
+// differ from those of vf32 by their return type
+struct vf32x16
+{
+    __m512 v;
+};
+
+struct mask16
+{
+    __mmask16 v;
+};
+
+// GCC 12 reports the unmasked forms of some AVX-512 intrinsics as reading an
+// uninitialized value, so their zero-masked forms are used with every lane
+// selected, which compile to the same instructions
+constexpr inline __mmask16 all_lanes16 {0xffff};
+
+[[nodiscard]] FORCE_INLINE vf32x16 zero16()
+{
+    return {_mm512_setzero_ps()};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 broadcast16(f32 a)
+{
+    return {_mm512_set1_ps(a)};
+}
+
+// Broadcasts the bit pattern of an integer, e.g. to carry indices through
+// select()
+[[nodiscard]] FORCE_INLINE vf32x16 broadcast_bits16(u32 a)
+{
+    return {_mm512_castsi512_ps(_mm512_set1_epi32(static_cast<int>(a)))};
+}
+
+// Bit patterns of the integers first + k of the lanes k, e.g. to compress the
+// indices of the selected lanes
+[[nodiscard]] FORCE_INLINE vf32x16 index_bits16(u32 first)
+{
+    const auto offsets = _mm512_setr_epi32(
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    return {_mm512_castsi512_ps(_mm512_add_epi32(
+        _mm512_set1_epi32(static_cast<int>(first)), offsets))};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 load_aligned16(const f32 *p)
+{
+    return {_mm512_load_ps(p)};
+}
+
+FORCE_INLINE void store_aligned(f32 *p, vf32x16 a)
+{
+    _mm512_store_ps(p, a.v);
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 load_unaligned16(const f32 *p)
+{
+    return {_mm512_loadu_ps(p)};
+}
+
+FORCE_INLINE void store_unaligned(f32 *p, vf32x16 a)
+{
+    _mm512_storeu_ps(p, a.v);
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 operator+(vf32x16 a)
+{
+    return a;
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 operator-(vf32x16 a)
+{
+    return {_mm512_sub_ps(_mm512_setzero_ps(), a.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 operator+(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_add_ps(a.v, b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 operator-(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_sub_ps(a.v, b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 operator*(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_mul_ps(a.v, b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 operator/(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_div_ps(a.v, b.v)};
+}
+
+FORCE_INLINE vf32x16 &operator+=(vf32x16 &a, vf32x16 b)
+{
+    a = a + b;
+    return a;
+}
+
+FORCE_INLINE vf32x16 &operator-=(vf32x16 &a, vf32x16 b)
+{
+    a = a - b;
+    return a;
+}
+
+FORCE_INLINE vf32x16 &operator*=(vf32x16 &a, vf32x16 b)
+{
+    a = a * b;
+    return a;
+}
+
+FORCE_INLINE vf32x16 &operator/=(vf32x16 &a, vf32x16 b)
+{
+    a = a / b;
+    return a;
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 min(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_maskz_min_ps(all_lanes16, a.v, b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 max(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_maskz_max_ps(all_lanes16, a.v, b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 abs(vf32x16 a)
+{
+    return {_mm512_abs_ps(a.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 sqrt(vf32x16 a)
+{
+    return {_mm512_maskz_sqrt_ps(all_lanes16, a.v)};
+}
+
+// Relative error below 2^-14, more accurate than those of vf32
+[[nodiscard]] FORCE_INLINE vf32x16 rsqrt(vf32x16 a)
+{
+    return {_mm512_maskz_rsqrt14_ps(all_lanes16, a.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 rcp(vf32x16 a)
+{
+    return {_mm512_maskz_rcp14_ps(all_lanes16, a.v)};
+}
+
+[[nodiscard]] FORCE_INLINE f32 reduce_min(vf32x16 a)
+{
+    a = min(a,
+            {_mm512_maskz_shuffle_f32x4(
+                all_lanes16, a.v, a.v, _MM_SHUFFLE(1, 0, 3, 2))});
+    a = min(a,
+            {_mm512_maskz_shuffle_f32x4(
+                all_lanes16, a.v, a.v, _MM_SHUFFLE(2, 3, 0, 1))});
+    a = min(a,
+            {_mm512_maskz_permute_ps(
+                all_lanes16, a.v, _MM_SHUFFLE(1, 0, 3, 2))});
+    a = min(a,
+            {_mm512_maskz_permute_ps(
+                all_lanes16, a.v, _MM_SHUFFLE(2, 3, 0, 1))});
+    return _mm512_cvtss_f32(a.v);
+}
+
+[[nodiscard]] FORCE_INLINE f32 reduce_max(vf32x16 a)
+{
+    a = max(a,
+            {_mm512_maskz_shuffle_f32x4(
+                all_lanes16, a.v, a.v, _MM_SHUFFLE(1, 0, 3, 2))});
+    a = max(a,
+            {_mm512_maskz_shuffle_f32x4(
+                all_lanes16, a.v, a.v, _MM_SHUFFLE(2, 3, 0, 1))});
+    a = max(a,
+            {_mm512_maskz_permute_ps(
+                all_lanes16, a.v, _MM_SHUFFLE(1, 0, 3, 2))});
+    a = max(a,
+            {_mm512_maskz_permute_ps(
+                all_lanes16, a.v, _MM_SHUFFLE(2, 3, 0, 1))});
+    return _mm512_cvtss_f32(a.v);
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 round(vf32x16 a)
+{
+    return {_mm512_maskz_roundscale_ps(all_lanes16, a.v, _MM_FROUND_NINT)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 floor(vf32x16 a)
+{
+    return {_mm512_maskz_roundscale_ps(all_lanes16, a.v, _MM_FROUND_FLOOR)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 ceil(vf32x16 a)
+{
+    return {_mm512_maskz_roundscale_ps(all_lanes16, a.v, _MM_FROUND_CEIL)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 trunc(vf32x16 a)
+{
+    return {_mm512_maskz_roundscale_ps(all_lanes16, a.v, _MM_FROUND_TRUNC)};
+}
+
+// Returns the magnitude of a with the sign of b
+[[nodiscard]] FORCE_INLINE vf32x16 copysign(vf32x16 a, vf32x16 b)
+{
+    // Bitwise select of a outside the sign bit and of b in it
+    const auto magnitude_mask = _mm512_set1_epi32(0x7fffffff);
+    return {_mm512_castsi512_ps(
+        _mm512_ternarylogic_epi32(magnitude_mask,
+                                  _mm512_castps_si512(a.v),
+                                  _mm512_castps_si512(b.v),
+                                  0xca))};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 fmadd(vf32x16 a, vf32x16 b, vf32x16 c)
+{
+    return {_mm512_fmadd_ps(a.v, b.v, c.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 fmsub(vf32x16 a, vf32x16 b, vf32x16 c)
+{
+    return {_mm512_fmsub_ps(a.v, b.v, c.v)};
+}
+
+[[nodiscard]] FORCE_INLINE mask16 operator==(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_EQ_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask16 operator!=(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_NEQ_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask16 operator<(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask16 operator<=(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask16 operator>(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE mask16 operator>=(vf32x16 a, vf32x16 b)
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 masked(vf32x16 a, mask16 m)
+{
+    return {_mm512_maskz_mov_ps(m.v, a.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 select(vf32x16 a, vf32x16 b, mask16 m)
+{
+    return {_mm512_mask_blend_ps(m.v, a.v, b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE mask16 operator~(mask16 m)
+{
+    return {static_cast<__mmask16>(~m.v)};
+}
+
+[[nodiscard]] FORCE_INLINE mask16 operator&(mask16 a, mask16 b)
+{
+    return {static_cast<__mmask16>(a.v & b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE mask16 operator|(mask16 a, mask16 b)
+{
+    return {static_cast<__mmask16>(a.v | b.v)};
+}
+
+[[nodiscard]] FORCE_INLINE bool none(mask16 m)
+{
+    return m.v == 0;
+}
+
+[[nodiscard]] FORCE_INLINE bool all(mask16 m)
+{
+    return m.v == 0xffff;
+}
+
+// Returns the lanes of the mask as the bits of an integer, lane 0 being the
+// least significant bit
+[[nodiscard]] FORCE_INLINE u32 bits(mask16 m)
+{
+    return m.v;
+}
+
+// See compress(vf32, mask)
+[[nodiscard]] FORCE_INLINE vf32x16 compress(vf32x16 a, mask16 m)
+{
+    return {_mm512_maskz_compress_ps(m.v, a.v)};
+}
+
+FORCE_INLINE u32 compress_store(f32 *p, vf32x16 a, mask16 m)
+{
+    _mm512_mask_compressstoreu_ps(p, m.v, a.v);
+    return static_cast<u32>(std::popcount(m.v));
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 expand(vf32x16 a, mask16 m)
+{
+    return {_mm512_maskz_expand_ps(m.v, a.v)};
+}
+
+[[nodiscard]] FORCE_INLINE vf32x16 expand_load(const f32 *p, mask16 m)
+{
+    return {_mm512_maskz_expandloadu_ps(m.v, p)};
+}
+
+#endif
+
+} // namespace SIMD_NAMESPACE
+} // namespace simd
+
+using vf32 = simd::vf32;
+#if SIMD_AVX512F
+using vf32x16 = simd::vf32x16;
+#endif
 
 #endif // SIMD_HPP
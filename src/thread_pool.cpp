@@ -0,0 +1,119 @@
+#include "thread_pool.hpp"
+
+Thread_pool::Thread_pool(u32 thread_count)
+{
+    if (thread_count == 0)
+    {
+        thread_count = std::thread::hardware_concurrency();
+    }
+    m_thread_count = thread_count > 0 ? thread_count : 1;
+    m_ranges = std::make_unique<Task_range[]>(m_thread_count);
+    m_threads.reserve(m_thread_count - 1);
+    for (u32 i {1}; i < m_thread_count; ++i)
+    {
+        m_threads.emplace_back([this, i] { worker_main(i); });
+    }
+}
+
+Thread_pool::~Thread_pool()
+{
+    {
+        const std::lock_guard lock {m_mutex};
+        m_stop = true;
+    }
+    m_start_condition.notify_all();
+    for (auto &thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+u32 Thread_pool::thread_count() const noexcept
+{
+    return m_thread_count;
+}
+
+void Thread_pool::run(u32 task_count, Task_function function, void *context)
+{
+    if (task_count == 0)
+    {
+        return;
+    }
+
+    const auto thread_count = static_cast<u64>(m_thread_count);
+    for (u64 i {}; i < thread_count; ++i)
+    {
+        m_ranges[i].next.store(
+            static_cast<u32>(i * task_count / thread_count),
+            std::memory_order_relaxed);
+        m_ranges[i].end =
+            static_cast<u32>((i + 1) * task_count / thread_count);
+    }
+
+    {
+        const std::lock_guard lock {m_mutex};
+        m_function = function;
+        m_context = context;
+        m_active_threads = m_thread_count;
+        ++m_generation;
+    }
+    m_start_condition.notify_all();
+
+    work(0);
+
+    std::unique_lock lock {m_mutex};
+    m_done_condition.wait(lock, [this] { return m_active_threads == 0; });
+}
+
+void Thread_pool::work(u32 thread_index)
+{
+    // Drain our own range first, then steal from the other threads in a
+    // round-robin order. Ranges are only advanced with fetch_add, so a task
+    // index is handed out exactly once even when several threads race on the
+    // same range
+    for (u32 offset {}; offset < m_thread_count; ++offset)
+    {
+        auto &range = m_ranges[(thread_index + offset) % m_thread_count];
+        for (;;)
+        {
+            const auto task_index =
+                range.next.fetch_add(1, std::memory_order_relaxed);
+            if (task_index >= range.end)
+            {
+                break;
+            }
+            m_function(m_context, task_index);
+        }
+    }
+
+    bool last {};
+    {
+        const std::lock_guard lock {m_mutex};
+        last = --m_active_threads == 0;
+    }
+    if (last)
+    {
+        m_done_condition.notify_one();
+    }
+}
+
+void Thread_pool::worker_main(u32 thread_index)
+{
+    u64 generation {};
+    for (;;)
+    {
+        {
+            std::unique_lock lock {m_mutex};
+            m_start_condition.wait(
+                lock,
+                [this, generation]
+                { return m_stop || m_generation != generation; });
+            if (m_stop)
+            {
+                return;
+            }
+            generation = m_generation;
+        }
+        work(thread_index);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include "definitions.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class Thread_pool
+{
+public:
+    // A thread count of 0 uses all hardware threads. The calling thread takes
+    // part in the work, so thread_count - 1 threads are spawned
+    explicit Thread_pool(u32 thread_count = 0);
+
+    ~Thread_pool();
+
+    Thread_pool(const Thread_pool &) = delete;
+    Thread_pool(Thread_pool &&) = delete;
+    Thread_pool &operator=(const Thread_pool &) = delete;
+    Thread_pool &operator=(Thread_pool &&) = delete;
+
+    [[nodiscard]] u32 thread_count() const noexcept;
+
+    // Calls f(task_index) for every task_index in [0, task_count) and returns
+    // once all of them have completed. Tasks are initially distributed in
+    // contiguous ranges, idle threads then steal from the others' ranges
+    template <typename F>
+    void parallel_for(u32 task_count, F &&f)
+    {
+        run(
+            task_count,
+            [](void *context, u32 task_index)
+            { (*static_cast<std::remove_reference_t<F> *>(context))(task_index); },
+            &f);
+    }
+
+private:
+    using Task_function = void (*)(void *, u32);
+
+    struct alignas(64) Task_range
+    {
+        std::atomic<u32> next;
+        u32 end;
+    };
+
+    void run(u32 task_count, Task_function function, void *context);
+
+    void work(u32 thread_index);
+
+    void worker_main(u32 thread_index);
+
+    std::vector<std::thread> m_threads;
+    std::unique_ptr<Task_range[]> m_ranges;
+    u32 m_thread_count;
+
+    std::mutex m_mutex;
+    std::condition_variable m_start_condition;
+    std::condition_variable m_done_condition;
+    u64 m_generation {};
+    u32 m_active_threads {};
+    bool m_stop {};
+
+    Task_function m_function {};
+    void *m_context {};
+};
+
+#endif // THREAD_POOL_HPP
@@ -1,57 +1,924 @@
 #include "trace.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <utility>
+
 namespace
 {
 
-constexpr void intersect(const Ray &ray,
-                         const Triangle &triangle,
-                         u32 triangle_id,
-                         f32 t_min,
-                         f32 &t_max,
-                         Ray_payload &payload)
+constexpr u32 bvh_bin_count {16};
+constexpr u32 bvh_max_leaf_size {8};
+constexpr f32 bvh_traversal_cost {1.0f};
+// Past this depth, nodes are split at the object median, which bounds the
+// total depth (and thus the traversal stack size) to 64
+constexpr u32 bvh_max_sah_depth {32};
+// Nodes with fewer primitives are built serially by a single task
+constexpr u32 bvh_min_subtree_size {1 << 12};
+
+// Largest coordinate of a vertex on the grid
+constexpr f32 vertex_grid_max {65535.0f};
+
+struct Aabb
+{
+    f32v3 min {std::numeric_limits<f32>::max(),
+               std::numeric_limits<f32>::max(),
+               std::numeric_limits<f32>::max()};
+    f32v3 max {std::numeric_limits<f32>::lowest(),
+               std::numeric_limits<f32>::lowest(),
+               std::numeric_limits<f32>::lowest()};
+};
+
+[[nodiscard]] constexpr f32v3 min(f32v3 a, f32v3 b) noexcept
+{
+    return {math::min(a.x, b.x), math::min(a.y, b.y), math::min(a.z, b.z)};
+}
+
+[[nodiscard]] constexpr f32v3 max(f32v3 a, f32v3 b) noexcept
+{
+    return {math::max(a.x, b.x), math::max(a.y, b.y), math::max(a.z, b.z)};
+}
+
+constexpr void grow(Aabb &aabb, f32v3 p) noexcept
+{
+    aabb.min = min(aabb.min, p);
+    aabb.max = max(aabb.max, p);
+}
+
+constexpr void grow(Aabb &aabb, const Aabb &other) noexcept
+{
+    aabb.min = min(aabb.min, other.min);
+    aabb.max = max(aabb.max, other.max);
+}
+
+[[nodiscard]] constexpr f32 half_area(const Aabb &aabb) noexcept
+{
+    const auto extent = aabb.max - aabb.min;
+    if (extent.x < 0.0f)
+    {
+        return 0.0f;
+    }
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+[[nodiscard]] constexpr f32 component(f32v3 v, u32 axis) noexcept
+{
+    return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+// The primitive data is shared by all the tasks of a build, each of which owns
+// the nodes it creates and a disjoint range of indices
+struct Bvh_builder
+{
+    Aligned_vector<Bvh_node> &nodes;
+    const std::vector<Aabb> &primitive_bounds;
+    const std::vector<f32v3> &centroids;
+    std::vector<u32> &indices;
+};
+
+struct Bin
+{
+    Aabb bounds;
+    u32 count;
+};
+
+using Bins = std::array<std::array<Bin, bvh_bin_count>, 3>;
+
+struct Node_bounds
+{
+    Aabb bounds;
+    Aabb centroid_bounds;
+};
+
+constexpr void grow(Node_bounds &a, const Node_bounds &b) noexcept
+{
+    grow(a.bounds, b.bounds);
+    grow(a.centroid_bounds, b.centroid_bounds);
+}
+
+constexpr void grow(Bins &a, const Bins &b) noexcept
+{
+    for (u32 axis {}; axis < 3; ++axis)
+    {
+        for (u32 i {}; i < bvh_bin_count; ++i)
+        {
+            grow(a[axis][i].bounds, b[axis][i].bounds);
+            a[axis][i].count += b[axis][i].count;
+        }
+    }
+}
+
+[[nodiscard]] Node_bounds
+compute_bounds(const Bvh_builder &builder, u32 begin, u32 end)
+{
+    Node_bounds result {};
+    for (auto i = begin; i < end; ++i)
+    {
+        grow(result.bounds, builder.primitive_bounds[builder.indices[i]]);
+        grow(result.centroid_bounds, builder.centroids[builder.indices[i]]);
+    }
+    return result;
+}
+
+[[nodiscard]] FORCE_INLINE u32 bin_index(const Aabb &centroid_bounds,
+                                         u32 axis,
+                                         f32v3 centroid)
+{
+    const auto offset =
+        component(centroid, axis) - component(centroid_bounds.min, axis);
+    const auto scale =
+        static_cast<f32>(bvh_bin_count) /
+        (component(centroid_bounds.max, axis) -
+         component(centroid_bounds.min, axis));
+    return std::min(static_cast<u32>(offset * scale), bvh_bin_count - 1);
+}
+
+// Bins the primitives along every axis on which their centroids are spread
+void fill_bins(const Bvh_builder &builder,
+               u32 begin,
+               u32 end,
+               const Aabb &centroid_bounds,
+               Bins &bins)
+{
+    const auto centroid_extent = centroid_bounds.max - centroid_bounds.min;
+    for (u32 axis {}; axis < 3; ++axis)
+    {
+        if (component(centroid_extent, axis) <= 0.0f)
+        {
+            continue;
+        }
+        for (auto i = begin; i < end; ++i)
+        {
+            const auto primitive = builder.indices[i];
+            auto &bin = bins[axis][bin_index(
+                centroid_bounds, axis, builder.centroids[primitive])];
+            grow(bin.bounds, builder.primitive_bounds[primitive]);
+            ++bin.count;
+        }
+    }
+}
+
+// Chooses the split of the primitives [begin, end) of a node from their bins,
+// and partitions them. Returns the first index of the second child, or end if
+// the node must be a leaf
+[[nodiscard]] u32 split_node(Bvh_builder &builder,
+                             u32 begin,
+                             u32 end,
+                             u32 depth,
+                             const Node_bounds &node_bounds,
+                             const Bins &bins)
 {
-    // Möller-Trumbore
+    const auto count = end - begin;
+    if (count == 1)
+    {
+        return end;
+    }
+
+    const auto &bounds = node_bounds.bounds;
+    const auto &centroid_bounds = node_bounds.centroid_bounds;
+    const auto centroid_extent = centroid_bounds.max - centroid_bounds.min;
+    u32 largest_axis {0};
+    if (centroid_extent.y > component(centroid_extent, largest_axis))
+    {
+        largest_axis = 1;
+    }
+    if (centroid_extent.z > component(centroid_extent, largest_axis))
+    {
+        largest_axis = 2;
+    }
+
+    auto best_cost = std::numeric_limits<f32>::max();
+    u32 best_axis {largest_axis};
+    u32 best_split {0};
+    if (depth < bvh_max_sah_depth)
+    {
+        for (u32 axis {}; axis < 3; ++axis)
+        {
+            if (component(centroid_extent, axis) <= 0.0f)
+            {
+                continue;
+            }
+
+            // Sweep from the right to get the cost of every right partition,
+            // then from the left to evaluate every split plane
+            const auto &axis_bins = bins[axis];
+            std::array<f32, bvh_bin_count - 1> right_costs {};
+            Aabb right_bounds {};
+            u32 right_count {};
+            for (auto b = bvh_bin_count - 1; b > 0; --b)
+            {
+                grow(right_bounds, axis_bins[b].bounds);
+                right_count += axis_bins[b].count;
+                right_costs[b - 1] =
+                    half_area(right_bounds) * static_cast<f32>(right_count);
+            }
+            Aabb left_bounds {};
+            u32 left_count {};
+            for (u32 b {}; b < bvh_bin_count - 1; ++b)
+            {
+                grow(left_bounds, axis_bins[b].bounds);
+                left_count += axis_bins[b].count;
+                if (left_count == 0 || left_count == count)
+                {
+                    continue;
+                }
+                const auto cost =
+                    half_area(left_bounds) * static_cast<f32>(left_count) +
+                    right_costs[b];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b;
+                }
+            }
+        }
+    }
+
+    const auto leaf_cost = half_area(bounds) * static_cast<f32>(count);
+    const auto split_cost =
+        bvh_traversal_cost * half_area(bounds) + best_cost;
+    if (count <= bvh_max_leaf_size && leaf_cost <= split_cost)
+    {
+        return end;
+    }
 
-    constexpr f32 epsilon {1e-8f};
-    const auto edge1 = triangle.vertex1 - triangle.vertex0;
-    const auto edge2 = triangle.vertex2 - triangle.vertex0;
-    const auto h = vec::cross(ray.direction, edge2);
-    const auto a = vec::dot(edge1, h);
-    if (a > -epsilon && a < epsilon) [[unlikely]]
+    const auto first = builder.indices.begin() + begin;
+    const auto last = builder.indices.begin() + end;
+    auto middle = first;
+    if (best_cost < std::numeric_limits<f32>::max())
+    {
+        middle = std::partition(first,
+                                last,
+                                [&](u32 primitive)
+                                {
+                                    return bin_index(
+                                               centroid_bounds,
+                                               best_axis,
+                                               builder.centroids[primitive]) <=
+                                           best_split;
+                                });
+    }
+    else
     {
-        // The ray is parallel to the triangle
+        // No SAH split is available (or allowed at this depth): fall back to
+        // an object median split along the largest axis
+        middle = first + count / 2;
+        std::nth_element(first,
+                         middle,
+                         last,
+                         [&](u32 a, u32 b)
+                         {
+                             return component(builder.centroids[a],
+                                              largest_axis) <
+                                    component(builder.centroids[b],
+                                              largest_axis);
+                         });
+    }
+    return static_cast<u32>(middle - builder.indices.begin());
+}
+
+void build_node(Bvh_builder &builder,
+                u32 node_index,
+                u32 begin,
+                u32 end,
+                u32 depth)
+{
+    const auto node_bounds = compute_bounds(builder, begin, end);
+    Bins bins {};
+    if (depth < bvh_max_sah_depth && end - begin > 1)
+    {
+        fill_bins(builder, begin, end, node_bounds.centroid_bounds, bins);
+    }
+    const auto split =
+        split_node(builder, begin, end, depth, node_bounds, bins);
+    if (split == end)
+    {
+        builder.nodes[node_index] = {.aabb_min = node_bounds.bounds.min,
+                                     .first = begin,
+                                     .aabb_max = node_bounds.bounds.max,
+                                     .count = end - begin};
         return;
     }
-    const auto f = 1.0f / a;
-    const auto s = ray.origin - triangle.vertex0;
-    const auto u = f * vec::dot(s, h);
-    const auto q = vec::cross(s, edge1);
-    const auto v = f * vec::dot(ray.direction, q);
-    const auto t = f * vec::dot(edge2, q);
-    const auto hit_condition = (u >= 0.0f) & (u <= 1.0f) & (v >= 0.0f) &
-                               (u + v <= 1.0f) & (t > t_min) & (t < t_max);
-    if (hit_condition) [[unlikely]]
+
+    const auto child_index = static_cast<u32>(builder.nodes.size());
+    builder.nodes[node_index] = {.aabb_min = node_bounds.bounds.min,
+                                 .first = child_index,
+                                 .aabb_max = node_bounds.bounds.max,
+                                 .count = 0};
+    builder.nodes.emplace_back();
+    builder.nodes.emplace_back();
+    build_node(builder, child_index, begin, split, depth + 1);
+    build_node(builder, child_index + 1, split, end, depth + 1);
+}
+
+// Node whose primitives still have to be split
+struct Pending_node
+{
+    u32 node_index;
+    u32 begin;
+    u32 end;
+    u32 depth;
+};
+
+// Splits the large nodes near the root one at a time, with their bounds and
+// bins computed in parallel over blocks of primitives, until every pending
+// node is small enough to be built as a subtree by a single task. Returns
+// these subtrees
+[[nodiscard]] std::vector<Pending_node>
+build_top_nodes(Bvh_builder &builder,
+                u32 subtree_size,
+                Thread_pool &thread_pool)
+{
+    constexpr u32 block_size {1 << 14};
+    const auto primitive_count = static_cast<u32>(builder.indices.size());
+    std::vector<Pending_node> subtrees;
+    std::vector<Pending_node> pending {{0, 0, primitive_count, 0}};
+    std::vector<Node_bounds> block_bounds;
+    std::vector<Bins> block_bins;
+    while (!pending.empty())
     {
-        t_max = t;
-        payload.position = ray.origin + t * ray.direction;
-        payload.u = u;
-        payload.v = v;
-        payload.primitive_id = triangle_id;
+        const auto node = pending.back();
+        pending.pop_back();
+        if (node.end - node.begin <= subtree_size)
+        {
+            subtrees.push_back(node);
+            continue;
+        }
+
+        const auto block_count = (node.end - node.begin + block_size - 1) /
+                                 block_size;
+        const auto block_range = [&](u32 block)
+        {
+            const auto begin = node.begin + block * block_size;
+            return std::pair {begin, std::min(begin + block_size, node.end)};
+        };
+
+        block_bounds.assign(block_count, {});
+        thread_pool.parallel_for(block_count,
+                                 [&](u32 block)
+                                 {
+                                     const auto [begin, end] =
+                                         block_range(block);
+                                     block_bounds[block] =
+                                         compute_bounds(builder, begin, end);
+                                 });
+        Node_bounds node_bounds {};
+        for (const auto &bounds : block_bounds)
+        {
+            grow(node_bounds, bounds);
+        }
+
+        Bins bins {};
+        if (node.depth < bvh_max_sah_depth)
+        {
+            block_bins.assign(block_count, {});
+            thread_pool.parallel_for(
+                block_count,
+                [&](u32 block)
+                {
+                    const auto [begin, end] = block_range(block);
+                    fill_bins(builder,
+                              begin,
+                              end,
+                              node_bounds.centroid_bounds,
+                              block_bins[block]);
+                });
+            for (const auto &b : block_bins)
+            {
+                grow(bins, b);
+            }
+        }
+
+        const auto split = split_node(
+            builder, node.begin, node.end, node.depth, node_bounds, bins);
+        if (split == node.end)
+        {
+            builder.nodes[node.node_index] = {
+                .aabb_min = node_bounds.bounds.min,
+                .first = node.begin,
+                .aabb_max = node_bounds.bounds.max,
+                .count = node.end - node.begin};
+            continue;
+        }
+        const auto child_index = static_cast<u32>(builder.nodes.size());
+        builder.nodes[node.node_index] = {.aabb_min = node_bounds.bounds.min,
+                                          .first = child_index,
+                                          .aabb_max = node_bounds.bounds.max,
+                                          .count = 0};
+        builder.nodes.emplace_back();
+        builder.nodes.emplace_back();
+        pending.push_back(
+            {child_index + 1, split, node.end, node.depth + 1});
+        pending.push_back({child_index, node.begin, split, node.depth + 1});
     }
+    return subtrees;
+}
+
+// Makes wide_nodes[wide_index] from the binary node: its children are found by
+// repeatedly replacing the inner child with the largest surface area, the one
+// most likely to be visited, by its own two children, until there are 8 or
+// only leaves remain
+void collapse_node(const Aligned_vector<Bvh_node> &nodes,
+                   u32 binary_index,
+                   Aligned_vector<Bvh8_node> &wide_nodes,
+                   u32 wide_index)
+{
+    std::array<u32, 8> children {};
+    u32 child_count {};
+    const auto &binary_node = nodes[binary_index];
+    if (binary_node.count > 0)
+    {
+        children[child_count++] = binary_index;
+    }
+    else
+    {
+        children[child_count++] = binary_node.first;
+        children[child_count++] = binary_node.first + 1;
+    }
+    while (child_count < children.size())
+    {
+        u32 largest {child_count};
+        f32 largest_area {-1.0f};
+        for (u32 c {}; c < child_count; ++c)
+        {
+            const auto &child = nodes[children[c]];
+            const auto area =
+                half_area({.min = child.aabb_min, .max = child.aabb_max});
+            if (child.count == 0 && area > largest_area)
+            {
+                largest = c;
+                largest_area = area;
+            }
+        }
+        if (largest == child_count)
+        {
+            break;
+        }
+        const auto first = nodes[children[largest]].first;
+        children[largest] = first;
+        children[child_count++] = first + 1;
+    }
+
+    Bvh8_node wide_node {};
+    wide_node.child_count = child_count;
+    for (u32 c {}; c < child_count; ++c)
+    {
+        const auto &child = nodes[children[c]];
+        wide_node.min_x[c] = child.aabb_min.x;
+        wide_node.min_y[c] = child.aabb_min.y;
+        wide_node.min_z[c] = child.aabb_min.z;
+        wide_node.max_x[c] = child.aabb_max.x;
+        wide_node.max_y[c] = child.aabb_max.y;
+        wide_node.max_z[c] = child.aabb_max.z;
+        if (child.count > 0)
+        {
+            wide_node.first[c] = child.first;
+            wide_node.count[c] = static_cast<u8>(child.count);
+        }
+        else
+        {
+            wide_node.first[c] = static_cast<u32>(wide_nodes.size());
+            wide_nodes.emplace_back();
+        }
+    }
+    wide_nodes[wide_index] = wide_node;
+
+    for (u32 c {}; c < child_count; ++c)
+    {
+        if (wide_node.count[c] == 0)
+        {
+            collapse_node(nodes, children[c], wide_nodes, wide_node.first[c]);
+        }
+    }
+}
+
+[[nodiscard]] FORCE_INLINE u16v3 grid_coordinates(const Vertex_grid &grid,
+                                                  f32v3 position) noexcept
+{
+    const auto coordinate = [&](f32 p, f32 origin)
+    {
+        return static_cast<u16>(std::clamp(
+            std::round((p - origin) / grid.step), 0.0f, vertex_grid_max));
+    };
+    return {coordinate(position.x, grid.origin.x),
+            coordinate(position.y, grid.origin.y),
+            coordinate(position.z, grid.origin.z)};
+}
+
+// Same expression as in vertex_position(), which is exact for grid points
+[[nodiscard]] FORCE_INLINE f32v3 grid_point(const Vertex_grid &grid,
+                                            u16v3 coordinates) noexcept
+{
+    return grid.origin + grid.step * f32v3 {static_cast<f32>(coordinates.x),
+                                            static_cast<f32>(coordinates.y),
+                                            static_cast<f32>(coordinates.z)};
+}
+
+[[nodiscard]] FORCE_INLINE std::size_t position_hash(f32v3 position) noexcept
+{
+    auto hash = std::bit_cast<u32>(position.x) * 0x9e3779b97f4a7c15ull ^
+                std::bit_cast<u32>(position.y) * 0xc2b2ae3d27d4eb4full ^
+                std::bit_cast<u32>(position.z) * 0x165667b19e3779f9ull;
+    hash ^= hash >> 32;
+    return static_cast<std::size_t>(hash);
+}
+
+// Compares the bits, such that merged vertices are bitwise identical
+[[nodiscard]] FORCE_INLINE bool same_position(f32v3 a, f32v3 b) noexcept
+{
+    return std::bit_cast<u32>(a.x) == std::bit_cast<u32>(b.x) &&
+           std::bit_cast<u32>(a.y) == std::bit_cast<u32>(b.y) &&
+           std::bit_cast<u32>(a.z) == std::bit_cast<u32>(b.z);
+}
+
+// Builds the BVH over primitives given by their bounds and the centroids of
+// these. indices must hold every primitive once, and is reordered such that
+// every leaf references a contiguous range of it
+[[nodiscard]] Bvh build_bvh(const std::vector<Aabb> &primitive_bounds,
+                            const std::vector<f32v3> &centroids,
+                            std::vector<u32> &indices,
+                            Thread_pool &thread_pool)
+{
+    const auto primitive_count = static_cast<u32>(indices.size());
+    Aligned_vector<Bvh_node> binary_nodes(1);
+    Bvh_builder builder {.nodes = binary_nodes,
+                         .primitive_bounds = primitive_bounds,
+                         .centroids = centroids,
+                         .indices = indices};
+
+    // Several subtrees per thread, so that work stealing can balance subtrees
+    // of different costs
+    const auto subtree_size =
+        std::max(primitive_count / (8 * thread_pool.thread_count()),
+                 bvh_min_subtree_size);
+    const auto subtrees = build_top_nodes(builder, subtree_size, thread_pool);
+
+    // Every subtree is built depth-first into its own nodes, as the whole BVH
+    // would be by a serial build, so the result does not depend on the number
+    // of threads
+    std::vector<Aligned_vector<Bvh_node>> subtree_nodes(subtrees.size());
+    thread_pool.parallel_for(
+        static_cast<u32>(subtrees.size()),
+        [&](u32 s)
+        {
+            const auto &subtree = subtrees[s];
+            auto &nodes = subtree_nodes[s];
+            nodes.reserve(2 * static_cast<std::size_t>(subtree.end -
+                                                       subtree.begin) -
+                          1);
+            nodes.emplace_back();
+            Bvh_builder subtree_builder {.nodes = nodes,
+                                         .primitive_bounds = primitive_bounds,
+                                         .centroids = centroids,
+                                         .indices = indices};
+            build_node(subtree_builder,
+                       0,
+                       subtree.begin,
+                       subtree.end,
+                       subtree.depth);
+        });
+
+    // The root of a subtree replaces its pending node, and its other nodes are
+    // appended after the top nodes
+    std::vector<u32> offsets(subtrees.size());
+    auto node_count = static_cast<u32>(binary_nodes.size());
+    for (std::size_t s {}; s < subtrees.size(); ++s)
+    {
+        offsets[s] = node_count;
+        node_count += static_cast<u32>(subtree_nodes[s].size()) - 1;
+    }
+    binary_nodes.resize(node_count);
+    thread_pool.parallel_for(
+        static_cast<u32>(subtrees.size()),
+        [&](u32 s)
+        {
+            const auto &nodes = subtree_nodes[s];
+            const auto relocate = [&](Bvh_node node)
+            {
+                if (node.count == 0)
+                {
+                    node.first += offsets[s] - 1;
+                }
+                return node;
+            };
+            binary_nodes[subtrees[s].node_index] = relocate(nodes.front());
+            for (std::size_t i {1}; i < nodes.size(); ++i)
+            {
+                binary_nodes[offsets[s] + i - 1] = relocate(nodes[i]);
+            }
+        });
+
+    Aligned_vector<Bvh8_node> wide_nodes(1);
+    collapse_node(binary_nodes, 0, wide_nodes, 0);
+
+    return {.nodes = std::move(binary_nodes),
+            .wide_nodes = std::move(wide_nodes)};
 }
 
 } // namespace
 
-Ray_payload intersect(const Ray &ray, const std::vector<Triangle> &triangles)
+Bvh build_bvh(std::vector<Triangle> &triangles, Thread_pool &thread_pool)
+{
+    if (triangles.empty())
+    {
+        return {};
+    }
+
+    constexpr u32 block_size {1 << 14};
+    const auto triangle_count = static_cast<u32>(triangles.size());
+    const auto block_count = (triangle_count + block_size - 1) / block_size;
+
+    std::vector<Aabb> primitive_bounds(triangle_count);
+    std::vector<f32v3> centroids(triangle_count);
+    std::vector<u32> indices(triangle_count);
+    thread_pool.parallel_for(
+        block_count,
+        [&](u32 block)
+        {
+            const auto begin = block * block_size;
+            const auto end = std::min(begin + block_size, triangle_count);
+            for (auto i = begin; i < end; ++i)
+            {
+                auto &bounds = primitive_bounds[i];
+                grow(bounds, triangles[i].vertex0);
+                grow(bounds, triangles[i].vertex1);
+                grow(bounds, triangles[i].vertex2);
+                centroids[i] = (bounds.min + bounds.max) * 0.5f;
+                indices[i] = i;
+            }
+        });
+
+    auto bvh =
+        build_bvh(primitive_bounds, centroids, indices, thread_pool);
+
+    std::vector<Triangle> ordered_triangles(triangle_count);
+    thread_pool.parallel_for(
+        block_count,
+        [&](u32 block)
+        {
+            const auto begin = block * block_size;
+            const auto end = std::min(begin + block_size, triangle_count);
+            for (auto i = begin; i < end; ++i)
+            {
+                ordered_triangles[i] = triangles[indices[i]];
+            }
+        });
+    triangles = std::move(ordered_triangles);
+    return bvh;
+}
+
+Transform inverse(const Transform &transform)
+{
+    // The rows of the inverse of the linear part are the cross products of its
+    // columns, divided by its determinant
+    const auto row_x = vec::cross(transform.y, transform.z);
+    const auto row_y = vec::cross(transform.z, transform.x);
+    const auto row_z = vec::cross(transform.x, transform.y);
+    const auto inv_determinant = 1.0f / vec::dot(transform.x, row_x);
+    Transform result {
+        .x = f32v3 {row_x.x, row_y.x, row_z.x} * inv_determinant,
+        .y = f32v3 {row_x.y, row_y.y, row_z.y} * inv_determinant,
+        .z = f32v3 {row_x.z, row_y.z, row_z.z} * inv_determinant,
+        .translation = {}};
+    result.translation = -transform_vector(result, transform.translation);
+    return result;
+}
+
+Scene_geometry build_scene_geometry(std::vector<Object> objects,
+                                    std::vector<Instance> instances,
+                                    Thread_pool &thread_pool)
+{
+    // Instances of empty objects could not be bounded
+    std::erase_if(instances,
+                  [&](const Instance &instance)
+                  { return objects[instance.object_id].bvh.nodes.empty(); });
+    if (instances.empty())
+    {
+        return {.objects = std::move(objects), .instances = {}, .bvh = {}};
+    }
+
+    const auto instance_count = static_cast<u32>(instances.size());
+    std::vector<Aabb> primitive_bounds(instance_count);
+    std::vector<f32v3> centroids(instance_count);
+    std::vector<u32> indices(instance_count);
+    for (u32 i {}; i < instance_count; ++i)
+    {
+        // Bounds of the transformed corners of the bounds of the object
+        const auto &instance = instances[i];
+        const auto &root = objects[instance.object_id].bvh.nodes.front();
+        auto &bounds = primitive_bounds[i];
+        for (u32 corner {}; corner < 8; ++corner)
+        {
+            const f32v3 p {
+                (corner & 1) != 0 ? root.aabb_max.x : root.aabb_min.x,
+                (corner & 2) != 0 ? root.aabb_max.y : root.aabb_min.y,
+                (corner & 4) != 0 ? root.aabb_max.z : root.aabb_min.z};
+            grow(bounds, transform_point(instance.object_to_world, p));
+        }
+        centroids[i] = (bounds.min + bounds.max) * 0.5f;
+        indices[i] = i;
+    }
+
+    auto bvh = build_bvh(primitive_bounds, centroids, indices, thread_pool);
+
+    Aligned_vector<Instance> ordered_instances(instance_count);
+    for (u32 i {}; i < instance_count; ++i)
+    {
+        ordered_instances[i] = instances[indices[i]];
+    }
+    return {.objects = std::move(objects),
+            .instances = std::move(ordered_instances),
+            .bvh = std::move(bvh)};
+}
+
+Bvh_stats compute_bvh_stats(const Bvh &bvh)
+{
+    Bvh_stats stats {.node_count = static_cast<u32>(bvh.nodes.size()),
+                     .leaf_count = 0,
+                     .wide_node_count = static_cast<u32>(bvh.wide_nodes.size()),
+                     .max_depth = 0,
+                     .max_leaf_size = 0,
+                     .average_leaf_size = 0.0f,
+                     .sah_cost = 0.0f};
+    if (bvh.nodes.empty())
+    {
+        return stats;
+    }
+
+    const auto &root = bvh.nodes.front();
+    const auto root_area =
+        half_area({.min = root.aabb_min, .max = root.aabb_max});
+    u32 triangle_count {};
+    f64 cost {};
+    std::vector<std::pair<u32, u32>> stack {{0, 0}};
+    while (!stack.empty())
+    {
+        const auto [node_index, depth] = stack.back();
+        stack.pop_back();
+        const auto &node = bvh.nodes[node_index];
+        const auto area =
+            half_area({.min = node.aabb_min, .max = node.aabb_max});
+        stats.max_depth = std::max(stats.max_depth, depth);
+        if (node.count > 0)
+        {
+            ++stats.leaf_count;
+            stats.max_leaf_size = std::max(stats.max_leaf_size, node.count);
+            triangle_count += node.count;
+            cost += static_cast<f64>(area * static_cast<f32>(node.count));
+        }
+        else
+        {
+            cost += static_cast<f64>(area * bvh_traversal_cost);
+            stack.emplace_back(node.first, depth + 1);
+            stack.emplace_back(node.first + 1, depth + 1);
+        }
+    }
+    stats.average_leaf_size = static_cast<f32>(triangle_count) /
+                              static_cast<f32>(stats.leaf_count);
+    if (root_area > 0.0f)
+    {
+        stats.sah_cost = static_cast<f32>(cost / static_cast<f64>(root_area));
+    }
+    return stats;
+}
+
+std::optional<Vertex_grid>
+make_vertex_grid(const std::vector<Triangle> &triangles)
+{
+    Aabb bounds {};
+    for (const auto &triangle : triangles)
+    {
+        grow(bounds, triangle.vertex0);
+        grow(bounds, triangle.vertex1);
+        grow(bounds, triangle.vertex2);
+    }
+    const auto extent = bounds.max - bounds.min;
+    const auto max_extent =
+        math::max(math::max(extent.x, extent.y), extent.z);
+    if (max_extent <= 0.0f)
+    {
+        return std::nullopt;
+    }
+
+    // Rounding the origin down loses at most one step, hence the grid spans
+    // vertex_grid_max - 1 steps from the lower bounds
+    auto step = std::exp2(std::ceil(std::log2(max_extent / vertex_grid_max)));
+    while (step * (vertex_grid_max - 1.0f) < max_extent)
+    {
+        step *= 2.0f;
+    }
+    const Vertex_grid grid {.origin = {std::floor(bounds.min.x / step) * step,
+                                       std::floor(bounds.min.y / step) * step,
+                                       std::floor(bounds.min.z / step) * step},
+                            .step = step};
+
+    // The points are multiples of the step, which are exact up to 2^24 steps
+    constexpr f32 max_exact_steps {16777216.0f};
+    const auto max_origin =
+        math::max(math::max(std::abs(grid.origin.x), std::abs(grid.origin.y)),
+                  std::abs(grid.origin.z));
+    if (max_origin / step + vertex_grid_max > max_exact_steps)
+    {
+        return std::nullopt;
+    }
+    return grid;
+}
+
+void snap_to_grid(std::vector<Triangle> &triangles, const Vertex_grid &grid)
+{
+    for (auto &triangle : triangles)
+    {
+        for (auto *vertex :
+             {&triangle.vertex0, &triangle.vertex1, &triangle.vertex2})
+        {
+            *vertex = grid_point(grid, grid_coordinates(grid, *vertex));
+        }
+    }
+}
+
+Triangle_soa make_triangle_soa(const std::vector<Triangle> &triangles,
+                               const std::optional<Vertex_grid> &grid)
+{
+    Aligned_vector<f32v3> vertices;
+    Aligned_vector<u32v3> indices;
+    Aligned_vector<f32v3> normal;
+    Aligned_vector<u32> material_id;
+    indices.reserve(triangles.size());
+    normal.reserve(triangles.size());
+    material_id.reserve(triangles.size());
+
+    // Open addressing table of the vertex ids plus one, 0 marking the free
+    // slots. It is at most three quarters full, when no vertex is shared
+    const auto slot_count = std::bit_ceil(4 * triangles.size() + 1);
+    const auto slot_mask = slot_count - 1;
+    std::vector<u32> slots(slot_count);
+    const auto vertex_id = [&](f32v3 position)
+    {
+        for (auto slot = position_hash(position) & slot_mask;;
+             slot = (slot + 1) & slot_mask)
+        {
+            if (slots[slot] == 0)
+            {
+                vertices.push_back(position);
+                slots[slot] = static_cast<u32>(vertices.size());
+                return slots[slot] - 1;
+            }
+            if (same_position(vertices[slots[slot] - 1], position))
+            {
+                return slots[slot] - 1;
+            }
+        }
+    };
+
+    for (const auto &triangle : triangles)
+    {
+        const auto e1 = triangle.vertex1 - triangle.vertex0;
+        const auto e2 = triangle.vertex2 - triangle.vertex0;
+        const auto n = vec::cross(e1, e2);
+        const auto length = vec::length(n);
+        const auto id0 = vertex_id(triangle.vertex0);
+        const auto id1 = vertex_id(triangle.vertex1);
+        const auto id2 = vertex_id(triangle.vertex2);
+        indices.push_back({id0, id1, id2});
+        // Degenerate triangles cannot be hit, but must not produce NaNs
+        normal.push_back(length > 0.0f ? n * (1.0f / length) : f32v3 {});
+        material_id.push_back(triangle.material_id);
+    }
+
+    Aligned_vector<u16v3> quantized_vertices;
+    if (grid.has_value())
+    {
+        quantized_vertices.reserve(vertices.size());
+        for (const auto &position : vertices)
+        {
+            quantized_vertices.push_back(grid_coordinates(*grid, position));
+        }
+        vertices = {};
+    }
+    return {.vertices = std::move(vertices),
+            .quantized_vertices = std::move(quantized_vertices),
+            .grid = grid.value_or(Vertex_grid {}),
+            .indices = std::move(indices),
+            .normal = std::move(normal),
+            .material_id = std::move(material_id)};
+}
+
+Ray_packet8 make_packet(const std::array<Ray, 8> &rays)
 {
-    constexpr f32 t_min {1e-6f};
-    constexpr f32 t_max {std::numeric_limits<f32>::max()};
-    f32 t {t_max};
-    Ray_payload payload {};
-    payload.primitive_id = 0xffffffffu;
-    for (u32 i {}; i < triangles.size(); ++i)
+    Ray_packet8 packet {};
+    for (std::size_t k {}; k < rays.size(); ++k)
     {
-        intersect(ray, triangles[i], i, t_min, t, payload);
+        packet.origin_x[k] = rays[k].origin.x;
+        packet.origin_y[k] = rays[k].origin.y;
+        packet.origin_z[k] = rays[k].origin.z;
+        packet.direction_x[k] = rays[k].direction.x;
+        packet.direction_y[k] = rays[k].direction.y;
+        packet.direction_z[k] = rays[k].direction.z;
     }
-    return payload;
+    return packet;
 }
@@ -2,8 +2,14 @@
 #define TRACE_HPP
 
 #include "definitions.hpp"
+#include "memory.hpp"
+#include "thread_pool.hpp"
 #include "vec.hpp"
 
+#include <array>
+#include <bit>
+#include <cmath>
+#include <optional>
 #include <vector>
 
 struct Ray
@@ -20,15 +26,330 @@ struct Triangle
     u32 material_id;
 };
 
+// Grid of 2^16 points per axis over the vertices of a scene. The step is a
+// power of two and the origin one of its multiples, so that the points are
+// exact floats whether or not the products are fused
+struct Vertex_grid
+{
+    f32v3 origin;
+    f32 step;
+};
+
+// Triangles split into one stream per attribute, in the order of the BVH
+// leaves. The triangles share their vertices, whose positions are either
+// floats or 16-bit coordinates on a grid, and the unit geometric normals are
+// precomputed. Kernels only read the streams they need: the intersection
+// tests the indices and the positions, shading the normals and materials
+struct Triangle_soa
+{
+    // Empty if the positions are quantized
+    Buffer<f32v3> vertices;
+    Buffer<u16v3> quantized_vertices;
+    Vertex_grid grid;
+    Buffer<u32v3> indices;
+    Buffer<f32v3> normal;
+    Buffer<u32> material_id;
+};
+
+[[nodiscard]] FORCE_INLINE constexpr f32v3
+vertex_position(const Triangle_soa &triangles, u32 vertex_id)
+{
+    if (triangles.quantized_vertices.empty())
+    {
+        return triangles.vertices[vertex_id];
+    }
+    const auto position = triangles.quantized_vertices[vertex_id];
+    return triangles.grid.origin +
+           triangles.grid.step * f32v3 {static_cast<f32>(position.x),
+                                        static_cast<f32>(position.y),
+                                        static_cast<f32>(position.z)};
+}
+
+// First vertex of a triangle and its edges to the two others, as used by the
+// intersection and by the sampling of points on the triangle
+struct Triangle_edges
+{
+    f32v3 vertex0;
+    f32v3 edge1;
+    f32v3 edge2;
+};
+
+[[nodiscard]] FORCE_INLINE constexpr Triangle_edges
+triangle_edges(const Triangle_soa &triangles, u32 triangle_id)
+{
+    const auto indices = triangles.indices[triangle_id];
+    const auto vertex0 = vertex_position(triangles, indices.x);
+    return {.vertex0 = vertex0,
+            .edge1 = vertex_position(triangles, indices.y) - vertex0,
+            .edge2 = vertex_position(triangles, indices.z) - vertex0};
+}
+
 struct Ray_payload
 {
     f32v3 position;
     f32 u;
     f32 v;
+    // Index of the triangle in its object
     u32 primitive_id;
+    u32 instance_id;
+};
+
+// Structure-of-arrays packet of 8 rays, lane i holding ray i. Stored as floats
+// rather than SIMD vectors, whose type depends on the instruction set, so that
+// it has the same layout for the kernels of every instruction set
+struct alignas(32) Ray_packet8
+{
+    std::array<f32, 8> origin_x;
+    std::array<f32, 8> origin_y;
+    std::array<f32, 8> origin_z;
+    std::array<f32, 8> direction_x;
+    std::array<f32, 8> direction_y;
+    std::array<f32, 8> direction_z;
 };
 
+struct Bvh_node
+{
+    f32v3 aabb_min;
+    // Index of the first child if count is 0, otherwise index of the first
+    // triangle of the leaf. The second child is always stored at first + 1
+    u32 first;
+    f32v3 aabb_max;
+    u32 count;
+};
+
+static_assert(sizeof(Bvh_node) == 32);
+
+// Node of the 8-wide BVH. The bounds of the children are stored per axis, so
+// that a single 8-wide slab test checks all of them. The children occupy the
+// first child_count lanes
+struct alignas(cache_line_size) Bvh8_node
+{
+    std::array<f32, 8> min_x;
+    std::array<f32, 8> min_y;
+    std::array<f32, 8> min_z;
+    std::array<f32, 8> max_x;
+    std::array<f32, 8> max_y;
+    std::array<f32, 8> max_z;
+    // Index of the child node if count is 0, otherwise index of the first
+    // triangle of the leaf
+    std::array<u32, 8> first;
+    std::array<u8, 8> count;
+    u32 child_count;
+};
+
+static_assert(sizeof(Bvh8_node) == 4 * cache_line_size);
+
+// The binary nodes are traversed by packets, and the 8-wide nodes, collapsed
+// from them and referencing the same leaves, by single rays
+struct Bvh
+{
+    Buffer<Bvh_node> nodes;
+    Buffer<Bvh8_node> wide_nodes;
+};
+
+// Measures of the quality of a BVH for tracing
+struct Bvh_stats
+{
+    u32 node_count;
+    u32 leaf_count;
+    u32 wide_node_count;
+    u32 max_depth;
+    u32 max_leaf_size;
+    f32 average_leaf_size;
+    // Expected cost of tracing a ray that hits the root, in triangle
+    // intersections, from the surface areas of the nodes
+    f32 sah_cost;
+};
+
+// Builds a binned SAH BVH, and the 8-wide BVH from it. The triangles are
+// reordered such that every leaf references a contiguous range of them. The
+// nodes close to the root are split with parallel binning, and the subtrees
+// below them are built by parallel tasks, which gives the same tree as a
+// serial build
+[[nodiscard]] Bvh build_bvh(std::vector<Triangle> &triangles,
+                            Thread_pool &thread_pool);
+
+[[nodiscard]] Bvh_stats compute_bvh_stats(const Bvh &bvh);
+
+// Returns the grid over the vertices of the triangles, or nothing if they are
+// too far from the origin, relative to their extent, for its points to be
+// exact
+[[nodiscard]] std::optional<Vertex_grid>
+make_vertex_grid(const std::vector<Triangle> &triangles);
+
+// Moves every vertex to the nearest point of the grid
+void snap_to_grid(std::vector<Triangle> &triangles, const Vertex_grid &grid);
+
+// Merges the vertices with identical positions, numbered in the order in which
+// the triangles first use them, so that the triangles of a leaf mostly read
+// neighbouring vertices. With a grid, the triangles must have been snapped to
+// it, and the positions are stored as their coordinates on it
+[[nodiscard]] Triangle_soa
+make_triangle_soa(const std::vector<Triangle> &triangles,
+                  const std::optional<Vertex_grid> &grid);
+
+// Affine transform mapping p to x * p.x + y * p.y + z * p.z + translation
+struct Transform
+{
+    f32v3 x;
+    f32v3 y;
+    f32v3 z;
+    f32v3 translation;
+};
+
+constexpr inline Transform identity_transform {.x = {1.0f, 0.0f, 0.0f},
+                                               .y = {0.0f, 1.0f, 0.0f},
+                                               .z = {0.0f, 0.0f, 1.0f},
+                                               .translation = {}};
+
+[[nodiscard]] FORCE_INLINE constexpr f32v3
+transform_vector(const Transform &transform, f32v3 v)
+{
+    return transform.x * v.x + transform.y * v.y + transform.z * v.z;
+}
+
+[[nodiscard]] FORCE_INLINE constexpr f32v3
+transform_point(const Transform &transform, f32v3 p)
+{
+    return transform_vector(transform, p) + transform.translation;
+}
+
+// Transforms a normal by the inverse transpose of the transform, given the
+// inverse, which keeps it orthogonal to the transformed surface. The result is
+// not normalized
+[[nodiscard]] FORCE_INLINE constexpr f32v3
+transform_normal(const Transform &inverse_transform, f32v3 n)
+{
+    return {vec::dot(inverse_transform.x, n),
+            vec::dot(inverse_transform.y, n),
+            vec::dot(inverse_transform.z, n)};
+}
+
+// The transform must be invertible
+[[nodiscard]] Transform inverse(const Transform &transform);
+
+// Triangles with their BVH, in object space
+struct Object
+{
+    Triangle_soa triangles;
+    Bvh bvh;
+};
+
+constexpr inline u32 no_material_override {0xffffffffu};
+
+// Places an object in the scene
+struct Instance
+{
+    Transform object_to_world;
+    Transform world_to_object;
+    u32 object_id;
+    // Material of every triangle of the object, or no_material_override to
+    // keep theirs
+    u32 material_id;
+};
+
+// Two-level acceleration structure: every object has its own BVH in object
+// space, and the instances placing the objects in the scene are bounded by a
+// BVH in world space, so that an object repeated by many instances is stored
+// once. Rays are transformed into object space to traverse the objects of the
+// instances they reach. The instance BVH has the same layout as the BVH of
+// an object, its leaves referencing ranges of instances
+struct Scene_geometry
+{
+    std::vector<Object> objects;
+    Buffer<Instance> instances;
+    Bvh bvh;
+};
+
+// Builds the BVH over the world bounds of the instances, and reorders them
+// such that every leaf references a contiguous range of them
+[[nodiscard]] Scene_geometry
+build_scene_geometry(std::vector<Object> objects,
+                     std::vector<Instance> instances,
+                     Thread_pool &thread_pool);
+
+// Material of a triangle, with the override of its instance
+[[nodiscard]] FORCE_INLINE u32
+surface_material_id(const Scene_geometry &geometry,
+                    u32 instance_id,
+                    u32 triangle_id)
+{
+    const auto &instance = geometry.instances[instance_id];
+    if (instance.material_id != no_material_override)
+    {
+        return instance.material_id;
+    }
+    return geometry.objects[instance.object_id]
+        .triangles.material_id[triangle_id];
+}
+
+// Unit geometric normal of a triangle, in world space
+[[nodiscard]] FORCE_INLINE f32v3 surface_normal(const Scene_geometry &geometry,
+                                                u32 instance_id,
+                                                u32 triangle_id)
+{
+    const auto &instance = geometry.instances[instance_id];
+    const auto normal =
+        geometry.objects[instance.object_id].triangles.normal[triangle_id];
+    const auto n = transform_normal(instance.world_to_object, normal);
+    const auto length = vec::length(n);
+    // Degenerate triangles have a null normal
+    return length > 0.0f ? n * (1.0f / length) : f32v3 {};
+}
+
+// Point of barycentric coordinates (u, v) on a triangle, in world space
+[[nodiscard]] FORCE_INLINE f32v3 surface_point(const Scene_geometry &geometry,
+                                               u32 instance_id,
+                                               u32 triangle_id,
+                                               f32 u,
+                                               f32 v)
+{
+    const auto &instance = geometry.instances[instance_id];
+    const auto [vertex0, edge1, edge2] = triangle_edges(
+        geometry.objects[instance.object_id].triangles, triangle_id);
+    return transform_point(instance.object_to_world,
+                           vertex0 + u * edge1 + v * edge2);
+}
+
 [[nodiscard]] Ray_payload intersect(const Ray &ray,
-                                    const std::vector<Triangle> &triangles);
+                                    const Scene_geometry &geometry);
+
+// Returns whether the ray hits any triangle closer than t_max. Stops at the
+// first hit found and does not compute a payload, which makes it cheaper than
+// intersect() for shadow and visibility rays
+[[nodiscard]] bool
+occluded(const Ray &ray, f32 t_max, const Scene_geometry &geometry);
+
+// Moves a hit position off the surface along the normal by a few ulps of its
+// coordinates, so that rays starting from it do not hit the same surface
+// again whatever the scale of the scene. From "A Fast and Robust Method for
+// Avoiding Self-Intersection" by Wächter and Binder
+[[nodiscard]] FORCE_INLINE f32v3 offset_ray_origin(f32v3 position,
+                                                   f32v3 normal) noexcept
+{
+    const auto offset = [](f32 p, f32 n)
+    {
+        constexpr f32 origin {1.0f / 32.0f};
+        constexpr f32 float_scale {1.0f / 65536.0f};
+        constexpr f32 int_scale {256.0f};
+        if (std::abs(p) < origin)
+        {
+            return p + float_scale * n;
+        }
+        const auto ulps = static_cast<i32>(int_scale * n);
+        return std::bit_cast<f32>(std::bit_cast<i32>(p) +
+                                  (p < 0.0f ? -ulps : ulps));
+    };
+    return {offset(position.x, normal.x),
+            offset(position.y, normal.y),
+            offset(position.z, normal.z)};
+}
+
+[[nodiscard]] Ray_packet8 make_packet(const std::array<Ray, 8> &rays);
+
+// Traces the 8 rays of the packet together, which is efficient when they are
+// coherent, e.g. primary rays through neighbouring pixels
+[[nodiscard]] std::array<Ray_payload, 8>
+intersect8(const Ray_packet8 &rays, const Scene_geometry &geometry);
 
 #endif // TRACE_HPP
@@ -0,0 +1,634 @@
+#include "kernels.hpp"
+#include "trace.hpp"
+
+#include <array>
+#include <bit>
+#include <limits>
+#include <utility>
+
+namespace
+{
+
+// The binary BVH is at most 64 levels deep
+constexpr u32 bvh_stack_size {64};
+// Each level of the 8-wide BVH pushes at most 7 children besides the nearest,
+// and is at most as deep as the binary BVH
+constexpr u32 bvh8_stack_size {7 * bvh_stack_size + 1};
+// Entry distance returned for a missed box. Infinity cannot be used as the
+// sentinel since the code is compiled with -ffast-math
+constexpr f32 t_miss {std::numeric_limits<f32>::max()};
+
+// Ray_packet8 loaded into SIMD vectors
+struct Packet8
+{
+    vf32v3 origin;
+    vf32v3 direction;
+};
+
+[[nodiscard]] FORCE_INLINE Packet8 load_packet(const Ray_packet8 &packet)
+{
+    return {.origin = {simd::load_aligned(packet.origin_x.data()),
+                       simd::load_aligned(packet.origin_y.data()),
+                       simd::load_aligned(packet.origin_z.data())},
+            .direction = {simd::load_aligned(packet.direction_x.data()),
+                          simd::load_aligned(packet.direction_y.data()),
+                          simd::load_aligned(packet.direction_z.data())}};
+}
+
+// Returns the bits of the children of the node that the ray enters before
+// t_max, and their entry distances
+[[nodiscard]] FORCE_INLINE u32 intersect(const vf32v3 &origin,
+                                         const vf32v3 &inv_direction,
+                                         const Bvh8_node &node,
+                                         vf32 t_min,
+                                         vf32 t_max,
+                                         vf32 &t_entry)
+{
+    const auto t0_x =
+        (simd::load_aligned(node.min_x.data()) - origin.x) * inv_direction.x;
+    const auto t0_y =
+        (simd::load_aligned(node.min_y.data()) - origin.y) * inv_direction.y;
+    const auto t0_z =
+        (simd::load_aligned(node.min_z.data()) - origin.z) * inv_direction.z;
+    const auto t1_x =
+        (simd::load_aligned(node.max_x.data()) - origin.x) * inv_direction.x;
+    const auto t1_y =
+        (simd::load_aligned(node.max_y.data()) - origin.y) * inv_direction.y;
+    const auto t1_z =
+        (simd::load_aligned(node.max_z.data()) - origin.z) * inv_direction.z;
+    t_entry = simd::max(
+        simd::max(simd::min(t0_x, t1_x), simd::min(t0_y, t1_y)),
+        simd::max(simd::min(t0_z, t1_z), t_min));
+    const auto t_exit =
+        simd::min(simd::min(simd::max(t0_x, t1_x), simd::max(t0_y, t1_y)),
+                  simd::min(simd::max(t0_z, t1_z), t_max));
+    // The unused lanes hold arbitrary bounds
+    return simd::bits(t_entry <= t_exit) & ((1u << node.child_count) - 1);
+}
+
+struct Wide_stack_entry
+{
+    u32 first;
+    // Number of primitives of a leaf, 0 for a node
+    u32 count;
+    f32 t_entry;
+};
+
+// Pushes the children of the node in hit_bits, the farthest first so that the
+// nearest is popped first
+FORCE_INLINE void push_children(const Bvh8_node &node,
+                                u32 hit_bits,
+                                vf32 t_entry,
+                                Wide_stack_entry *stack,
+                                u32 &stack_size)
+{
+    alignas(32) f32 distances[8];
+    simd::store_aligned(distances, t_entry);
+    const auto begin = stack_size;
+    for (; hit_bits != 0; hit_bits &= hit_bits - 1)
+    {
+        const auto c = static_cast<u32>(std::countr_zero(hit_bits));
+        const Wide_stack_entry entry {.first = node.first[c],
+                                      .count = node.count[c],
+                                      .t_entry = distances[c]};
+        // Insertion sort by decreasing distance
+        auto i = stack_size++;
+        for (; i > begin && stack[i - 1].t_entry < entry.t_entry; --i)
+        {
+            stack[i] = stack[i - 1];
+        }
+        stack[i] = entry;
+    }
+}
+
+[[nodiscard]] FORCE_INLINE f32 safe_inverse(f32 x) noexcept
+{
+    constexpr f32 epsilon {1e-12f};
+    return 1.0f / (x >= 0.0f ? math::max(x, epsilon) : math::min(x, -epsilon));
+}
+
+[[nodiscard]] FORCE_INLINE vf32 safe_inverse(vf32 x) noexcept
+{
+    const auto epsilon = simd::broadcast(1e-12f);
+    return simd::broadcast(1.0f) /
+           simd::select(simd::min(x, -epsilon),
+                        simd::max(x, epsilon),
+                        x >= simd::zero());
+}
+
+[[nodiscard]] FORCE_INLINE vf32v3 broadcast(f32v3 v) noexcept
+{
+    return {simd::broadcast(v.x), simd::broadcast(v.y), simd::broadcast(v.z)};
+}
+
+constexpr void intersect_triangle(const Ray &ray,
+                                  const Triangle_soa &triangles,
+                                  u32 triangle_id,
+                                  u32 instance_id,
+                                  f32 t_min,
+                                  f32 &t_max,
+                                  Ray_payload &payload)
+{
+    // Möller-Trumbore
+
+    constexpr f32 epsilon {1e-8f};
+    const auto [vertex0, edge1, edge2] = triangle_edges(triangles, triangle_id);
+    const auto h = vec::cross(ray.direction, edge2);
+    const auto a = vec::dot(edge1, h);
+    if (a > -epsilon && a < epsilon) [[unlikely]]
+    {
+        // The ray is parallel to the triangle
+        return;
+    }
+    const auto f = 1.0f / a;
+    const auto s = ray.origin - vertex0;
+    const auto u = f * vec::dot(s, h);
+    const auto q = vec::cross(s, edge1);
+    const auto v = f * vec::dot(ray.direction, q);
+    const auto t = f * vec::dot(edge2, q);
+    const auto hit_condition = (u >= 0.0f) & (u <= 1.0f) & (v >= 0.0f) &
+                               (u + v <= 1.0f) & (t > t_min) & (t < t_max);
+    if (hit_condition) [[unlikely]]
+    {
+        t_max = t;
+        payload.u = u;
+        payload.v = v;
+        payload.primitive_id = triangle_id;
+        payload.instance_id = instance_id;
+    }
+}
+
+// Any-hit version of the test above, which only reports whether there is an
+// intersection in (t_min, t_max)
+[[nodiscard]] constexpr bool intersects(const Ray &ray,
+                                        const Triangle_soa &triangles,
+                                        u32 triangle_id,
+                                        f32 t_min,
+                                        f32 t_max)
+{
+    constexpr f32 epsilon {1e-8f};
+    const auto [vertex0, edge1, edge2] = triangle_edges(triangles, triangle_id);
+    const auto h = vec::cross(ray.direction, edge2);
+    const auto a = vec::dot(edge1, h);
+    if (a > -epsilon && a < epsilon) [[unlikely]]
+    {
+        return false;
+    }
+    const auto f = 1.0f / a;
+    const auto s = ray.origin - vertex0;
+    const auto u = f * vec::dot(s, h);
+    const auto q = vec::cross(s, edge1);
+    const auto v = f * vec::dot(ray.direction, q);
+    const auto t = f * vec::dot(edge2, q);
+    return (u >= 0.0f) & (u <= 1.0f) & (v >= 0.0f) & (u + v <= 1.0f) &
+           (t > t_min) & (t < t_max);
+}
+
+struct Packet_payload8
+{
+    vf32 t;
+    vf32 u;
+    vf32 v;
+    // Bit patterns of the primitive and instance indices
+    vf32 primitive_id;
+    vf32 instance_id;
+};
+
+// Returns the mask of the rays that hit the box, and their entry distances
+[[nodiscard]] FORCE_INLINE simd::mask intersect(const vf32v3 &origin,
+                                                const vf32v3 &inv_direction,
+                                                const Bvh_node &node,
+                                                vf32 t_min,
+                                                vf32 t_max,
+                                                vf32 &t_entry)
+{
+    const auto t0_x = (simd::broadcast(node.aabb_min.x) - origin.x) *
+                      inv_direction.x;
+    const auto t0_y = (simd::broadcast(node.aabb_min.y) - origin.y) *
+                      inv_direction.y;
+    const auto t0_z = (simd::broadcast(node.aabb_min.z) - origin.z) *
+                      inv_direction.z;
+    const auto t1_x = (simd::broadcast(node.aabb_max.x) - origin.x) *
+                      inv_direction.x;
+    const auto t1_y = (simd::broadcast(node.aabb_max.y) - origin.y) *
+                      inv_direction.y;
+    const auto t1_z = (simd::broadcast(node.aabb_max.z) - origin.z) *
+                      inv_direction.z;
+    t_entry = simd::max(
+        simd::max(simd::min(t0_x, t1_x), simd::min(t0_y, t1_y)),
+        simd::max(simd::min(t0_z, t1_z), t_min));
+    const auto t_exit =
+        simd::min(simd::min(simd::max(t0_x, t1_x), simd::max(t0_y, t1_y)),
+                  simd::min(simd::max(t0_z, t1_z), t_max));
+    return t_entry <= t_exit;
+}
+
+FORCE_INLINE void intersect_triangle(const Packet8 &rays,
+                                     const Triangle_soa &triangles,
+                                     u32 triangle_id,
+                                     u32 instance_id,
+                                     vf32 t_min,
+                                     Packet_payload8 &payload)
+{
+    // Möller-Trumbore, one triangle against the 8 rays
+
+    const auto epsilon = simd::broadcast(1e-8f);
+    const auto triangle = triangle_edges(triangles, triangle_id);
+    const auto vertex0 = broadcast(triangle.vertex0);
+    const auto edge1 = broadcast(triangle.edge1);
+    const auto edge2 = broadcast(triangle.edge2);
+    const auto h = vec::cross(rays.direction, edge2);
+    const auto a = vec::dot(edge1, h);
+    const auto f = simd::broadcast(1.0f) / a;
+    const auto s = rays.origin - vertex0;
+    const auto u = f * vec::dot(s, h);
+    const auto q = vec::cross(s, edge1);
+    const auto v = f * vec::dot(rays.direction, q);
+    const auto t = f * vec::dot(edge2, q);
+    const auto hit_mask = (simd::abs(a) >= epsilon) & (u >= simd::zero()) &
+                          (u <= simd::broadcast(1.0f)) &
+                          (v >= simd::zero()) &
+                          (u + v <= simd::broadcast(1.0f)) & (t > t_min) &
+                          (t < payload.t);
+    if (simd::none(hit_mask)) [[likely]]
+    {
+        return;
+    }
+    payload.t = simd::select(payload.t, t, hit_mask);
+    payload.u = simd::select(payload.u, u, hit_mask);
+    payload.v = simd::select(payload.v, v, hit_mask);
+    payload.primitive_id = simd::select(
+        payload.primitive_id, simd::broadcast_bits(triangle_id), hit_mask);
+    payload.instance_id = simd::select(
+        payload.instance_id, simd::broadcast_bits(instance_id), hit_mask);
+}
+
+// Visits the leaves of the 8-wide BVH that the ray enters before t, nearest
+// first. visit_leaf(first, count) tests the primitives of a leaf, can shorten
+// t, and returns true to end the traversal. Returns whether it was ended
+template <typename F>
+FORCE_INLINE bool
+traverse(const Ray &ray, const Bvh &bvh, f32 t_min, const f32 &t, F visit_leaf)
+{
+    if (bvh.wide_nodes.empty())
+    {
+        return false;
+    }
+    // A root leaf, such as the single instance of a scene without instancing,
+    // is visited directly: its primitives test their own bounds, and the
+    // traversal setup would cost as much as the rest of a small scene
+    if (const auto &root = bvh.nodes.front(); root.count > 0)
+    {
+        return visit_leaf(root.first, root.count);
+    }
+
+    const auto origin = broadcast(ray.origin);
+    const auto inv_direction = broadcast({safe_inverse(ray.direction.x),
+                                          safe_inverse(ray.direction.y),
+                                          safe_inverse(ray.direction.z)});
+    const auto t_min_v = simd::broadcast(t_min);
+
+    Wide_stack_entry stack[bvh8_stack_size];
+    u32 stack_size {};
+    stack[stack_size++] = {.first = 0, .count = 0, .t_entry = t_min};
+
+    // Front-to-back traversal: the children hit by the ray are pushed with
+    // their entry distances, nearest on top, and the ones behind the closest
+    // hit found so far are culled when they are popped
+    while (stack_size > 0)
+    {
+        const auto entry = stack[--stack_size];
+        if (entry.t_entry >= t)
+        {
+            continue;
+        }
+        if (entry.count > 0)
+        {
+            if (visit_leaf(entry.first, entry.count))
+            {
+                return true;
+            }
+            continue;
+        }
+        const auto &node = bvh.wide_nodes[entry.first];
+        vf32 t_entry {};
+        const auto hit_bits = intersect(
+            origin, inv_direction, node, t_min_v, simd::broadcast(t), t_entry);
+        push_children(node, hit_bits, t_entry, stack, stack_size);
+    }
+    return false;
+}
+
+// Same as traverse() for a packet, with the binary BVH: a node is visited if
+// any ray of the packet enters it before its t, and children are ordered by
+// their nearest entry distance over the packet
+template <typename F>
+FORCE_INLINE void traverse(const Packet8 &rays,
+                           const Bvh &bvh,
+                           vf32 t_min,
+                           const vf32 &t,
+                           F visit_leaf)
+{
+    if (bvh.nodes.empty())
+    {
+        return;
+    }
+
+    const vf32v3 inv_direction {safe_inverse(rays.direction.x),
+                                safe_inverse(rays.direction.y),
+                                safe_inverse(rays.direction.z)};
+
+    struct Stack_entry
+    {
+        u32 node_index;
+        f32 t_entry;
+    };
+    Stack_entry stack[bvh_stack_size];
+    u32 stack_size {};
+
+    vf32 t_entry {};
+    if (!simd::none(intersect(rays.origin,
+                              inv_direction,
+                              bvh.nodes.front(),
+                              t_min,
+                              t,
+                              t_entry)))
+    {
+        stack[stack_size++] = {0, simd::reduce_min(t_entry)};
+    }
+
+    while (stack_size > 0)
+    {
+        const auto entry = stack[--stack_size];
+        if (entry.t_entry >= simd::reduce_max(t))
+        {
+            continue;
+        }
+        auto node_index = entry.node_index;
+        for (;;)
+        {
+            const auto &node = bvh.nodes[node_index];
+            if (node.count > 0)
+            {
+                visit_leaf(node.first, node.count);
+                break;
+            }
+
+            auto near_index = node.first;
+            auto far_index = node.first + 1;
+            vf32 t_entry_near {};
+            vf32 t_entry_far {};
+            const auto near_mask = intersect(rays.origin,
+                                             inv_direction,
+                                             bvh.nodes[near_index],
+                                             t_min,
+                                             t,
+                                             t_entry_near);
+            const auto far_mask = intersect(rays.origin,
+                                            inv_direction,
+                                            bvh.nodes[far_index],
+                                            t_min,
+                                            t,
+                                            t_entry_far);
+            const auto miss = simd::broadcast(t_miss);
+            auto t_near =
+                simd::reduce_min(simd::select(miss, t_entry_near, near_mask));
+            auto t_far =
+                simd::reduce_min(simd::select(miss, t_entry_far, far_mask));
+            if (t_far < t_near)
+            {
+                std::swap(near_index, far_index);
+                std::swap(t_near, t_far);
+            }
+            if (t_near == t_miss)
+            {
+                break;
+            }
+            if (t_far != t_miss)
+            {
+                stack[stack_size++] = {far_index, t_far};
+            }
+            node_index = near_index;
+        }
+    }
+}
+
+// The ray in the space of the object of the instance. The direction is not
+// normalized, so that distances along the ray are the same in both spaces
+[[nodiscard]] FORCE_INLINE Ray object_ray(const Ray &ray,
+                                          const Instance &instance)
+{
+    return {.origin = transform_point(instance.world_to_object, ray.origin),
+            .direction =
+                transform_vector(instance.world_to_object, ray.direction)};
+}
+
+[[nodiscard]] FORCE_INLINE Packet8 object_rays(const Packet8 &rays,
+                                               const Instance &instance)
+{
+    const auto &transform = instance.world_to_object;
+    const auto x = broadcast(transform.x);
+    const auto y = broadcast(transform.y);
+    const auto z = broadcast(transform.z);
+    const auto linear = [&](const vf32v3 &v)
+    { return x * v.x + y * v.y + z * v.z; };
+    return {.origin = linear(rays.origin) + broadcast(transform.translation),
+            .direction = linear(rays.direction)};
+}
+
+} // namespace
+
+template <Isa isa>
+Ray_payload kernels::intersect(const Ray &ray, const Scene_geometry &geometry)
+{
+    static_assert(isa == compiled_isa);
+    constexpr f32 t_min {1e-6f};
+    f32 t {t_miss};
+    Ray_payload payload {};
+    payload.primitive_id = 0xffffffffu;
+
+    // Distances along the ray are the same in every space, so that the closest
+    // hit found so far also culls the nodes of the next objects
+    traverse(ray,
+             geometry.bvh,
+             t_min,
+             t,
+             [&](u32 first_instance, u32 instance_count)
+             {
+                 for (auto i = first_instance;
+                      i < first_instance + instance_count;
+                      ++i)
+                 {
+                     const auto &instance = geometry.instances[i];
+                     const auto &object = geometry.objects[instance.object_id];
+                     const auto local_ray = object_ray(ray, instance);
+                     traverse(local_ray,
+                              object.bvh,
+                              t_min,
+                              t,
+                              [&](u32 first, u32 count)
+                              {
+                                  for (auto j = first; j < first + count; ++j)
+                                  {
+                                      intersect_triangle(local_ray,
+                                                         object.triangles,
+                                                         j,
+                                                         i,
+                                                         t_min,
+                                                         t,
+                                                         payload);
+                                  }
+                                  return false;
+                              });
+                 }
+                 return false;
+             });
+
+    // Interpolated from the vertices rather than computed as
+    // origin + t * direction, whose error grows with the distance to the
+    // origin and can place the point below the surface
+    if (payload.primitive_id != 0xffffffffu)
+    {
+        payload.position = surface_point(geometry,
+                                         payload.instance_id,
+                                         payload.primitive_id,
+                                         payload.u,
+                                         payload.v);
+    }
+    return payload;
+}
+
+template <Isa isa>
+bool kernels::occluded(const Ray &ray,
+                       f32 t_max,
+                       const Scene_geometry &geometry)
+{
+    static_assert(isa == compiled_isa);
+    constexpr f32 t_min {1e-6f};
+
+    // Any hit terminates the traversal and t_max never shrinks, but visiting
+    // the nearer children first still finds blockers close to the origin
+    // sooner
+    return traverse(
+        ray,
+        geometry.bvh,
+        t_min,
+        t_max,
+        [&](u32 first_instance, u32 instance_count)
+        {
+            for (auto i = first_instance; i < first_instance + instance_count;
+                 ++i)
+            {
+                const auto &instance = geometry.instances[i];
+                const auto &object = geometry.objects[instance.object_id];
+                const auto local_ray = object_ray(ray, instance);
+                if (traverse(local_ray,
+                             object.bvh,
+                             t_min,
+                             t_max,
+                             [&](u32 first, u32 count)
+                             {
+                                 for (auto j = first; j < first + count; ++j)
+                                 {
+                                     if (intersects(local_ray,
+                                                    object.triangles,
+                                                    j,
+                                                    t_min,
+                                                    t_max))
+                                     {
+                                         return true;
+                                     }
+                                 }
+                                 return false;
+                             }))
+                {
+                    return true;
+                }
+            }
+            return false;
+        });
+}
+
+template <Isa isa>
+std::array<Ray_payload, 8> kernels::intersect8(const Ray_packet8 &packet,
+                                               const Scene_geometry &geometry)
+{
+    static_assert(isa == compiled_isa);
+    const auto rays = load_packet(packet);
+    const auto t_min = simd::broadcast(1e-6f);
+    Packet_payload8 payload {
+        .t = simd::broadcast(std::numeric_limits<f32>::max()),
+        .u = simd::zero(),
+        .v = simd::zero(),
+        .primitive_id = simd::broadcast_bits(0xffffffffu),
+        .instance_id = simd::broadcast_bits(0xffffffffu)};
+
+    traverse(rays,
+             geometry.bvh,
+             t_min,
+             payload.t,
+             [&](u32 first_instance, u32 instance_count)
+             {
+                 for (auto i = first_instance;
+                      i < first_instance + instance_count;
+                      ++i)
+                 {
+                     const auto &instance = geometry.instances[i];
+                     const auto &object = geometry.objects[instance.object_id];
+                     const auto local_rays = object_rays(rays, instance);
+                     traverse(local_rays,
+                              object.bvh,
+                              t_min,
+                              payload.t,
+                              [&](u32 first, u32 count)
+                              {
+                                  for (auto j = first; j < first + count; ++j)
+                                  {
+                                      intersect_triangle(local_rays,
+                                                         object.triangles,
+                                                         j,
+                                                         i,
+                                                         t_min,
+                                                         payload);
+                                  }
+                              });
+                 }
+             });
+
+    alignas(32) f32 u[8];
+    alignas(32) f32 v[8];
+    alignas(32) f32 primitive_id[8];
+    alignas(32) f32 instance_id[8];
+    simd::store_aligned(u, payload.u);
+    simd::store_aligned(v, payload.v);
+    simd::store_aligned(primitive_id, payload.primitive_id);
+    simd::store_aligned(instance_id, payload.instance_id);
+
+    std::array<Ray_payload, 8> payloads {};
+    for (std::size_t i {}; i < payloads.size(); ++i)
+    {
+        payloads[i] = {.position = {},
+                       .u = u[i],
+                       .v = v[i],
+                       .primitive_id = std::bit_cast<u32>(primitive_id[i]),
+                       .instance_id = std::bit_cast<u32>(instance_id[i])};
+        if (payloads[i].primitive_id != 0xffffffffu)
+        {
+            payloads[i].position = surface_point(geometry,
+                                                 payloads[i].instance_id,
+                                                 payloads[i].primitive_id,
+                                                 u[i],
+                                                 v[i]);
+        }
+    }
+    return payloads;
+}
+
+template Ray_payload
+kernels::intersect<compiled_isa>(const Ray &, const Scene_geometry &);
+
+template bool
+kernels::occluded<compiled_isa>(const Ray &, f32, const Scene_geometry &);
+
+template std::array<Ray_payload, 8>
+kernels::intersect8<compiled_isa>(const Ray_packet8 &, const Scene_geometry &);
@@ -0,0 +1,233 @@
+#include "definitions.hpp"
+#include "kernels.hpp"
+#include "random.hpp"
+#include "render.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Compares intersect(), intersect8() and occluded(), which traverse the BVHs,
+// with a brute force test of every triangle of every instance, on random rays
+// through the scenes, with the kernels of every instruction set of the CPU
+
+namespace
+{
+
+constexpr f32 t_min {1e-6f};
+constexpr f32 t_miss {std::numeric_limits<f32>::max()};
+
+// Closest distance along the ray to a triangle of the scene in (t_min, t_max),
+// with the arithmetic of the kernels, or t_miss
+[[nodiscard]] f32
+brute_force_intersect(const Ray &ray, const Scene_geometry &geometry, f32 t_max)
+{
+    auto t_closest = t_max;
+    for (const auto &instance : geometry.instances)
+    {
+        const Ray local_ray {
+            .origin = transform_point(instance.world_to_object, ray.origin),
+            .direction =
+                transform_vector(instance.world_to_object, ray.direction)};
+        const auto &triangles = geometry.objects[instance.object_id].triangles;
+        for (u32 i {}; i < triangles.indices.size(); ++i)
+        {
+            // Möller-Trumbore
+            constexpr f32 epsilon {1e-8f};
+            const auto [vertex0, edge1, edge2] = triangle_edges(triangles, i);
+            const auto h = vec::cross(local_ray.direction, edge2);
+            const auto a = vec::dot(edge1, h);
+            if (a > -epsilon && a < epsilon)
+            {
+                continue;
+            }
+            const auto f = 1.0f / a;
+            const auto s = local_ray.origin - vertex0;
+            const auto u = f * vec::dot(s, h);
+            const auto q = vec::cross(s, edge1);
+            const auto v = f * vec::dot(local_ray.direction, q);
+            const auto t = f * vec::dot(edge2, q);
+            if (u >= 0.0f && u <= 1.0f && v >= 0.0f && u + v <= 1.0f &&
+                t > t_min && t < t_closest)
+            {
+                t_closest = t;
+            }
+        }
+    }
+    return t_closest < t_max ? t_closest : t_miss;
+}
+
+// Distance along the ray to the hit of the payload, or t_miss
+[[nodiscard]] f32 payload_distance(const Ray &ray, const Ray_payload &payload)
+{
+    if (payload.primitive_id == 0xffffffffu)
+    {
+        return t_miss;
+    }
+    return vec::length(payload.position - ray.origin) /
+           vec::length(ray.direction);
+}
+
+// Hits on edges shared by two triangles may be reported on either, and the
+// position is interpolated rather than computed from the distance
+[[nodiscard]] bool same_distance(f32 a, f32 b)
+{
+    if (a == t_miss || b == t_miss)
+    {
+        return a == b;
+    }
+    return std::abs(a - b) <= 1e-3f * std::max(1.0f, std::max(a, b));
+}
+
+// Rays from random points around the scene towards random points inside it,
+// so that most of them hit
+[[nodiscard]] std::vector<Ray>
+generate_rays(const Scene_geometry &geometry, std::size_t count, u32 rng_state)
+{
+    const auto &root = geometry.bvh.nodes.front();
+    const auto extent = root.aabb_max - root.aabb_min;
+    const auto random_point = [&](f32 margin)
+    {
+        return root.aabb_min - margin * extent +
+               (1.0f + 2.0f * margin) * extent *
+                   f32v3 {random(rng_state),
+                          random(rng_state),
+                          random(rng_state)};
+    };
+    std::vector<Ray> rays(count);
+    for (auto &ray : rays)
+    {
+        ray.origin = random_point(0.5f);
+        const auto target = random_point(0.0f);
+        ray.direction = vec::normalize(target - ray.origin);
+    }
+    return rays;
+}
+
+// Returns the number of rays on which the kernels disagree with brute force
+[[nodiscard]] std::size_t check_scene(std::string_view scene_name,
+                                      const Scene &scene,
+                                      std::size_t ray_count)
+{
+    const auto &geometry = scene.geometry;
+    const auto rays = generate_rays(geometry, ray_count, seed(12345));
+    std::vector<f32> expected(rays.size());
+    std::size_t hit_count {};
+    for (std::size_t i {}; i < rays.size(); ++i)
+    {
+        expected[i] = brute_force_intersect(rays[i], geometry, t_miss);
+        hit_count += expected[i] != t_miss;
+    }
+
+    std::size_t failure_count {};
+    const auto fail = [&](std::string_view query, std::size_t i, f32 t)
+    {
+        if (failure_count++ < 8)
+        {
+            std::cerr << scene_name << ", "
+                      << isa_names[static_cast<int>(active_kernels().isa)]
+                      << ": " << query << " of ray " << i << " gives " << t
+                      << ", brute force " << expected[i] << '\n';
+        }
+    };
+
+    for (std::size_t i {}; i < rays.size(); ++i)
+    {
+        const auto t = payload_distance(rays[i], intersect(rays[i], geometry));
+        if (!same_distance(t, expected[i]))
+        {
+            fail("intersect()", i, t);
+        }
+    }
+
+    for (std::size_t p {}; p + 8 <= rays.size(); p += 8)
+    {
+        std::array<Ray, 8> packet_rays {};
+        std::copy_n(rays.begin() + static_cast<std::ptrdiff_t>(p),
+                    8,
+                    packet_rays.begin());
+        const auto payloads = intersect8(make_packet(packet_rays), geometry);
+        for (std::size_t k {}; k < 8; ++k)
+        {
+            const auto t = payload_distance(packet_rays[k], payloads[k]);
+            if (!same_distance(t, expected[p + k]))
+            {
+                fail("intersect8()", p + k, t);
+            }
+        }
+    }
+
+    // Just before and after the closest hit, far enough from it that both
+    // queries see the same triangles
+    for (std::size_t i {}; i < rays.size(); ++i)
+    {
+        const auto t_hit = expected[i];
+        const auto t_before = t_hit == t_miss ? 1e30f : 0.99f * t_hit;
+        const bool expected_before {
+            t_hit != t_miss &&
+            brute_force_intersect(rays[i], geometry, t_before) != t_miss};
+        if (occluded(rays[i], t_before, geometry) != expected_before)
+        {
+            fail("occluded() before the hit", i, t_before);
+        }
+        if (t_hit != t_miss && !occluded(rays[i], 1.01f * t_hit, geometry))
+        {
+            fail("occluded() after the hit", i, 1.01f * t_hit);
+        }
+    }
+
+    std::cout << scene_name << ", "
+              << isa_names[static_cast<int>(active_kernels().isa)] << ": "
+              << rays.size() << " rays, " << hit_count << " hits, "
+              << failure_count << " failures\n";
+    return failure_count;
+}
+
+} // namespace
+
+int main()
+{
+    struct Test_scene
+    {
+        std::string_view name;
+        Vertex_format vertex_format;
+        std::size_t ray_count;
+    };
+    constexpr Test_scene test_scenes[] {
+        {"cornell_box", Vertex_format::full, 1 << 14},
+        {"sphere_16", Vertex_format::full, 1 << 12},
+        {"sphere_16", Vertex_format::quantized, 1 << 12},
+        {"instances_3", Vertex_format::full, 1 << 9}};
+
+    Thread_pool thread_pool {};
+    std::size_t failure_count {};
+    for (const auto &test_scene : test_scenes)
+    {
+        const auto scene =
+            load_scene(test_scene.name, test_scene.vertex_format, thread_pool);
+        if (!scene.has_value())
+        {
+            std::cerr << "Failed to load scene \"" << test_scene.name
+                      << "\"\n";
+            return EXIT_FAILURE;
+        }
+        for (auto isa = static_cast<int>(detect_isa()); isa >= 0; --isa)
+        {
+            if (!select_kernels(static_cast<Isa>(isa)))
+            {
+                return EXIT_FAILURE;
+            }
+            const auto label =
+                std::string(test_scene.name) + ", " +
+                vertex_format_names[static_cast<int>(test_scene.vertex_format)];
+            failure_count += check_scene(label, *scene, test_scene.ray_count);
+        }
+    }
+    return failure_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -5,6 +5,8 @@
 #include "math.hpp"
 #include "simd.hpp"
 
+#include <concepts>
+
 template <typename T>
 struct v3
 {
@@ -15,6 +17,8 @@ struct v3
 
 using f32v3 = v3<f32>;
 using vf32v3 = v3<vf32>;
+using u16v3 = v3<u16>;
+using u32v3 = v3<u32>;
 
 template <typename T>
 [[nodiscard]] FORCE_INLINE constexpr v3<T> operator+(v3<T> a)
@@ -188,6 +192,35 @@ template <>
     return a * (1.0f / vec::length(a));
 }
 
+template <>
+[[nodiscard]] FORCE_INLINE v3<vf32> normalize(v3<vf32> a)
+{
+    return a * (simd::broadcast(1.0f) / vec::length(a));
+}
+
+// Builds tangents such that (tangent, bitangent, n) is a right-handed
+// orthonormal basis, n being normalized. Branch-free, from "Building an
+// Orthonormal Basis, Revisited" by Duff et al.
+template <typename T>
+FORCE_INLINE void
+orthonormal_basis(v3<T> n, v3<T> &tangent, v3<T> &bitangent)
+{
+    T one {};
+    if constexpr (std::same_as<T, vf32>)
+    {
+        one = simd::broadcast(1.0f);
+    }
+    else
+    {
+        one = 1.0f;
+    }
+    const auto sign = math::copysign(one, n.z);
+    const auto a = -one / (sign + n.z);
+    const auto b = n.x * n.y * a;
+    tangent = {one + sign * n.x * n.x * a, sign * b, -sign * n.x};
+    bitangent = {b, sign + n.y * n.y * a, -n.y};
+}
+
 } // namespace vec
 
 #endif // VEC_HPP
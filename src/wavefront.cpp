@@ -0,0 +1,346 @@
+#include "wavefront.hpp"
+
+#include "memory.hpp"
+#include "path.hpp"
+#include "ray_sort.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+namespace
+{
+
+// Paths processed by one task of a stage, a multiple of the packet size
+constexpr std::size_t chunk_size {256};
+
+// Rays of the paths that are still alive. The sampler and the radiance of a
+// path stay in its slot, the index of its pixel sample, so that only the state
+// needed by the next bounce is moved by compaction
+struct Path_queue
+{
+    Aligned_vector<f32v3> origins;
+    Aligned_vector<f32v3> directions;
+    Aligned_vector<f32v3> reflectances;
+    Aligned_vector<f32> bounce_pdfs;
+    Aligned_vector<u32> slots;
+};
+
+// Light connections of the current bounce, at most one per path, stored at the
+// position of the path with a t_max of 0 for none
+struct Shadow_queue
+{
+    Aligned_vector<f32v3> origins;
+    Aligned_vector<f32v3> directions;
+    Aligned_vector<f32> t_maxs;
+    Aligned_vector<f32v3> contributions;
+};
+
+[[nodiscard]] Path_queue make_path_queue(std::size_t size)
+{
+    return {.origins = Aligned_vector<f32v3>(size),
+            .directions = Aligned_vector<f32v3>(size),
+            .reflectances = Aligned_vector<f32v3>(size),
+            .bounce_pdfs = Aligned_vector<f32>(size),
+            .slots = Aligned_vector<u32>(size)};
+}
+
+[[nodiscard]] Shadow_queue make_shadow_queue(std::size_t size)
+{
+    return {.origins = Aligned_vector<f32v3>(size),
+            .directions = Aligned_vector<f32v3>(size),
+            .t_maxs = Aligned_vector<f32>(size),
+            .contributions = Aligned_vector<f32v3>(size)};
+}
+
+FORCE_INLINE void copy_path(const Path_queue &source,
+                           std::size_t i,
+                           Path_queue &destination,
+                           std::size_t j)
+{
+    destination.origins[j] = source.origins[i];
+    destination.directions[j] = source.directions[i];
+    destination.reflectances[j] = source.reflectances[i];
+    destination.bounce_pdfs[j] = source.bounce_pdfs[i];
+    destination.slots[j] = source.slots[i];
+}
+
+[[nodiscard]] constexpr u32 chunk_count(std::size_t size) noexcept
+{
+    return static_cast<u32>((size + chunk_size - 1) / chunk_size);
+}
+
+// Moves the first chunk_sizes[c] paths of every chunk c of source to the front
+// of destination, in order, and returns their number
+[[nodiscard]] std::size_t compact(const Path_queue &source,
+                                  const std::vector<u32> &chunk_sizes,
+                                  Path_queue &destination,
+                                  Thread_pool &thread_pool)
+{
+    std::vector<std::size_t> offsets(chunk_sizes.size());
+    std::size_t size {};
+    for (std::size_t c {}; c < chunk_sizes.size(); ++c)
+    {
+        offsets[c] = size;
+        size += chunk_sizes[c];
+    }
+    thread_pool.parallel_for(
+        static_cast<u32>(chunk_sizes.size()),
+        [&](u32 chunk)
+        {
+            const auto begin = chunk * chunk_size;
+            const auto end = begin + chunk_sizes[chunk];
+            const auto offset = offsets[chunk];
+            for (auto i = begin, j = offset; i < end; ++i, ++j)
+            {
+                copy_path(source, i, destination, j);
+            }
+        });
+    return size;
+}
+
+// Reorders the first size paths by ray_sort_key(), through scratch
+void sort_paths(Path_queue &paths,
+                std::size_t size,
+                Path_queue &scratch,
+                const Bvh &bvh,
+                Thread_pool &thread_pool)
+{
+    const auto &root = bvh.nodes.front();
+    std::vector<u32> keys(size);
+    thread_pool.parallel_for(
+        chunk_count(size),
+        [&](u32 chunk)
+        {
+            const auto begin = chunk * chunk_size;
+            const auto end = std::min(begin + chunk_size, size);
+            for (auto i = begin; i < end; ++i)
+            {
+                keys[i] = ray_sort_key({.origin = paths.origins[i],
+                                        .direction = paths.directions[i]},
+                                       root.aabb_min,
+                                       root.aabb_max);
+            }
+        });
+    const auto order = sort_keys(keys, thread_pool);
+    thread_pool.parallel_for(
+        chunk_count(size),
+        [&](u32 chunk)
+        {
+            const auto begin = chunk * chunk_size;
+            const auto end = std::min(begin + chunk_size, size);
+            for (auto i = begin; i < end; ++i)
+            {
+                copy_path(paths, order[i], scratch, i);
+            }
+        });
+    std::swap(paths, scratch);
+}
+
+} // namespace
+
+void trace_paths_wavefront(const Scene &scene,
+                           int image_width,
+                           int image_height,
+                           std::span<const u32> pixel_indices,
+                           std::span<Sampler> samplers,
+                           std::span<f32v3> colors,
+                           bool sort_rays,
+                           Thread_pool &thread_pool)
+{
+    trace_paths_wavefront(scene,
+                          image_width,
+                          image_height,
+                          pixel_indices,
+                          samplers,
+                          colors,
+                          {},
+                          sort_rays,
+                          thread_pool);
+}
+
+void trace_paths_wavefront(const Scene &scene,
+                           int image_width,
+                           int image_height,
+                           std::span<const u32> pixel_indices,
+                           std::span<Sampler> samplers,
+                           std::span<f32v3> colors,
+                           std::span<Ray_payload> primary_payloads,
+                           bool sort_rays,
+                           Thread_pool &thread_pool)
+{
+    const auto path_count = pixel_indices.size();
+    auto paths = make_path_queue(path_count);
+    // Written by the shading stage, each chunk at the start of its own range,
+    // then compacted into paths
+    auto shaded_paths = make_path_queue(path_count);
+    auto shadow_rays = make_shadow_queue(path_count);
+    std::vector<Ray_payload> payloads(path_count);
+    std::vector<u32> path_chunk_sizes;
+
+    // Generate: one camera ray per pixel sample
+    thread_pool.parallel_for(
+        chunk_count(path_count),
+        [&](u32 chunk)
+        {
+            const auto begin = chunk * chunk_size;
+            const auto end = std::min(begin + chunk_size, path_count);
+            for (auto i = begin; i < end; ++i)
+            {
+                const auto pixel_index = static_cast<int>(pixel_indices[i]);
+                const auto path =
+                    start_path(generate_ray(scene.camera,
+                                            pixel_index / image_width,
+                                            pixel_index % image_width,
+                                            image_width,
+                                            image_height,
+                                            samplers[i]));
+                paths.origins[i] = path.ray.origin;
+                paths.directions[i] = path.ray.direction;
+                paths.reflectances[i] = path.reflectance;
+                paths.bounce_pdfs[i] = path.bounce_pdf;
+                paths.slots[i] = static_cast<u32>(i);
+                colors[i] = path.color;
+            }
+        });
+
+    auto size = path_count;
+    for (int depth {}; size > 0; ++depth)
+    {
+        const auto chunks = chunk_count(size);
+
+        // Extend: closest hit of every ray. Camera rays are coherent enough to
+        // be traced as packets
+        thread_pool.parallel_for(
+            chunks,
+            [&](u32 chunk)
+            {
+                const auto begin = chunk * chunk_size;
+                const auto end = std::min(begin + chunk_size, size);
+                auto i = begin;
+                if (depth == 0)
+                {
+                    for (; i + 8 <= end; i += 8)
+                    {
+                        std::array<Ray, 8> rays {};
+                        for (std::size_t k {}; k < rays.size(); ++k)
+                        {
+                            rays[k] = {.origin = paths.origins[i + k],
+                                       .direction = paths.directions[i + k]};
+                        }
+                        const auto packet_payloads =
+                            intersect8(make_packet(rays), scene.geometry);
+                        std::copy(packet_payloads.begin(),
+                                  packet_payloads.end(),
+                                  payloads.begin() +
+                                      static_cast<std::ptrdiff_t>(i));
+                    }
+                }
+                for (; i < end; ++i)
+                {
+                    payloads[i] = intersect({.origin = paths.origins[i],
+                                             .direction = paths.directions[i]},
+                                            scene.geometry);
+                }
+                // The camera rays are still in slot order
+                if (depth == 0 && !primary_payloads.empty())
+                {
+                    std::copy(payloads.begin() +
+                                  static_cast<std::ptrdiff_t>(begin),
+                              payloads.begin() +
+                                  static_cast<std::ptrdiff_t>(end),
+                              primary_payloads.begin() +
+                                  static_cast<std::ptrdiff_t>(begin));
+                }
+            });
+
+        // Shade: emission, light sample and bounce of every vertex. The paths
+        // that continue are written at the start of the chunk's range, and
+        // counted per chunk
+        path_chunk_sizes.assign(chunks, 0);
+        thread_pool.parallel_for(
+            chunks,
+            [&](u32 chunk)
+            {
+                const auto begin = chunk * chunk_size;
+                const auto end = std::min(begin + chunk_size, size);
+                auto path_end = begin;
+                for (auto i = begin; i < end; ++i)
+                {
+                    const auto slot = paths.slots[i];
+                    Path_state path {
+                        .ray = {.origin = paths.origins[i],
+                                .direction = paths.directions[i]},
+                        .color = colors[slot],
+                        .reflectance = paths.reflectances[i],
+                        .bounce_pdf = paths.bounce_pdfs[i],
+                        .depth = depth};
+                    Light_connection connection {};
+                    const auto alive = shade_path_vertex(
+                        scene, payloads[i], path, samplers[slot], connection);
+                    colors[slot] = path.color;
+                    shadow_rays.t_maxs[i] = connection.t_max;
+                    if (connection.t_max > 0.0f)
+                    {
+                        shadow_rays.origins[i] = connection.ray.origin;
+                        shadow_rays.directions[i] = connection.ray.direction;
+                        shadow_rays.contributions[i] = connection.contribution;
+                    }
+                    if (alive)
+                    {
+                        shaded_paths.origins[path_end] = path.ray.origin;
+                        shaded_paths.directions[path_end] = path.ray.direction;
+                        shaded_paths.reflectances[path_end] = path.reflectance;
+                        shaded_paths.bounce_pdfs[path_end] = path.bounce_pdf;
+                        shaded_paths.slots[path_end] = slot;
+                        ++path_end;
+                    }
+                }
+                path_chunk_sizes[chunk] = static_cast<u32>(path_end - begin);
+            });
+
+        // Connect: any hit of every shadow ray, whose positions in the chunk
+        // are compacted first. A path has at most one, so the colors are
+        // updated without synchronization. The paths are still in the order
+        // of the shading stage
+        thread_pool.parallel_for(
+            chunks,
+            [&](u32 chunk)
+            {
+                const auto begin = chunk * chunk_size;
+                const auto end = std::min(begin + chunk_size, size);
+                std::array<u32, chunk_size> shadow_indices {};
+                const auto shadow_count =
+                    compact_indices(&shadow_rays.t_maxs[begin],
+                                    static_cast<u32>(end - begin),
+                                    static_cast<u32>(begin),
+                                    shadow_indices.data());
+                for (u32 k {}; k < shadow_count; ++k)
+                {
+                    const auto i = shadow_indices[k];
+                    if (!occluded({.origin = shadow_rays.origins[i],
+                                   .direction = shadow_rays.directions[i]},
+                                  shadow_rays.t_maxs[i],
+                                  scene.geometry))
+                    {
+                        colors[paths.slots[i]] +=
+                            shadow_rays.contributions[i];
+                    }
+                }
+            });
+
+        // Compact: the surviving paths are packed to the front, so that the
+        // next bounce only processes live paths, contiguously
+        size = compact(shaded_paths, path_chunk_sizes, paths, thread_pool);
+
+        // Sort: bounce rays leave in random directions, so the next extension
+        // is more coherent when rays that start close to each other in the
+        // same direction are traced one after the other
+        if (sort_rays && size > 0)
+        {
+            sort_paths(
+                paths, size, shaded_paths, scene.geometry.bvh, thread_pool);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef WAVEFRONT_HPP
+#define WAVEFRONT_HPP
+
+#include "render.hpp"
+#include "sampler.hpp"
+#include "thread_pool.hpp"
+
+#include <span>
+
+// Computes the radiance of one path from each of the given pixels with a
+// wavefront integrator: instead of tracing every path to completion, all the
+// paths advance together, one stage at a time over queues of ray states stored
+// as structures of arrays. Each bounce extends every path (closest hit), shades
+// every vertex, connects the vertices to the lights (any hit) and compacts the
+// queue to the paths that are still alive. samplers[k] is the sampler of pixel
+// pixel_indices[k], and colors[k] receives its radiance. The vertices use the
+// same random numbers as the depth-first integrator, so the images match.
+// With sort_rays, the bounce rays are also reordered by ray_sort_key() before
+// every extension, which does not change the result either
+void trace_paths_wavefront(const Scene &scene,
+                           int image_width,
+                           int image_height,
+                           std::span<const u32> pixel_indices,
+                           std::span<Sampler> samplers,
+                           std::span<f32v3> colors,
+                           bool sort_rays,
+                           Thread_pool &thread_pool);
+
+// Also writes the camera ray hit of every path to primary_payloads[k], e.g.
+// for the other sample types
+void trace_paths_wavefront(const Scene &scene,
+                           int image_width,
+                           int image_height,
+                           std::span<const u32> pixel_indices,
+                           std::span<Sampler> samplers,
+                           std::span<f32v3> colors,
+                           std::span<Ray_payload> primary_payloads,
+                           bool sort_rays,
+                           Thread_pool &thread_pool);
+
+#endif // WAVEFRONT_HPP